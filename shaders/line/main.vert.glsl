@@ -0,0 +1,13 @@
+#version 330 core
+
+layout(location = 0) in vec3 pos;
+
+layout(std140) uniform frame {
+  mat4 vp;
+  vec3 cam_pos;
+  float time;
+};
+
+void main(){
+  gl_Position = vp * vec4(pos, 1);
+}
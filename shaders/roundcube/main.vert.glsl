@@ -1,12 +1,16 @@
 #version 330 core
 
 layout(location = 0) in vec3 pos;
+layout(location = 1) in mat4 model; // per instance
 out vec3 tex_cords;
 
-uniform mat4 mvp;
+layout(std140) uniform frame {
+  mat4 vp;
+  vec3 cam_pos;
+  float time;
+};
 
 void main(){
-  gl_Position = mvp * vec4(pos, 1);
+  gl_Position = vp * model * vec4(pos, 1);
   tex_cords = pos;
 }
-
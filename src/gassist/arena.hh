@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace gassist {
+
+/// Bump allocator: Hands out memory from large chunks by
+/// advancing a pointer and frees everything at once.
+///
+/// Use it for data with a common life time: reset() once
+/// per frame for per frame data, or an arena_scope around a
+/// loading step. Destructors of objects in the arena are not
+/// run; it is meant for trivially destructible data and
+/// containers using arena_allocator.
+///
+/// Chunks are kept on reset(), so an arena that has warmed
+/// up does not touch the heap at all.
+///
+/// Not thread safe.
+class arena {
+  struct chunk {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  std::vector<chunk> chunks_;
+  size_t current_ = 0, offset_ = 0;
+  size_t chunk_size_;
+  size_t heap_allocs_ = 0;
+
+public:
+  /// Position in the arena; see mark() and rewind()
+  struct marker {
+    size_t chunk, offset;
+  };
+
+  /// Allocation requests larger than chunk_size get a chunk
+  /// of their own
+  explicit arena(size_t chunk_size=1 << 20)
+    : chunk_size_{chunk_size} {}
+
+  arena(const arena&) = delete;
+  arena& operator =(const arena&) = delete;
+
+  /// Returns n bytes aligned to align (a power of two)
+  void* allocate(size_t n, size_t align=alignof(std::max_align_t)) {
+    while (true) {
+      if (current_ < chunks_.size()) {
+        chunk &c = chunks_[current_];
+        auto base = reinterpret_cast<uintptr_t>(c.data.get());
+        size_t p = ((base + offset_ + align - 1) & ~(align - 1)) - base;
+        if (p + n <= c.size) {
+          offset_ = p + n;
+          return c.data.get() + p;
+        }
+        current_++;
+        offset_ = 0;
+        continue;
+      }
+
+      size_t size = std::max(chunk_size_, n + align);
+      chunks_.push_back({std::unique_ptr<char[]>{new char[size]}, size});
+      heap_allocs_++;
+    }
+  }
+
+  /// Makes all memory available again; keeps the chunks
+  void reset() {
+    current_ = 0;
+    offset_ = 0;
+  }
+
+  /// Frees all chunks
+  void release() {
+    chunks_.clear();
+    reset();
+  }
+
+  marker mark() const { return {current_, offset_}; }
+
+  /// Frees everything allocated since m was taken
+  void rewind(const marker &m) {
+    current_ = m.chunk;
+    offset_ = m.offset;
+  }
+
+  /// Bytes handed out since the last reset (not counting
+  /// space left over at the end of chunks)
+  size_t used() const {
+    size_t r = offset_;
+    for (size_t i=0; i < current_ && i < chunks_.size(); i++)
+      r += chunks_[i].size;
+    return r;
+  }
+
+  /// Total size of all chunks
+  size_t capacity() const {
+    size_t r = 0;
+    for (auto &c : chunks_) r += c.size;
+    return r;
+  }
+
+  /// Number of chunks ever allocated from the heap
+  size_t heap_allocations() const { return heap_allocs_; }
+};
+
+/// Frees everything allocated from the arena during its
+/// life time on destruction
+class arena_scope {
+  arena &a_;
+  arena::marker m_;
+
+public:
+  explicit arena_scope(arena &a) : a_{a}, m_{a.mark()} {}
+  ~arena_scope() { a_.rewind(m_); }
+
+  arena_scope(const arena_scope&) = delete;
+  arena_scope& operator =(const arena_scope&) = delete;
+};
+
+/// Standard allocator adapter for an arena; deallocation is
+/// a no-op, the memory is reclaimed with the arena.
+template<typename T>
+class arena_allocator {
+  template<typename U> friend class arena_allocator;
+  arena *a_;
+
+public:
+  typedef T value_type;
+
+  arena_allocator(arena &a) noexcept : a_{&a} {}
+
+  template<typename U>
+  arena_allocator(const arena_allocator<U> &o) noexcept : a_{o.a_} {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(a_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, size_t) noexcept {}
+
+  template<typename U>
+  bool operator==(const arena_allocator<U> &o) const { return a_ == o.a_; }
+  template<typename U>
+  bool operator!=(const arena_allocator<U> &o) const { return a_ != o.a_; }
+};
+
+template<typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+} // ns gassist
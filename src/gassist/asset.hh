@@ -1,8 +1,24 @@
 #pragma once
 
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
 #include <utility>
 #include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <atomic>
 #include <algorithm>
+#include <array>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <optional>
+#include <string_view>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -14,6 +30,10 @@
 
 #include "gassist/exception.hh"
 #include "gassist/util.hh"
+#include "gassist/jobs.hh"
+#include "gassist/texcomp.hh"
+#include "gassist/gapk.hh"
+#include "gassist/wrap_gl.hh"
 
 namespace gassist::asset {
 
@@ -104,94 +124,740 @@ public:
   }
 };
 
-// TODO: Support a load path
-// TODO: Support multiple sources
-// TODO: Use async loading
-// TODO: Put asset loading on extra thread(s)
+// LOAD PATH ////////////////////////
+
+/// The contents of an asset: Either a view into a mapped
+/// archive or a loose file with a mapping of its own.
+///
+/// Views into an archive stay valid as long as the
+/// load_path they came from.
+class blob {
+  mapped_file file_{empty};
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  blob() {}
+
+  /// Contents of an archive
+  explicit blob(std::string_view v) : data_{v.data()}, size_{v.size()} {}
+
+  /// Maps a loose file
+  explicit blob(const std::string &path) : file_{path} {
+    data_ = file_.data();
+    size_ = file_.size();
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  const char* begin() const { return data(); }
+  const char* end() const { return data() + size(); }
+
+  /// Whether this is a loose file rather than part of an
+  /// archive
+  bool loose() const { return file_.fd() >= 0; }
+
+  blob(const blob&) = delete;
+  blob& operator =(const blob&) = delete;
+
+  blob(blob &&otr) { swap(otr); }
+  blob& operator=(blob &&otr) {
+    swap(otr);
+    return *this;
+  }
+
+  void swap(blob &otr) {
+    std::swap(file_, otr.file_);
+    std::swap(data_, otr.data_);
+    std::swap(size_, otr.size_);
+  }
+};
+
+/// Where assets are loaded from: An ordered list of loose
+/// file directories and packed archives (see gapk.hh); the
+/// first source containing a path wins.
+///
+/// Put a directory in front of the archive to override
+/// assets during development without repacking.
+///
+/// Archives are mapped once when added; lookups are const
+/// and may be done from any thread once the sources are
+/// set up.
+class load_path {
+  struct source {
+    std::string dir; // Empty for archives
+    mapped_file file{empty};
+    gapk::view archive{};
+    std::string archive_path{};
+  };
+
+  std::vector<source> sources_;
+
+public:
+  /// Searches dir for loose files
+  void add_directory(const std::string &dir) {
+    sources_.push_back({dir});
+  }
+
+  /// Maps an archive; throws if it can not be read or is
+  /// malformed
+  void add_archive(const std::string &path) {
+    source s{"", mapped_file{path}};
+    s.archive = gapk::parse(s.file.data(), s.file.size());
+    s.archive_path = path;
+    sources_.push_back(std::move(s));
+  }
+
+  /// The contents of the asset at path if there is one
+  std::optional<blob> find(const std::string &path) const {
+    for (const source &s : sources_) {
+      if (s.dir.empty()) {
+        if (auto r = s.archive.find(path)) return blob{*r};
+      } else {
+        std::string full = s.dir + "/" + path;
+        if (::access(full.c_str(), R_OK) == 0) return blob{full};
+      }
+    }
+    return std::nullopt;
+  }
+
+  /// The contents of the asset at path; throws if there is
+  /// none
+  blob load(const std::string &path) const {
+    if (auto r = find(path)) return std::move(*r);
+    throw msg_exception{"Asset not found: " + path};
+  }
+
+  /// The loose file directories in front of the first
+  /// archive, in search order. Editing files anywhere else
+  /// has no effect while the archive has them, so these
+  /// are the ones worth watching for changes.
+  std::vector<std::string> directories() const {
+    std::vector<std::string> r;
+    for (const source &s : sources_) {
+      if (s.dir.empty()) break;
+      r.push_back(s.dir);
+    }
+    return r;
+  }
+
+  /// The source find() takes path from: the directory or
+  /// the path of the archive; empty if there is none
+  std::string source_of(const std::string &path) const {
+    for (const source &s : sources_) {
+      if (s.dir.empty() ? s.archive.find(path).has_value()
+          : ::access((s.dir + "/" + path).c_str(), R_OK) == 0)
+        return s.dir.empty() ? s.archive_path : s.dir;
+    }
+    return "";
+  }
+
+  /// Whether any source contains path
+  bool contains(const std::string &path) const {
+    return !source_of(path).empty();
+  }
+};
+
+namespace intern {
+
+/// The directory the program binary cache is stored in;
+/// created if necessary. Empty if there is none.
+inline std::string program_cache_dir() {
+  std::string dir;
+  if (const char *xdg = std::getenv("XDG_CACHE_HOME"))
+    dir = xdg;
+  else if (const char *home = std::getenv("HOME"))
+    dir = std::string{home} + "/.cache";
+  else
+    return "";
+
+  ::mkdir(dir.c_str(), 0755);
+  dir += "/gravity-assist";
+  ::mkdir(dir.c_str(), 0755);
+  return dir;
+}
+
+} // ns intern
+
+/// Number of programs loaded from and missed in the
+/// binary cache since startup
+struct program_cache_stats_t {
+  std::atomic<uint> hits{0}, misses{0};
+};
+inline program_cache_stats_t program_cache_stats;
+
+/// Loads an opengl program from a directory on the load
+/// path.
+///
+/// Linked programs are cached on disk (in
+/// $XDG_CACHE_HOME/gravity-assist) as driver specific
+/// binaries. The cache key covers the shader sources and
+/// the driver, so changing either just causes a miss; so
+/// does a binary the driver rejects, in which case the
+/// program is compiled from source as usual.
+gl::program load_gl_program(const load_path &assets, const std::string &dir) {
+  blob sfrag = assets.load(dir + "/main.frag.glsl"),
+       svert = assets.load(dir + "/main.vert.glsl");
+
+  std::string cache_file;
+  if (gl::program::binaries_supported()) {
+    uint64_t key = fnv1a(svert.data(), svert.size());
+    key = fnv1a(sfrag.data(), sfrag.size(), key);
+    for (GLenum e : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+      auto str = (const char*)glGetString(e);
+      key = fnv1a(str, std::strlen(str), key);
+    }
+
+    std::string cache_dir = intern::program_cache_dir();
+    if (!cache_dir.empty()) {
+      std::stringstream name;
+      name << cache_dir << "/" << std::hex << key << ".bin";
+      cache_file = name.str();
+    }
+  }
+
+  // File layout: GLenum format, then the binary. A crash
+  // right after the rename may leave an empty file, which
+  // can not even be mapped.
+  struct stat st;
+  if (!cache_file.empty() && ::stat(cache_file.c_str(), &st) == 0) {
+    try {
+      if (size_t(st.st_size) <= sizeof(GLenum))
+        throw msg_exception{"Truncated program binary"};
+      mapped_file bin{cache_file};
+
+      GLenum format;
+      std::memcpy(&format, bin.data(), sizeof(format));
+      gl::program p{format, bin.data() + sizeof(format),
+                    bin.size() - sizeof(format)};
+
+      program_cache_stats.hits++;
+      std::cerr << dir << ": program cache hit\n";
+      return p;
+    } catch (const std::exception&) {
+      ::unlink(cache_file.c_str()); // Stale; replaced below
+    } catch (const errno_exception&) {
+      ::unlink(cache_file.c_str()); // Unreadable; likewise
+    }
+  }
 
-/// Loads an opengl program from a directory
-gl::program load_gl_program(const std::string &dir) {
-  mapped_file sfrag{dir + "/main.frag.glsl"},
-              svert{dir + "/main.vert.glsl"};
   gl::shader vert = gl::make_vertex_shader(svert.data(), svert.size()),
              frag = gl::make_fragment_shader(sfrag.data(), sfrag.size());
+  gl::program p{frag, vert};
+
+  program_cache_stats.misses++;
+  std::cerr << dir << ": program cache miss\n";
+
+  if (!cache_file.empty()) {
+    GLenum format;
+    std::vector<char> bin = p.binary(format);
+    if (!bin.empty()) {
+      // Write to a temporary of our own and rename, so
+      // concurrently running instances never see a partial
+      // file nor write into each other's
+      std::string tmp = cache_file + "." + std::to_string(::getpid()) + ".tmp";
+      std::ofstream out{tmp, std::ios::binary | std::ios::trunc};
+      out.write((const char*)&format, sizeof(format));
+      out.write(bin.data(), bin.size());
+      out.close();
+      if (out)
+        ::rename(tmp.c_str(), cache_file.c_str());
+      else
+        ::unlink(tmp.c_str());
+    }
+  }
 
-  return gl::program{frag, vert};
+  return p;
 }
 
+/// How much texture data may be uploaded in one frame; the
+/// same budget is passed to every loader polled in a frame.
+///
+/// Uploads are split into pieces; a piece is allowed if it
+/// fits the bytes left and the deadline has not passed. The
+/// first piece of a frame is always allowed, so loading
+/// makes progress no matter how small the budget.
+class upload_budget {
+  typedef std::chrono::steady_clock clock;
+
+  size_t left_;
+  clock::time_point deadline_;
+  bool spent_ = false;
+
+public:
+  upload_budget(size_t bytes, std::chrono::microseconds time)
+    : left_{bytes}, deadline_{clock::now() + time} {}
+
+  /// No limit at all; for loading synchronously
+  static upload_budget unlimited() {
+    return {SIZE_MAX, std::chrono::hours{1}};
+  }
+
+  /// Claims n bytes if allowed
+  bool take(size_t n) {
+    if (spent_ && (n > left_ || clock::now() >= deadline_)) return false;
+    left_ -= std::min(n, left_);
+    spent_ = true;
+    return true;
+  }
+
+  /// Claims as many units of the given size as allowed, up
+  /// to n; returns the number claimed
+  size_t take_units(size_t n, size_t unit) {
+    size_t k = std::min(n, left_ / unit);
+    if (!spent_) k = std::max<size_t>(k, 1);
+    if (k == 0 || (spent_ && clock::now() >= deadline_)) return 0;
+    left_ -= std::min(k*unit, left_);
+    spent_ = true;
+    return k;
+  }
+};
+
+/// A cube map texture loaded progressively from six image
+/// files on the load path.
+///
+/// If block compressed .gatex files (see texcomp.hh) are
+/// available, their small mip levels are uploaded right
+/// away, so there is a low resolution texture from the
+/// first frame on. The larger levels follow one face at a
+/// time, smallest first, with GL_TEXTURE_BASE_LEVEL
+/// lowered whenever a level is complete. The pages of each
+/// level are read from the mapping on a job_pool first, so
+/// the uploads never wait for the disk.
+///
+/// Otherwise the webp faces are decoded on a job_pool,
+/// incrementally (WebPIDecoder), so decoding overlaps with
+/// reading the file. Decoded rows are uploaded as they
+/// come in; the same job then box filters the mip levels,
+/// which are uploaded within the budget too. Until all
+/// faces are complete use() binds a placeholder texture.
+///
+/// Call poll() once per frame on the GL thread; it does
+/// the uploads within the given budget.
 class cubemap {
-  GLuint id;
+  typedef std::chrono::steady_clock clock;
+
+  GLuint id, placeholder_id;
+
+  /// Whether anything but the placeholder can be shown;
+  /// whether the full resolution is uploaded
+  bool usable_ = false, ready_ = false;
+
+  std::string basepath_;
+  clock::time_point t_start_;
+  double first_ms_ = -1, full_ms_ = -1;
+
+  /// Loading state for .gatex files
+  struct compressed {
+    std::array<blob, 6> files;
+    std::array<texcomp::view, 6> views;
+    uint32_t no_levels;
+
+    /// The next upload is this level of this face;
+    /// levels are uploaded from the smallest one down to 0
+    uint32_t level, face = 0;
+
+    /// Per level; done when its pages have been read
+    std::vector<std::future<void>> prefetched;
+  };
 
-  struct mapped_webp_file : mapped_file {
-    typedef mapped_file super;
+  /// Loading state of a single webp face
+  struct face {
+    std::string path;
+    blob file;
     int w, h;
 
-    using super::super;
+    /// Decoded pixels; the first `rows` rows are complete
+    std::vector<uint8_t> px;
+    std::atomic<int> rows{0};
 
-    mapped_webp_file(const std::string &p) : super{p} {
-      // TODO: Error handling
-      WebPGetInfo(data(), size(), &w, &h);
+    /// Levels 1 and up; built by the decoding job once px is
+    /// complete, only to be touched after it finished
+    std::vector<texcomp::rgb_image> mips;
+    uint32_t no_levels;
+
+    /// Rows of this level uploaded so far
+    uint32_t level = 0;
+    int uploaded_rows = 0;
+
+    std::future<bool> decoded;
+    /// The job finished successfully
+    bool done = false;
+  };
+
+  // On the heap, since the background jobs hold pointers;
+  // only the one in use is set
+  std::unique_ptr<compressed> bc_;
+  std::unique_ptr<std::array<face, 6>> faces;
+
+  static constexpr const char *face_names[] = {
+    "right", "left", "top", "bottom", "back", "front"};
+
+  /// Mip levels up to this size are uploaded right away
+  static constexpr uint32_t preview_size = 64;
+
+  /// How much to feed the incremental decoder at once
+  static constexpr size_t decode_chunk = 64 << 10;
+
+  /// Whether the basepath contains block compressed
+  /// versions of the faces that we can use
+  static bool has_compressed(const load_path &assets,
+                             const std::string &basepath) {
+    return epoxy_has_gl_extension("GL_EXT_texture_compression_s3tc")
+        && assets.contains(basepath + "/right.gatex");
+  }
+
+  double ms_since_start() const {
+    return std::chrono::duration<double, std::milli>{
+        clock::now() - t_start_}.count();
+  }
+
+  void loaded_first() {
+    usable_ = true;
+    first_ms_ = ms_since_start();
+  }
+
+  void loaded_full() {
+    ready_ = true;
+    full_ms_ = ms_since_start();
+    std::cerr << basepath_ << ": first level after " << first_ms_
+              << " ms, full resolution after " << full_ms_ << " ms\n";
+  }
+
+  //// COMPRESSED ////
+
+  /// Uploads the current level of the current face
+  void upload_compressed() {
+    compressed &c = *bc_;
+    const texcomp::view &v = c.views[c.face];
+    const texcomp::level &l = v.levels[c.level];
+    glCompressedTexImage2D(
+        GL_TEXTURE_CUBE_MAP_POSITIVE_X + c.face, c.level,
+        GL_COMPRESSED_RGB_S3TC_DXT1_EXT, l.width, l.height, 0,
+        l.size, v.data(c.level));
+
+    if (++c.face < 6) return;
+
+    // Level complete; start sampling from it
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, c.level);
+    c.face = 0;
+    if (!usable_) loaded_first();
+    if (c.level == 0)
+      loaded_full();
+    else
+      c.level--;
+  }
+
+  void load_compressed(job_pool &pool, const load_path &assets) {
+    bc_.reset(new compressed);
+    compressed &c = *bc_;
+
+    for (size_t i=0; i < 6; i++) {
+      c.files[i] = assets.load(basepath_ + "/" + face_names[i] + ".gatex");
+      c.views[i] = texcomp::parse(c.files[i].data(), c.files[i].size());
+      const texcomp::header &h = *c.views[i].head;
+      if (i != 0 && (h.width != c.views[0].head->width
+          || h.height != c.views[0].head->height
+          || h.no_levels != c.no_levels))
+        throw msg_exception{"Cubemap faces differ in size: " + basepath_};
+      c.no_levels = h.no_levels;
     }
 
-    uint8_t *data() noexcept {
-      mapped_file *sup = this;
-      return (uint8_t*)sup->data();
+    // Read the pages of every level in the background, in
+    // the order they will be uploaded
+    c.prefetched.resize(c.no_levels);
+    for (uint32_t lv = c.no_levels; lv-- > 0;) {
+      compressed *cp = &c;
+      c.prefetched[lv] = pool.submit([cp, lv]() {
+        volatile char sink = 0;
+        for (const texcomp::view &v : cp->views) {
+          const char *d = v.data(lv);
+          for (size_t off=0; off < v.levels[lv].size; off += 4096)
+            sink = sink + d[off];
+        }
+      });
     }
-  };
+
+    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, c.no_levels-1);
+
+    // The small levels right away
+    c.level = c.no_levels - 1;
+    while (!ready_ && c.views[0].levels[c.level].width <= preview_size
+           && c.views[0].levels[c.level].height <= preview_size)
+      upload_compressed();
+  }
+
+  void poll_compressed(upload_budget &budget) {
+    compressed &c = *bc_;
+    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    while (!ready_ && is_ready(c.prefetched[c.level])
+           && budget.take(c.views[c.face].levels[c.level].size))
+      upload_compressed();
+
+    if (ready_) {
+      for (auto &f : c.prefetched) f.wait();
+      bc_.reset(); // Unmaps loose files
+    }
+  }
+
+  /// Blocks until no background job points into bc_ or
+  /// faces any more
+  void wait_jobs() {
+    if (bc_)
+      for (auto &f : bc_->prefetched)
+        if (f.valid()) f.wait();
+    if (faces)
+      for (auto &f : *faces)
+        if (f.decoded.valid()) f.decoded.wait();
+  }
+
+  //// WEBP ////
+
+  /// Decodes a face incrementally into f.px, publishing
+  /// the number of complete rows as it goes
+  static bool decode_webp(face &f) {
+    WebPIDecoder *dec = WebPINewRGB(MODE_RGB, f.px.data(), f.px.size(), f.w*3);
+    if (!dec) return false;
+
+    const uint8_t *data = (const uint8_t*)f.file.data();
+    bool ok = false;
+    for (size_t off=0; off < f.file.size(); off += decode_chunk) {
+      VP8StatusCode st = WebPIAppend(dec, data + off,
+          std::min(decode_chunk, f.file.size() - off));
+      int last_y = 0;
+      if (WebPIDecGetRGB(dec, &last_y, nullptr, nullptr, nullptr))
+        f.rows.store(last_y, std::memory_order_release);
+      if (st == VP8_STATUS_OK) ok = true;
+      if (st != VP8_STATUS_SUSPENDED) break;
+    }
+    WebPIDelete(dec);
+
+    // Optimization: Close the memory mapping of loose
+    // files right now, possibly freeing some memory
+    f.file = blob{};
+    return ok && f.rows.load() == f.h;
+  }
+
+  /// Box filters the decoded face down to 1×1, so the GL
+  /// thread only needs to upload the levels
+  static void build_mips(face &f) {
+    f.mips.reserve(f.no_levels - 1);
+    for (uint32_t lv=1; lv < f.no_levels; lv++) {
+      texcomp::rgb_image m = lv == 1
+        ? texcomp::downsample(f.px.data(), f.w, f.h)
+        : texcomp::downsample(f.mips.back());
+      f.mips.push_back(std::move(m));
+    }
+  }
+
+  void load_webp(job_pool &pool, const load_path &assets) {
+    faces.reset(new std::array<face, 6>);
+
+    // All files are checked before the first job starts
+    for (size_t i=0; i < 6; i++) {
+      face &f = (*faces)[i];
+      f.path = basepath_ + "/" + face_names[i] + ".webp";
+      f.file = assets.load(f.path);
+      if (!WebPGetInfo((const uint8_t*)f.file.data(), f.file.size(),
+                       &f.w, &f.h))
+        throw msg_exception{"Not a webp file: " + f.path};
+      f.px.resize(size_t(f.w)*f.h*3);
+      f.no_levels = texcomp::no_mip_levels(f.w, f.h);
+    }
+
+    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    for (size_t i=0; i < 6; i++) {
+      face &f = (*faces)[i];
+      for (uint32_t lv=0; lv < f.no_levels; lv++)
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, lv, GL_RGB,
+            std::max(f.w >> lv, 1), std::max(f.h >> lv, 1), 0,
+            GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+
+      face *fp = &f;
+      f.decoded = pool.submit([fp]() {
+        if (!decode_webp(*fp)) return false;
+        build_mips(*fp);
+        return true;
+      });
+    }
+  }
+
+  void poll_webp(upload_budget &budget) {
+    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    bool all = true;
+    for (size_t i=0; i < 6; i++) {
+      face &f = (*faces)[i];
+
+      // Fails only once the job is done
+      if (is_ready(f.decoded)) {
+        if (!f.decoded.get())
+          throw msg_exception{"Failed decoding texture " + f.path};
+        f.done = true;
+      }
+
+      // Level 0 as the rows come in, the others once the
+      // job has built them
+      while (f.level < f.no_levels && (f.level == 0 || f.done)) {
+        const texcomp::rgb_image *m =
+          f.level > 0 ? &f.mips[f.level - 1] : nullptr;
+        const int w = m ? m->width : f.w, h = m ? m->height : f.h;
+        const int rows = m ? h : f.rows.load(std::memory_order_acquire);
+        size_t n = rows > f.uploaded_rows
+          ? budget.take_units(rows - f.uploaded_rows, size_t(w)*3) : 0;
+        if (n == 0) break;
+
+        const uint8_t *px = m ? m->px.data() : f.px.data();
+        glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, f.level,
+            0, f.uploaded_rows, w, n, GL_RGB, GL_UNSIGNED_BYTE,
+            px + size_t(f.uploaded_rows)*w*3);
+        f.uploaded_rows += n;
+        if (f.uploaded_rows == h) {
+          f.level++;
+          f.uploaded_rows = 0;
+        }
+      }
+      all = all && f.done && f.level == f.no_levels;
+    }
+
+    if (all) {
+      faces.reset();
+      loaded_first();
+      loaded_full();
+    }
+  }
+
 public:
-  cubemap(const std::string &basepath) noexcept {
+  /// Starts loading the cubemap from basepath/{right,left,...}
+  /// on the load path.
+  ///
+  /// Prefers the block compressed .gatex files and falls
+  /// back to decoding the .webp files on the given pool.
+  cubemap(job_pool &pool, const load_path &assets,
+          const std::string &basepath)
+      : basepath_{basepath}, t_start_{clock::now()} {
     glGenTextures(1, &id);
+    glGenTextures(1, &placeholder_id);
     glActiveTexture(GL_TEXTURE0);
 
-    use();
-
-    {
-      std::array<mapped_webp_file, 6> disk_texes {
-        basepath + "/right.webp", basepath + "/left.webp",
-        basepath + "/top.webp",   basepath + "/bottom.webp",
-        basepath + "/back.webp", basepath + "/front.webp"};
-
-      size_t bufsize = 0;
-      for (auto &t : disk_texes)
-        bufsize = std::max<size_t>(bufsize, t.w*t.h*3);
-
-      std::vector<uint8_t> texbuf;
-      texbuf.resize(bufsize);
-
-      for (size_t i=0; i < disk_texes.size(); i++) {
-        auto &t = disk_texes[i];
-        WebPDecodeRGBInto(t.data(), t.size(),
-            texbuf.data(), texbuf.size(), t.w*3);
-        glTexImage2D(
-            // Adding the counter here is bad style
-            GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0,
-            GL_RGB, t.w, t.h, 0, GL_RGB, GL_UNSIGNED_BYTE,
-            texbuf.data());
-
-        // Optimization: Close the memory mapping right now,
-        // possibly freeing some memory
-        t = {empty};
-      }
-    }
+    // A single dark texel per face
+    const uint8_t gray[3] = {16, 16, 16};
+    glBindTexture(GL_TEXTURE_CUBE_MAP, placeholder_id);
+    for (GLenum i=0; i < 6; i++)
+      glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0,
+          GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, gray);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
+    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
-    // TODO: Texture compression
-    // TODO: Mipmapping
-
-    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    try {
+      if (has_compressed(assets, basepath))
+        load_compressed(pool, assets);
+      else
+        load_webp(pool, assets);
+    } catch (...) {
+      // No destructor call for us
+      wait_jobs();
+      glDeleteTextures(1, &placeholder_id);
+      glDeleteTextures(1, &id);
+      throw;
+    }
   }
 
   ~cubemap() {
+    wait_jobs();
+    glDeleteTextures(1, &placeholder_id);
     glDeleteTextures(1, &id);
   }
 
+  cubemap(const cubemap&) = delete;
+  cubemap& operator =(const cubemap&) = delete;
+
+  /// Exchanges the textures and loading state; used to
+  /// replace a cubemap with a reloaded one
+  void swap(cubemap &otr) {
+    std::swap(id, otr.id);
+    std::swap(placeholder_id, otr.placeholder_id);
+    std::swap(usable_, otr.usable_);
+    std::swap(ready_, otr.ready_);
+    std::swap(basepath_, otr.basepath_);
+    std::swap(t_start_, otr.t_start_);
+    std::swap(first_ms_, otr.first_ms_);
+    std::swap(full_ms_, otr.full_ms_);
+    std::swap(bc_, otr.bc_);
+    std::swap(faces, otr.faces);
+  }
+
+  /// The files a cubemap at basepath may be loaded from
+  static std::vector<std::string> files(const std::string &basepath) {
+    std::vector<std::string> r;
+    for (const char *f : face_names)
+      for (const char *ext : {".gatex", ".webp"})
+        r.push_back(basepath + "/" + f + ext);
+    return r;
+  }
+
+  /// Does the uploads that are due, within the budget; must
+  /// be called on the GL thread.
+  ///
+  /// Returns whether the texture is complete.
+  bool poll(upload_budget &budget) {
+    if (ready_) return true;
+    if (bc_)
+      poll_compressed(budget);
+    else
+      poll_webp(budget);
+    return ready_;
+  }
+
+  /// Loads the rest of the texture, blocking
+  void wait() {
+    while (!ready_) {
+      upload_budget all = upload_budget::unlimited();
+      if (!poll(all)) std::this_thread::yield();
+    }
+  }
+
+  /// Whether all faces have been uploaded at full
+  /// resolution
+  bool ready() const { return ready_; }
+
+  /// Whether background jobs are still working for this
+  /// cubemap; destroying it blocks until they are done
+  bool busy() const {
+    if (bc_)
+      for (auto &f : bc_->prefetched)
+        if (f.valid() && !is_ready(f)) return true;
+    if (faces)
+      for (auto &f : *faces)
+        if (f.decoded.valid() && !is_ready(f.decoded)) return true;
+    return false;
+  }
+
+  /// Milliseconds from construction until anything but the
+  /// placeholder could be shown, and until the full
+  /// resolution was uploaded; negative if not yet
+  double first_ms() const { return first_ms_; }
+  double full_ms() const { return full_ms_; }
+
+  /// The texture use() binds: the placeholder if there is
+  /// nothing to show yet
+  GLuint bound_id() const noexcept { return usable_ ? id : placeholder_id; }
+
   void use() {
-    glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, bound_id());
   }
 
   GLuint texid() const noexcept { return id; }
@@ -0,0 +1,647 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "gassist/util.hh"
+
+/// Close approaches and collisions between moving spheres.
+///
+/// Everything here is continuous: Bodies are assumed to
+/// move on a straight line over each simulation step (the
+/// chord of their actual path, and what a semi implicit
+/// euler step does), and the tests find the moment two of
+/// them touch anywhere along that line. So nothing is
+/// missed when a body moves several times its own size in
+/// one step, as it does at high time warp.
+namespace gassist::collide {
+
+// BOXES ////////////////////////////
+
+/// Axis aligned bounding box
+struct aabb {
+  vec3 lo, hi;
+
+  /// Half the surface area; what the tree minimizes
+  fl area() const {
+    vec3 d = hi - lo;
+    return d.x*d.y + d.y*d.z + d.z*d.x;
+  }
+
+  bool contains(const aabb &o) const {
+    return lo.x <= o.lo.x && lo.y <= o.lo.y && lo.z <= o.lo.z
+        && o.hi.x <= hi.x && o.hi.y <= hi.y && o.hi.z <= hi.z;
+  }
+};
+
+inline aabb merge(const aabb &a, const aabb &b) {
+  return {glm::min(a.lo, b.lo), glm::max(a.hi, b.hi)};
+}
+
+inline bool overlap(const aabb &a, const aabb &b) {
+  return a.lo.x <= b.hi.x && b.lo.x <= a.hi.x
+      && a.lo.y <= b.hi.y && b.lo.y <= a.hi.y
+      && a.lo.z <= b.hi.z && b.lo.z <= a.hi.z;
+}
+
+/// Box around a sphere of radius r moving from p0 to p1
+inline aabb swept(const vec3 &p0, const vec3 &p1, fl r) {
+  return {glm::min(p0, p1) - vec3{r, r, r},
+          glm::max(p0, p1) + vec3{r, r, r}};
+}
+
+// DYNAMIC TREE /////////////////////
+
+/// Dynamic bounding volume hierarchy over a set of boxes.
+///
+/// Leaves are given a fat box (the box of the object plus
+/// some room to move) and only need to be touched when the
+/// object leaves it, so with objects moving a little every
+/// step most updates are a containment check. Leaves are
+/// inserted next to the node that increases the total
+/// surface area the least and the tree is kept balanced
+/// with AVL rotations, so it stays shallow no matter the
+/// order of insertions.
+///
+/// Nodes are kept in a pool; the leaf handles returned by
+/// insert() are stable until the leaf is removed.
+class aabb_tree {
+public:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  /// Deep enough for any balanced tree of 2³² leaves
+  static constexpr uint max_height = 63;
+
+private:
+  struct node {
+    aabb box;
+    /// The next free node for unused nodes
+    uint32_t parent;
+    /// child[0] == none for leaves
+    std::array<uint32_t, 2> child;
+    /// 0 for leaves; -1 for unused nodes
+    int32_t height;
+    uint32_t user;
+
+    bool leaf() const { return child[0] == none; }
+  };
+
+  std::vector<node> nodes_;
+  uint32_t root_ = none, free_ = none;
+  size_t leaves_ = 0;
+
+  uint32_t allocate() {
+    if (free_ == none) {
+      nodes_.emplace_back();
+      free_ = nodes_.size() - 1;
+      nodes_[free_].parent = none;
+    }
+    const uint32_t i = free_;
+    free_ = nodes_[i].parent;
+    nodes_[i].parent = none;
+    nodes_[i].child = {none, none};
+    nodes_[i].height = 0;
+    nodes_[i].user = none;
+    return i;
+  }
+
+  void release(uint32_t i) {
+    nodes_[i].parent = free_;
+    nodes_[i].height = -1;
+    free_ = i;
+  }
+
+  /// Points the parent of old (or the root) at nu
+  void replace_child(uint32_t parent, uint32_t old, uint32_t nu) {
+    if (parent == none) {
+      root_ = nu;
+      return;
+    }
+    auto &ch = nodes_[parent].child;
+    ch[ch[0] == old ? 0 : 1] = nu;
+  }
+
+  /// Lifts the child on the given side of a above it;
+  /// returns the node now at the place of a
+  uint32_t rotate(uint32_t a, int side) {
+    const uint32_t x = nodes_[a].child[side], y = nodes_[a].child[1 - side];
+    uint32_t f = nodes_[x].child[0], g = nodes_[x].child[1];
+    // The taller grandchild stays below x
+    if (nodes_[f].height < nodes_[g].height) std::swap(f, g);
+
+    node &A = nodes_[a], &X = nodes_[x];
+    X.parent = A.parent;
+    replace_child(X.parent, a, x);
+    X.child = {a, f};
+    A.parent = x;
+    A.child[side] = g;
+    nodes_[g].parent = a;
+
+    A.box = merge(nodes_[y].box, nodes_[g].box);
+    A.height = 1 + std::max(nodes_[y].height, nodes_[g].height);
+    X.box = merge(A.box, nodes_[f].box);
+    X.height = 1 + std::max(A.height, nodes_[f].height);
+    return x;
+  }
+
+  uint32_t balance(uint32_t a) {
+    const node &A = nodes_[a];
+    if (A.leaf() || A.height < 2) return a;
+    const int32_t skew = nodes_[A.child[1]].height - nodes_[A.child[0]].height;
+    if (skew > 1) return rotate(a, 1);
+    if (skew < -1) return rotate(a, 0);
+    return a;
+  }
+
+  /// Rebalances and recomputes the boxes from i up
+  void refit(uint32_t i) {
+    while (i != none) {
+      i = balance(i);
+      node &n = nodes_[i];
+      const node &c0 = nodes_[n.child[0]], &c1 = nodes_[n.child[1]];
+      n.box = merge(c0.box, c1.box);
+      n.height = 1 + std::max(c0.height, c1.height);
+      i = n.parent;
+    }
+  }
+
+  void insert_leaf(uint32_t leaf) {
+    if (root_ == none) {
+      root_ = leaf;
+      nodes_[leaf].parent = none;
+      return;
+    }
+
+    // Find the best sibling: Descend while making leaf a
+    // child of the current node would cost more than
+    // moving it further down
+    const aabb b = nodes_[leaf].box;
+    uint32_t i = root_;
+    while (!nodes_[i].leaf()) {
+      const node &n = nodes_[i];
+      const fl combined = merge(n.box, b).area(),
+               here = 2*combined,
+               // Every node further down enlarges this one
+               inherited = 2*(combined - n.box.area());
+
+      auto descend = [&](uint32_t c) {
+        const node &ch = nodes_[c];
+        fl a = merge(ch.box, b).area();
+        return (ch.leaf() ? a : a - ch.box.area()) + inherited;
+      };
+      const fl c0 = descend(n.child[0]), c1 = descend(n.child[1]);
+      if (here < c0 && here < c1) break;
+      i = c0 < c1 ? n.child[0] : n.child[1];
+    }
+
+    const uint32_t sibling = i, parent = allocate();
+    node &p = nodes_[parent];
+    p.parent = nodes_[sibling].parent;
+    replace_child(p.parent, sibling, parent);
+    p.child = {sibling, leaf};
+    nodes_[sibling].parent = parent;
+    nodes_[leaf].parent = parent;
+    refit(parent);
+  }
+
+  void remove_leaf(uint32_t leaf) {
+    if (leaf == root_) {
+      root_ = none;
+      return;
+    }
+    const uint32_t parent = nodes_[leaf].parent,
+                   grand = nodes_[parent].parent,
+                   sibling = nodes_[parent].child[
+                       nodes_[parent].child[0] == leaf ? 1 : 0];
+
+    replace_child(grand, parent, sibling);
+    nodes_[sibling].parent = grand;
+    release(parent);
+    refit(grand);
+  }
+
+public:
+  size_t size() const { return leaves_; }
+  bool empty() const { return leaves_ == 0; }
+
+  /// Height of the tree; 0 for a single leaf
+  int height() const { return root_ == none ? 0 : nodes_[root_].height; }
+
+  void clear() {
+    nodes_.clear();
+    root_ = free_ = none;
+    leaves_ = 0;
+  }
+
+  /// Adds a leaf with the given (fat) box; returns the leaf
+  uint32_t insert(const aabb &fat, uint32_t user) {
+    const uint32_t leaf = allocate();
+    nodes_[leaf].box = fat;
+    nodes_[leaf].user = user;
+    insert_leaf(leaf);
+    leaves_++;
+    return leaf;
+  }
+
+  void remove(uint32_t leaf) {
+    assert(nodes_[leaf].leaf() && nodes_[leaf].height == 0);
+    remove_leaf(leaf);
+    release(leaf);
+    leaves_--;
+  }
+
+  /// Moves a leaf: Nothing happens as long as its box still
+  /// contains tight; otherwise the leaf is reinserted with
+  /// the box fat, which should contain tight. Returns
+  /// whether the leaf was reinserted.
+  bool move(uint32_t leaf, const aabb &tight, const aabb &fat) {
+    if (nodes_[leaf].box.contains(tight)) return false;
+    remove_leaf(leaf);
+    nodes_[leaf].box = fat;
+    insert_leaf(leaf);
+    return true;
+  }
+
+  const aabb& box(uint32_t leaf) const { return nodes_[leaf].box; }
+  uint32_t user(uint32_t leaf) const { return nodes_[leaf].user; }
+
+  /// Calls f(leaf) for every leaf whose box overlaps b
+  template<typename F>
+  void query(const aabb &b, F &&f) const {
+    if (root_ == none) return;
+    // Popping one node and pushing two needs at most one
+    // entry per level
+    std::array<uint32_t, max_height + 1> stack;
+    uint sp = 0;
+    stack[sp++] = root_;
+
+    while (sp > 0) {
+      const node &n = nodes_[stack[--sp]];
+      if (!overlap(n.box, b)) continue;
+      if (n.leaf()) {
+        f(uint32_t(&n - nodes_.data()));
+      } else {
+        assert(sp + 2 <= stack.size());
+        stack[sp++] = n.child[0];
+        stack[sp++] = n.child[1];
+      }
+    }
+  }
+};
+
+// CONTINUOUS TESTS /////////////////
+
+/// Earliest fraction s of the step at which two spheres
+/// with combined radius r touch, given their relative
+/// position d0 at the start and d1 at the end of the step
+/// (linear in between); s < 0 if they don't, 0 if they
+/// already touch at the start.
+inline fl first_contact(const vec3 &d0, const vec3 &d1, fl r) {
+  const vec3 v = d1 - d0;
+  const fl c = glm::dot(d0, d0) - r*r;
+  if (c <= 0) return 0;
+  const fl b = glm::dot(d0, v);
+  if (b >= 0) return -1; // Not closing in
+
+  // |d0 + v s|² = r² with a s² + 2 b s + c = 0; the
+  // smaller root in a form without cancellation
+  const fl a = glm::dot(v, v), disc = b*b - a*c;
+  if (disc < 0) return -1;
+  const fl s = c / (-b + std::sqrt(disc));
+  return s <= 1 ? s : -1;
+}
+
+/// Periapsis of two bodies during a step
+struct periapsis {
+  /// Fraction of the step
+  fl s;
+  fl distance;
+  bool found;
+};
+
+/// Finds the periapsis of two bodies with relative
+/// position d0 and velocity u0 at the start and d1, u1 at
+/// the end of the step: the point where the distance stops
+/// shrinking, i.e. where the radial velocity turns from
+/// negative to non negative. Each periapsis is found in
+/// one step only.
+///
+/// This uses the velocities at the positions rather than
+/// the straight line between them: Every chord of a circle
+/// has a minimum of the distance to the center halfway,
+/// but the velocities follow the curve. The time is
+/// interpolated from the radial velocities and the
+/// distance is measured on the straight line.
+inline periapsis find_periapsis(const vec3 &d0, const vec3 &u0,
+                                const vec3 &d1, const vec3 &u1) {
+  const fl r0 = glm::dot(d0, u0), r1 = glm::dot(d1, u1);
+  if (r0 >= 0 || r1 < 0) return {0, 0, false};
+  const fl s = r0 / (r0 - r1);
+  return {s, glm::length(d0 + (d1 - d0)*s), true};
+}
+
+// DETECTOR /////////////////////////
+
+/// What happened during a step
+enum class kind : uint8_t {
+  /// A craft got closer to a body than its approach radius
+  approach,
+  /// A craft passed the point of its closest approach to a
+  /// body while within its approach radius
+  periapsis,
+  /// Two bodies or a craft and a body touched
+  impact
+};
+
+inline const char* name(kind k) {
+  switch (k) {
+    case kind::approach:  return "approach";
+    case kind::periapsis: return "periapsis";
+    case kind::impact:    return "impact";
+  }
+  return "?";
+}
+
+struct event {
+  static constexpr uint32_t none = UINT32_MAX;
+
+  collide::kind kind;
+  /// Row of the body involved; for impacts between two
+  /// bodies other is the second one (body < other)
+  uint32_t body, other = none;
+  /// Row of the craft, if one is involved
+  uint32_t craft = none;
+  /// When it happened
+  fl time;
+  /// Distance of the centers
+  fl distance;
+
+  /// Chronological, ties broken by what is involved
+  bool operator<(const event &o) const {
+    return std::tie(time, kind, body, other, craft)
+         < std::tie(o.time, o.kind, o.body, o.other, o.craft);
+  }
+  bool operator==(const event &o) const {
+    return kind == o.kind && body == o.body && other == o.other
+        && craft == o.craft && time == o.time && distance == o.distance;
+  }
+};
+
+/// Finds the impacts between bodies and the encounters of
+/// craft with them, step by step, without testing all
+/// pairs.
+///
+/// The bodies are kept in an aabb_tree, with boxes around
+/// the volume they sweep during a step extended to their
+/// approach radius. The fat boxes are stretched along the
+/// motion of the body, so a body on a smooth path only
+/// needs to be reinserted every few steps. The candidate
+/// pairs of bodies whose fat boxes (shrunk to the radius)
+/// overlap are kept between steps and only requeried for
+/// reinserted bodies. Candidates are checked with the
+/// continuous tests above.
+///
+/// Call update() after every step with the state of the
+/// bodies at its end, then probe() with the state of the
+/// craft. Both are remembered as the start of the next
+/// step. Bodies and craft are identified by their rows;
+/// call reset() when rows change (the detector starts over
+/// by itself when their number changes).
+///
+/// The velocities must be the ones at the positions; the
+/// velocities of a semi implicit euler step are the ones
+/// of the step and lag half a step behind.
+class detector {
+public:
+  struct params {
+    /// Craft within this many radii of a body are
+    /// considered close to it; at least 1
+    fl approach = 4;
+
+    /// How many steps ahead the fat boxes cover the
+    /// current motion of a body
+    fl look_ahead = 8;
+
+    /// Extra room around fat boxes
+    fl margin = 1e-3f;
+  };
+
+  struct stats {
+    /// Bodies reinserted into the tree by the last update
+    size_t reinserted = 0;
+    /// Candidate pairs tested by the last update
+    size_t pairs = 0;
+  };
+
+private:
+  /// Positions and velocities at the start and the end of
+  /// the step
+  struct track {
+    std::vector<vec3> start, end, start_vel, end_vel;
+
+    size_t size() const { return end.size(); }
+
+    void clear() {
+      start.clear();
+      end.clear();
+      start_vel.clear();
+      end_vel.clear();
+    }
+
+    /// Returns false if the number of rows changed, in
+    /// which case nothing moved during this step
+    bool advance(const std::vector<vec3> &pos, const std::vector<vec3> &vel) {
+      assert(pos.size() == vel.size());
+      const bool same = pos.size() == end.size();
+      if (same) {
+        start.swap(end);
+        start_vel.swap(end_vel);
+        end = pos;
+        end_vel = vel;
+      } else {
+        start = end = pos;
+        start_vel = end_vel = vel;
+      }
+      return same;
+    }
+  };
+
+  params par_;
+  aabb_tree tree_;
+  std::vector<uint32_t> leaf_;
+  track bodies_, craft_;
+  std::vector<fl> radius_;
+  std::vector<char> moved_;
+  std::vector<std::pair<uint32_t, uint32_t>> pairs_;
+  fl time_ = 0, dt_ = 0;
+  stats stats_;
+
+  fl reach(uint32_t i) const { return par_.approach * radius_[i]; }
+
+  /// The fat box of a body for impacts: the box in the
+  /// tree is made for craft approaching, shrinking it to
+  /// the radius keeps it containing the swept sphere
+  aabb impact_box(uint32_t i) const {
+    const aabb &b = tree_.box(leaf_[i]);
+    const fl d = reach(i) - radius_[i];
+    return {b.lo + vec3{d, d, d}, b.hi - vec3{d, d, d}};
+  }
+
+  void test_pair(uint32_t i, uint32_t j, std::vector<event> &out) const {
+    const track &b = bodies_;
+    const vec3 d0 = b.start[j] - b.start[i], d1 = b.end[j] - b.end[i];
+    const fl s = first_contact(d0, d1, radius_[i] + radius_[j]);
+    // Touching since before the step is not news
+    if (s > 0)
+      out.push_back({kind::impact, i, j, event::none, time_ + s*dt_,
+                     radius_[i] + radius_[j]});
+  }
+
+  void test_craft(uint32_t i, uint32_t c, std::vector<event> &out) const {
+    const track &b = bodies_, &k = craft_;
+    const vec3 d0 = k.start[c] - b.start[i], d1 = k.end[c] - b.end[i];
+    const fl near = reach(i);
+
+    fl s = first_contact(d0, d1, near);
+    if (s > 0)
+      out.push_back({kind::approach, i, event::none, c,
+                     time_ + s*dt_, near});
+    s = first_contact(d0, d1, radius_[i]);
+    if (s > 0)
+      out.push_back({kind::impact, i, event::none, c,
+                     time_ + s*dt_, radius_[i]});
+
+    periapsis pe = find_periapsis(d0, k.start_vel[c] - b.start_vel[i],
+                                  d1, k.end_vel[c] - b.end_vel[i]);
+    if (pe.found && pe.distance <= near)
+      out.push_back({kind::periapsis, i, event::none, c,
+                     time_ + pe.s*dt_, pe.distance});
+  }
+
+public:
+  detector() = default;
+  explicit detector(const params &p) : par_{p} {}
+
+  const params& parameters() const { return par_; }
+
+  /// Statistics of the last update()
+  const stats& last_stats() const { return stats_; }
+
+  /// Forgets all bodies and craft; the next update() and
+  /// probe() only record their state
+  void reset() {
+    tree_.clear();
+    leaf_.clear();
+    bodies_.clear();
+    craft_.clear();
+    radius_.clear();
+    pairs_.clear();
+  }
+
+  /// Number of bodies
+  size_t size() const { return bodies_.size(); }
+  int tree_height() const { return tree_.height(); }
+
+  /// Advances by one step from time to time + dt; pos, vel
+  /// and radius describe the bodies at the end of the step.
+  /// Appends impacts between bodies during the step to out,
+  /// sorted by time.
+  void update(const std::vector<vec3> &pos, const std::vector<vec3> &vel,
+              const std::vector<fl> &radius, fl time, fl dt,
+              std::vector<event> &out) {
+    assert(pos.size() == radius.size());
+    stats_ = stats{};
+    time_ = time;
+    dt_ = dt;
+    if (!bodies_.advance(pos, vel)) {
+      tree_.clear();
+      leaf_.clear();
+      pairs_.clear();
+    }
+    radius_ = radius;
+
+    // Refit; bodies outside their fat box are reinserted
+    const track &b = bodies_;
+    const size_t n = pos.size();
+    const bool fresh = leaf_.empty();
+    leaf_.resize(n, aabb_tree::none);
+    moved_.assign(n, fresh);
+    for (uint32_t i=0; i < n; i++) {
+      const vec3 motion = b.end[i] - b.start[i];
+      const aabb tight = swept(b.start[i], b.end[i], reach(i));
+      aabb fat{glm::min(tight.lo, tight.lo + motion*par_.look_ahead),
+               glm::max(tight.hi, tight.hi + motion*par_.look_ahead)};
+      const vec3 m{par_.margin, par_.margin, par_.margin};
+      fat.lo -= m;
+      fat.hi += m;
+
+      if (fresh)
+        leaf_[i] = tree_.insert(fat, i);
+      else
+        moved_[i] = tree_.move(leaf_[i], tight, fat);
+      stats_.reinserted += moved_[i];
+    }
+
+    // Pairs among bodies that stayed in their boxes are
+    // still candidates; the pairs of the others are found
+    // again
+    pairs_.erase(std::remove_if(pairs_.begin(), pairs_.end(),
+        [&](const std::pair<uint32_t, uint32_t> &p) {
+          return moved_[p.first] || moved_[p.second];
+        }), pairs_.end());
+    for (uint32_t i=0; i < n; i++) {
+      if (!moved_[i]) continue;
+      const aabb box = impact_box(i);
+      tree_.query(box, [&](uint32_t l) {
+        const uint32_t j = tree_.user(l);
+        // Pairs of two moved bodies are found from both
+        if (j != i && (!moved_[j] || i < j) && overlap(box, impact_box(j)))
+          pairs_.emplace_back(std::min(i, j), std::max(i, j));
+      });
+    }
+    stats_.pairs = pairs_.size();
+
+    const size_t first = out.size();
+    for (auto [i, j] : pairs_)
+      test_pair(i, j, out);
+    std::sort(out.begin() + first, out.end());
+  }
+
+  /// Appends the encounters of craft with the bodies during
+  /// the step of the last update() to out, sorted by time;
+  /// pos and vel describe the craft at the end of the step
+  void probe(const std::vector<vec3> &pos, const std::vector<vec3> &vel,
+             std::vector<event> &out) {
+    craft_.advance(pos, vel);
+    const size_t first = out.size();
+    for (uint32_t c=0; c < pos.size(); c++) {
+      tree_.query(swept(craft_.start[c], craft_.end[c], 0), [&](uint32_t l) {
+        test_craft(tree_.user(l), c, out);
+      });
+    }
+    std::sort(out.begin() + first, out.end());
+  }
+
+  /// What update() and probe() reported for the last step,
+  /// found by testing every pair; O(N²). Slow; use this to
+  /// validate the results.
+  void direct(std::vector<event> &out) const {
+    const size_t first = out.size();
+    for (uint32_t i=0; i < bodies_.size(); i++)
+      for (uint32_t j=i+1; j < bodies_.size(); j++)
+        test_pair(i, j, out);
+    for (uint32_t c=0; c < craft_.size(); c++)
+      for (uint32_t i=0; i < bodies_.size(); i++)
+        test_craft(i, c, out);
+    std::sort(out.begin() + first, out.end());
+  }
+};
+
+} // ns gassist::collide
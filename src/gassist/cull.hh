@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <array>
+#include <algorithm>
+#include <limits>
+
+#include "gassist/util.hh"
+
+namespace gassist::cull {
+
+// FRUSTUM //////////////////////////
+
+/// The six planes of the view frustum of a view/projection
+/// matrix, for testing bounding spheres against.
+struct frustum {
+  /// (normal, distance) with the normal pointing inwards and
+  /// normalized, so dot(n, p) + d is the signed distance of
+  /// p from the plane
+  std::array<vec4, 6> planes;
+
+  /// Extracts the planes from the rows of vp (Gribb &
+  /// Hartmann); glm matrices are column major.
+  explicit frustum(const mat4 &vp) {
+    auto row = [&](int r) {
+      return vec4{vp[0][r], vp[1][r], vp[2][r], vp[3][r]};
+    };
+    const vec4 x = row(0), y = row(1), z = row(2), w = row(3);
+    planes = {w + x, w - x, w + y, w - y, w + z, w - z};
+
+    for (vec4 &p : planes) {
+      fl len = glm::length(vec3{p.x, p.y, p.z});
+      p = p * (1 / len);
+    }
+  }
+
+  /// Whether any part of the sphere may be visible
+  bool visible(const vec3 &center, fl radius) const {
+    for (const vec4 &p : planes)
+      if (p.x*center.x + p.y*center.y + p.z*center.z + p.w < -radius)
+        return false;
+    return true;
+  }
+};
+
+// LEVEL OF DETAIL //////////////////
+
+/// Pixels per world unit at distance one from the camera;
+/// fov_y in radians
+inline fl projection_scale(fl fov_y, fl viewport_height) {
+  return viewport_height / (2 * std::tan(fov_y / 2));
+}
+
+/// Approximate radius in pixels of a sphere of the given
+/// radius at the given distance from the camera; infinite
+/// if the camera is inside it.
+inline fl screen_radius(fl radius, fl distance, fl proj_scale) {
+  if (distance <= radius) return std::numeric_limits<fl>::max();
+  return radius * proj_scale / distance;
+}
+
+/// The lowest subdivision level of a cube sphere (see
+/// geom::cube_sphere) whose triangle edges are no longer
+/// than edge_px pixels when drawn with the given radius in
+/// pixels; clamped to max_lv.
+///
+/// A cube sphere of level l spans a quarter circle of each
+/// great circle with 2^l edges.
+inline uint lod_level(fl screen_r, uint max_lv, fl edge_px=8) {
+  fl segments = screen_r * (tau / 4) / edge_px;
+  if (!(segments > 1)) return 0;
+  if (segments >= fl(1u << max_lv)) return max_lv;
+  return std::min<uint>(std::ceil(std::log2(segments)), max_lv);
+}
+
+// STATISTICS ///////////////////////
+
+/// What happened to the objects in one frame
+struct stats {
+  uint drawn = 0, culled = 0;
+  uint64_t triangles = 0;
+
+  void reset() { *this = stats{}; }
+};
+
+} // ns gassist::cull
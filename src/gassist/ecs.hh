@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <cassert>
+
+#include <vector>
+#include <utility>
+
+#include "gassist/util.hh"
+
+/// Entities and dense component storage.
+///
+/// An entity is just a handle; its components live in
+/// stores, each of which keeps its components as one
+/// contiguous array per field (struct of arrays), so the
+/// systems working on them walk linear memory and their
+/// loops can be vectorized. Stores keep their rows packed:
+/// removing an entity moves the last row into the gap.
+///
+/// A store is a plain struct with one std::vector per field
+/// and an index mapping entities to rows; see transforms
+/// below for an example.
+namespace gassist::ecs {
+
+// ENTITIES /////////////////////////
+
+/// Handle of an entity. The generation tells apart
+/// entities that reused the same index, so handles to
+/// destroyed entities are recognized as stale.
+struct entity {
+  uint32_t index = UINT32_MAX, generation = 0;
+
+  explicit operator bool() const { return index != UINT32_MAX; }
+
+  bool operator==(const entity &o) const {
+    return index == o.index && generation == o.generation;
+  }
+  bool operator!=(const entity &o) const { return !(*this == o); }
+};
+
+/// Hands out entity handles; indices of destroyed entities
+/// are reused with the next generation
+class registry {
+  std::vector<uint32_t> generations_;
+  std::vector<uint32_t> free_;
+
+public:
+  entity create() {
+    if (free_.empty()) {
+      generations_.push_back(0);
+      return {uint32_t(generations_.size() - 1), 0};
+    }
+    uint32_t i = free_.back();
+    free_.pop_back();
+    return {i, generations_[i]};
+  }
+
+  /// Invalidates all handles to e; the components of e must
+  /// be removed from the stores separately
+  void destroy(entity e) {
+    if (!alive(e)) return;
+    generations_[e.index]++;
+    free_.push_back(e.index);
+  }
+
+  bool alive(entity e) const {
+    return e.index < generations_.size()
+        && generations_[e.index] == e.generation;
+  }
+
+  /// Number of live entities
+  size_t size() const { return generations_.size() - free_.size(); }
+};
+
+// STORES ///////////////////////////
+
+/// The bookkeeping of a store: which entity owns each row
+/// and which row belongs to each entity (a sparse set)
+class index {
+  std::vector<entity> owners_;
+  /// By entity index
+  std::vector<uint32_t> rows_;
+
+public:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  size_t size() const { return owners_.size(); }
+  bool empty() const { return owners_.empty(); }
+
+  entity owner(size_t row) const { return owners_[row]; }
+  const std::vector<entity>& owners() const { return owners_; }
+
+  /// The row of e; none if e has no row or is stale
+  uint32_t row(entity e) const {
+    if (e.index >= rows_.size()) return none;
+    uint32_t r = rows_[e.index];
+    return r != none && owners_[r] == e ? r : none;
+  }
+
+  bool contains(entity e) const { return row(e) != none; }
+
+  /// Adds a row for e at the end and returns it; the store
+  /// must append to each of its fields
+  size_t insert(entity e) {
+    assert(!contains(e));
+    if (e.index >= rows_.size()) rows_.resize(e.index + 1, none);
+    rows_[e.index] = owners_.size();
+    owners_.push_back(e);
+    return owners_.size() - 1;
+  }
+
+  /// Removes the row of e by moving the last row into its
+  /// place, in the index and in all the given fields;
+  /// returns false if e has no row
+  template<typename... Fields>
+  bool erase(entity e, Fields&... fields) {
+    const uint32_t r = row(e);
+    if (r == none) return false;
+    const size_t last = owners_.size() - 1;
+
+    auto move_last = [&](auto &f) {
+      f[r] = std::move(f[last]);
+      f.pop_back();
+    };
+    (move_last(fields), ...);
+
+    rows_[owners_[last].index] = r;
+    owners_[r] = owners_[last];
+    owners_.pop_back();
+    rows_[e.index] = none;
+    return true;
+  }
+};
+
+/// Where things are and where they are facing: location
+/// as a store.
+///
+/// at() returns a reference to a row that works with the
+/// pos(), focus() and roll() customization points (see
+/// util.hh), just like a location does.
+struct transforms {
+  ecs::index rows;
+  std::vector<vec3> pos, focus;
+  std::vector<fl> roll;
+
+  /// One row; only valid until rows are added or removed
+  struct ref {
+    transforms *t;
+    size_t row;
+
+    vec3& pos()   { return t->pos[row]; }
+    vec3& focus() { return t->focus[row]; }
+    fl& roll()    { return t->roll[row]; }
+  };
+
+  size_t size() const { return rows.size(); }
+
+  size_t add(entity e, const location &l) {
+    size_t r = rows.insert(e);
+    pos.push_back(l.pos_);
+    focus.push_back(l.focus_);
+    roll.push_back(l.roll_);
+    return r;
+  }
+
+  bool remove(entity e) {
+    return rows.erase(e, pos, focus, roll);
+  }
+
+  /// e must have a row
+  ref at(entity e) {
+    assert(rows.contains(e));
+    return {this, rows.row(e)};
+  }
+
+  location get(entity e) const {
+    const size_t r = rows.row(e);
+    assert(r != index::none);
+    return {pos[r], focus[r], roll[r]};
+  }
+
+  void set(entity e, const location &l) {
+    ref x = at(e);
+    gassist::pos(x) = l.pos_;
+    gassist::focus(x) = l.focus_;
+    gassist::roll(x) = l.roll_;
+  }
+};
+
+} // ns gassist::ecs
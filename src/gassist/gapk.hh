@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <utility>
+
+#include "gassist/exception.hh"
+#include "gassist/util.hh"
+
+/// Packed asset archive (.gapk files).
+///
+/// Bundles all the assets into a single file so they can be
+/// loaded with one mmap at startup; loading an asset is a
+/// hash table lookup returning a pointer into the mapping.
+/// Produced offline by the gapk tool from the asset
+/// pipeline.
+///
+/// Layout (all integers little endian):
+///
+///   header            32 bytes
+///   slot[no_slots]    32 bytes each; open addressing hash
+///                     table (linear probing) keyed by the
+///                     fnv1a hash of the path
+///   names             the paths, not null terminated
+///   data              each file aligned to 64 bytes
+///
+/// Paths are relative and use '/' (e.g.
+/// "shaders/line/main.vert.glsl").
+///
+/// This header has no GL dependencies so it can be used by
+/// the offline tools.
+namespace gassist::gapk {
+
+// FORMAT ///////////////////////////
+
+struct header {
+  char magic[4];
+  uint32_t version;
+  uint32_t no_entries;
+  /// Size of the hash table; a power of two
+  uint32_t no_slots;
+  /// Offset and length of the names block
+  uint64_t names_offset, names_size;
+};
+
+struct slot {
+  /// fnv1a of the path; unused slots have name_size 0
+  uint64_t hash;
+  /// Offset from the start of the file and length in bytes
+  uint64_t offset, size;
+  /// Offset into the names block and length of the path
+  uint32_t name_offset, name_size;
+};
+
+static_assert(sizeof(header) == 32, "Unexpected header padding");
+static_assert(sizeof(slot) == 32, "Unexpected slot padding");
+
+constexpr char magic[4] = {'G', 'A', 'P', 'K'};
+constexpr uint32_t version = 1;
+constexpr size_t alignment = 64;
+
+inline uint64_t hash(std::string_view path) {
+  return fnv1a(path.data(), path.size());
+}
+
+// READING //////////////////////////
+
+/// A parsed archive; points into the memory it was parsed
+/// from
+struct view {
+  const header *head;
+  const slot *slots;
+  const char *base;
+
+  std::string_view name(const slot &s) const {
+    return {base + head->names_offset + s.name_offset, s.name_size};
+  }
+
+  /// The contents of the file at path, if there is one
+  std::optional<std::string_view> find(std::string_view path) const {
+    const uint64_t h = hash(path);
+    const uint32_t mask = head->no_slots - 1;
+    for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+      const slot &s = slots[i];
+      if (s.name_size == 0) return std::nullopt;
+      if (s.hash == h && name(s) == path)
+        return std::string_view{base + s.offset, s.size};
+    }
+  }
+
+  /// Calls f(path, contents) for every file
+  template<typename F>
+  void for_each(F &&f) const {
+    for (uint32_t i=0; i < head->no_slots; i++)
+      if (slots[i].name_size != 0)
+        f(name(slots[i]),
+          std::string_view{base + slots[i].offset, slots[i].size});
+  }
+};
+
+/// Parses and validates an archive in memory; throws
+/// msg_exception if it is malformed
+inline view parse(const char *data, size_t len) {
+  if (len < sizeof(header))
+    throw msg_exception{"Archive truncated"};
+
+  view v;
+  v.base = data;
+  v.head = (const header*)data;
+  v.slots = (const slot*)(data + sizeof(header));
+
+  const header &h = *v.head;
+  if (std::memcmp(h.magic, magic, 4) != 0)
+    throw msg_exception{"Not an asset archive"};
+  if (h.version != version)
+    throw msg_exception{"Unsupported asset archive version"};
+  // At least one free slot, so lookups terminate
+  if (h.no_slots == 0 || (h.no_slots & (h.no_slots - 1)) != 0
+      || h.no_entries >= h.no_slots
+      || sizeof(header) + uint64_t{h.no_slots}*sizeof(slot) > len
+      || h.names_offset > len || h.names_size > len - h.names_offset)
+    throw msg_exception{"Asset archive has a bad index"};
+
+  uint32_t used = 0;
+  for (uint32_t i=0; i < h.no_slots; i++) {
+    const slot &s = v.slots[i];
+    if (s.name_size == 0) continue;
+    used++;
+    if (s.name_offset > h.names_size
+        || s.name_size > h.names_size - s.name_offset
+        || s.offset > len || s.size > len - s.offset
+        || s.hash != hash(v.name(s)))
+      throw msg_exception{"Asset archive has a bad entry"};
+  }
+  if (used != h.no_entries)
+    throw msg_exception{"Asset archive has a bad index"};
+
+  return v;
+}
+
+// WRITING //////////////////////////
+
+/// Serializes the given (path, contents) pairs as an
+/// archive; throws msg_exception on duplicate paths
+inline std::vector<char> build(
+    const std::vector<std::pair<std::string, std::vector<char>>> &files) {
+  auto align = [](size_t v) {
+    return (v + alignment - 1) / alignment * alignment;
+  };
+
+  // Load factor of at most one half
+  uint32_t no_slots = 1;
+  while (no_slots < 2*files.size() + 1) no_slots *= 2;
+
+  std::vector<slot> slots(no_slots, slot{0, 0, 0, 0, 0});
+  std::string names;
+  for (auto &[path, contents] : files) {
+    if (path.empty())
+      throw msg_exception{"Empty path in asset archive"};
+
+    const uint64_t h = hash(path);
+    uint32_t i = h & (no_slots - 1);
+    for (; slots[i].name_size != 0; i = (i + 1) & (no_slots - 1))
+      if (slots[i].hash == h
+          && names.compare(slots[i].name_offset, slots[i].name_size, path) == 0)
+        throw msg_exception{"Duplicate path in asset archive: " + path};
+
+    slots[i].hash = h;
+    slots[i].size = contents.size();
+    slots[i].name_offset = names.size();
+    slots[i].name_size = path.size();
+    names += path;
+  }
+
+  header head;
+  std::memcpy(head.magic, magic, 4);
+  head.version = version;
+  head.no_entries = files.size();
+  head.no_slots = no_slots;
+  head.names_offset = sizeof(header) + no_slots*sizeof(slot);
+  head.names_size = names.size();
+
+  std::vector<char> out(align(head.names_offset + names.size()));
+  std::memcpy(out.data(), &head, sizeof(head));
+  std::memcpy(out.data() + head.names_offset, names.data(), names.size());
+
+  // Data in the order the files were given
+  for (auto &[path, contents] : files) {
+    const uint64_t h = hash(path);
+    uint32_t i = h & (no_slots - 1);
+    while (slots[i].hash != h
+        || names.compare(slots[i].name_offset, slots[i].name_size, path) != 0)
+      i = (i + 1) & (no_slots - 1);
+
+    slots[i].offset = out.size();
+    out.insert(out.end(), contents.begin(), contents.end());
+    out.resize(align(out.size()));
+  }
+
+  std::memcpy(out.data() + sizeof(header), slots.data(),
+              slots.size()*sizeof(slot));
+  return out;
+}
+
+} // ns gassist::gapk
@@ -1,21 +1,80 @@
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
 
 #include <thread>
 #include <atomic>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <optional>
+#include <variant>
 
 #include <epoxy/gl.h>
 
 #include <softwear/thread_pool.hpp>
 
 #include "gassist/util.hh"
+#include "gassist/lockfree.hh"
+#include "gassist/arena.hh"
+#include "gassist/simd.hh"
+#include "gassist/jobs.hh"
+#include "gassist/ecs.hh"
+#include "gassist/nbody.hh"
+#include "gassist/trajectory.hh"
+#include "gassist/integrate.hh"
+#include "gassist/collide.hh"
+#include "gassist/geometry.hh"
+#include "gassist/cull.hh"
+#include "gassist/terrain.hh"
+#include "gassist/watch.hh"
 
 #include "gassist/wrap_glfw.hh"
 #include "gassist/wrap_gl.hh"
+#include "gassist/uniform.hh"
+#include "gassist/wrap_egl.hh"
 
 #include "gassist/asset.hh"
+#include "gassist/render.hh"
+#include "gassist/profile.hh"
 
 using namespace gassist;
 
+#ifdef GASSIST_COUNT_ALLOCS
+
+// Counts heap allocations for --bench alloc by replacing
+// the global operator new; never in a regular build
+
+std::atomic<size_t> no_heap_allocs{0};
+
+void* operator new(size_t n) {
+  no_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc{};
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+#endif
+
+/// Number of heap allocations made so far; empty unless
+/// built with GASSIST_COUNT_ALLOCS
+std::optional<size_t> heap_allocs() {
+#ifdef GASSIST_COUNT_ALLOCS
+  return no_heap_allocs.load();
+#else
+  return std::nullopt;
+#endif
+}
+
 float lininterp(float a, float b, float fac) {
   return a + (b-a)*fac;
 }
@@ -26,55 +85,186 @@ vec3 lininterp(const vec3 &a, const vec3 &b, float fac) {
           lininterp(a.z, b.z, fac)};
 }
 
-template<typename OutItr>
-void linsubdivide_face_(const vec3 &a, const vec3 &b, const vec3 &c,
-                        uint lv, OutItr &out) {
-  if (lv == 0) {
-    *out = a; ++out;
-    *out = b; ++out;
-    *out = c; ++out;
-    return;
-  }
-
-  uint lk = lv-1;
-  auto d = lininterp(a, b, 0.5f),
-       e = lininterp(a, c, 0.5f),
-       f = lininterp(b, c, 0.5f);
-
-  linsubdivide_face_(a, d, e, lk, out);
-  linsubdivide_face_(b, d, f, lk, out);
-  linsubdivide_face_(c, e, f, lk, out);
-  linsubdivide_face_(d, e, f, lk, out);
+location lininterp(location a, location b, float fac) {
+  return {lininterp(pos(a), pos(b), fac),
+          lininterp(focus(a), focus(b), fac),
+          lininterp(roll(a), roll(b), fac)};
 }
 
-template<typename Cont>
-std::vector<vec3> linsubdivide(const Cont &c, uint lv) {
-  std::vector<vec3> out;
-  out.resize(c.size()*(uint)std::pow(4, lv));
-  auto out_itr = out.begin();
-  for (size_t i=0; i<c.size(); i+=3)
-    linsubdivide_face_(c[i], c[i+1], c[i+2], lv, out_itr);
-  return out;
-}
+////////////// WORLD ///////////////////////
+
+/// How a celestial body is drawn
+enum class body_mesh : uint8_t {
+  /// Plain sphere; the level of detail depends on the size
+  /// on screen
+  sphere,
+  /// Sphere with terrain (see terrain.hh)
+  terrain
+};
 
+/// Textures of the scene; the renderer maps them to its
+/// cube maps
+enum class body_texture : uint8_t {
+  blue_marble
+};
 
-// TODO: Use ranges/iterators
-std::array<vec3, 3*2*6> __cube_verts() {
-  vec3 a={1,1, 1}, b={-1,1, 1}, c={-1,-1, 1}, d={1,-1, 1},
-       e={1,1,-1}, f={-1,1,-1}, g={-1,-1,-1}, h={1,-1,-1};
-  return {a,b,c, a,c,d,  e,f,g, e,g,h,  // front back
-          a,d,e, d,e,h,  b,c,f, c,f,g,  // right left
-          a,b,e, b,e,f,  c,d,g, d,g,h}; // top   bottom
-}
-const auto cube_verts = __cube_verts();
+/// The celestial bodies: Their physical state and how to
+/// draw them, one row per body.
+///
+/// The physical state is kept in the nbody::bodies layout,
+/// so the force calculation and the integrators work on the
+/// store directly.
+struct celestial_store {
+  ecs::index rows;
+  nbody::bodies bodies;
+  std::vector<fl> radius;
+  std::vector<body_mesh> mesh;
+  std::vector<body_texture> texture;
+
+  size_t size() const { return rows.size(); }
+
+  size_t add(ecs::entity e, fl mass, const vec3 &p, const vec3 &v, fl r,
+             body_mesh m, body_texture t=body_texture::blue_marble) {
+    size_t row = rows.insert(e);
+    bodies.add(mass, p, v);
+    radius.push_back(r);
+    mesh.push_back(m);
+    texture.push_back(t);
+    return row;
+  }
+
+  bool remove(ecs::entity e) {
+    return rows.erase(e, bodies.mass, bodies.pos, bodies.vel,
+                      radius, mesh, texture);
+  }
+};
+
+/// Something that happened to the ship or between two
+/// bodies during a tick
+struct encounter {
+  collide::kind kind;
+  /// The body; for impacts between two bodies also other,
+  /// which is null for encounters of the ship
+  ecs::entity body, other;
+  /// When it happened; the distance of the centers
+  fl time, distance;
+};
 
-std::vector<vec3> __sphere_verts(uint lv) {
-  std::vector<vec3> out = linsubdivide(cube_verts, lv);
-  for (auto &v : out)
-    v = glm::normalize(v);
-  return out;
+/// The state of the simulated world at a single tick
+struct world {
+  /// Number of ticks simulated so far
+  uint64_t tick = 0;
+
+  /// Simulated time in seconds
+  fl time = 0;
+
+  /// Everything in the world is an entity with components
+  /// in the stores below
+  ecs::registry entities;
+  ecs::transforms transforms;
+  celestial_store celestials;
+
+  /// Where we are looking from; has a transform
+  ecs::entity camera;
+
+  /// The player's space craft; massless
+  traj::ship_state ship;
+
+  /// Bodies lighter than this do not pull the ship (and
+  /// are ignored by the prediction)
+  fl attractor_mass = 1e-3f;
+
+  /// Burns the ship will execute, sorted by tick; relative
+  /// to the first body
+  std::vector<traj::maneuver> maneuvers;
+
+  /// What happened during the last tick, in order
+  std::vector<encounter> encounters;
+};
+
+/// What the simulation publishes to the renderer:
+/// The last two ticks, so the renderer can interpolate
+/// between them.
+struct world_snapshot {
+  world prev, cur;
+
+  /// When cur was computed
+  std::chrono::steady_clock::time_point time;
+};
+
+/// The scene we start with: A planet with a moon
+/// in a circular orbit around it and an asteroid belt
+/// between the two
+world initial_world() {
+  world w;
+
+  w.camera = w.entities.create();
+  w.transforms.add(w.camera, {{0, 10, 8}, {0, -10, -8}, 0});
+
+  fl M = 10, m = 0.1f, r = 6;
+  fl v = std::sqrt(M / r); // G=1
+  w.celestials.add(w.entities.create(), M, {0, 0, 0}, {0, 0, -v*m/M},
+                   1, body_mesh::terrain);
+  w.celestials.add(w.entities.create(), m, {r, 0, 0}, {0, 0, v},
+                   0.5f, body_mesh::terrain);
+
+  // Fixed seed; the scene should be the same every run
+  std::mt19937 rng{42};
+  std::uniform_real_distribution<fl>
+    belt_r{2.5f, 4}, angle{0, tau}, jitter{-0.05f, 0.05f},
+    size{0.01f, 0.04f};
+  for (int i=0; i < 2000; i++) {
+    fl ra = belt_r(rng), phi = angle(rng), va = std::sqrt(M / ra);
+    vec3 dir{std::cos(phi), 0, std::sin(phi)};
+    // In this order; arguments are evaluated in any order
+    fl y = jitter(rng), rad = size(rng);
+    w.celestials.add(w.entities.create(), 1e-6f,
+        dir*ra + vec3{0, y, 0}, vec3{-dir.z, 0, dir.x}*va,
+        rad, body_mesh::sphere);
+  }
+
+  // The ship starts in a low circular orbit
+  fl rs = 1.8f;
+  w.ship = {{0, 0, rs}, {-std::sqrt(M / rs), 0, 0}};
+
+  return w;
 }
 
+////////////// EVENTS //////////////////////
+
+/// The window size changed
+struct resize_event {
+  vec2 size;
+};
+
+/// The mouse was moved by delta pixels while the given
+/// buttons where held
+struct mouse_event {
+  vec2 delta;
+  bool left, middle, shift;
+};
+
+/// A key was pressed
+struct key_event {
+  int key;
+};
+
+/// The window was closed; the receiving thread should exit
+struct close_event {};
+
+typedef std::variant<resize_event, mouse_event,
+                     key_event, close_event> event;
+
+/// Queue for events from the input thread to one of the
+/// other threads; drained once per tick or frame
+typedef spsc_queue<event, 256> event_queue;
+
+/// Helper for visiting an event with a set of lambdas
+template<typename... Fs> struct overloaded : Fs... {
+  using Fs::operator()...;
+};
+template<typename... Fs> overloaded(Fs...) -> overloaded<Fs...>;
+
 /// Program state that is shared between threads
 struct shared_state {
   //// BASIC VARIABLES ////
@@ -82,127 +272,1466 @@ struct shared_state {
   /// The window we're drawing in
   glfw::window win{"Gravity Assist"};
 
-  /// The size of the window W
-  vec2 win_size{1,1};
-  // NOTE: Storing this in the state and loading it in
-  // the input thread because we don't know what kind of
-  // performance input this has.
-  // NOTE: We should move this to a store in glfw::window
-  // and update via events, but the glfw events are not
-  // very convenient (won't allow passing the address of
-  // the c++ wrapper to the callback)
-  // NOTE: Initializing not to zero in order to avoid
-  // division by zero errors on start
-
-  /// Indicates to the drawing thread that a resize of the
-  /// viewport is necessary
-  std::atomic<bool> opengl_needs_resize{false};
-  // TODO: Later we should introduce a signaling queue with
-  // signals indicating those kinds of events
-
-  /// Set to false to stop the program
-  std::atomic<bool> stop{false};
+  /// Events from the input thread; camera navigation and
+  /// maneuver planning go to the simulation, window events
+  /// to drawing
+  event_queue sim_events, draw_events;
+
+  /// Workers for background jobs like asset loading
+  job_pool workers;
+
+  /// Where assets and shaders are loaded from
+  asset::load_path assets;
 
   //// WORLD STATE ////
 
-  /// Where the camera is at
-  location cam{
-    {0,  10,  8},
-    {0, -10, -8},
-    0
-  };
+  /// Snapshots of the world; written by the simulation
+  /// thread, read by the drawing thread
+  triple_buffer<world_snapshot> world_buf;
 
   //// SETTINGS ////
 
   // y axis field of view in degrees
   float fov = 110;
+
+  /// How many frames the CPU may queue ahead of the GPU
+  /// (1-3); more is faster, less has lower latency.
+  /// Can be changed at runtime with the keys 1-3.
+  uint frames_in_flight = 2;
+
+  /// Where to periodically write frame time statistics;
+  /// "-" for stdout, empty to disable profiling.
+  /// Set from the GASSIST_PROFILE environment variable.
+  std::string profile_output;
+
+  /// Length of a single simulation tick
+  std::chrono::nanoseconds tick{std::chrono::seconds{1}/120};
+
+  /// How many ticks ahead the path of the ship is predicted
+  size_t prediction_ticks = 10000;
+
+  //// TRAJECTORY PREDICTION ////
+
+  /// Requested by the simulation thread, read by the
+  /// drawing thread; runs on the workers
+  traj::async_predictor predictor{workers, prediction_ticks,
+      std::chrono::duration<fl>{tick}.count()};
+};
+
+////////////// SIMULATION ////////////////////
+
+/// What step_world() keeps between ticks: scratch buffers
+/// and the collision detector, which remembers where the
+/// bodies were. Use the same one for every tick of a world.
+struct step_state {
+  /// The bodies are swapped in for each step
+  integrate::simulation<traj::integrator, integrate::tree_gravity> bodies;
+  traj::ship_simulation ship;
+  nbody::bodies attractors;
+  std::vector<vec3> vel;
+  collide::detector collisions;
+  std::vector<vec3> ship_pos, ship_vel;
+  std::vector<collide::event> events;
 };
 
+/// Advances the world by one tick of length dt
+void step_world(world &w, step_state &st, fl dt) {
+  nbody::bodies &b = w.celestials.bodies;
+
+  // The ship only feels the attractors at the start of the
+  // tick, through the same integrator and force as the
+  // trajectory predictor
+  const nbody::bodies &att = st.attractors;
+  traj::select_attractors(b, w.attractor_mass, st.attractors);
+  if (!att.empty())
+    traj::execute_maneuvers(w.ship, att.pos[0], w.maneuvers, w.tick);
+  auto done = std::upper_bound(w.maneuvers.begin(), w.maneuvers.end(), w.tick,
+      [](uint64_t t, const traj::maneuver &m) { return t < m.tick; });
+  w.maneuvers.erase(w.maneuvers.begin(), done);
+
+  nbody::bodies &ship = st.ship.bodies;
+  if (ship.empty()) ship.add(0, w.ship.pos);
+  ship.pos[0] = w.ship.pos;
+  ship.vel[0] = w.ship.vel;
+  st.ship.force.pos = att.pos.data();
+  st.ship.force.mass = att.mass.data();
+  st.ship.force.n = att.size();
+  // The attractors moved since the last step
+  st.ship.integrator.reset();
+  st.ship.step(dt);
+
+  st.vel = b.vel;
+  std::swap(st.bodies.bodies, b);
+  st.bodies.step(dt);
+  std::swap(st.bodies.bodies, b);
+
+  // Everything moved on a straight line during the tick
+  // as far as the collision tests are concerned. They need
+  // the velocities at the new positions, which may lag
+  // behind the ones just integrated.
+  const fl lag = traj::integrator::velocity_lag;
+  for (size_t i=0; i < b.size(); i++)
+    st.vel[i] = b.vel[i] + (b.vel[i] - st.vel[i]) * lag;
+  const celestial_store &cs = w.celestials;
+  st.ship_pos.assign(1, ship.pos[0]);
+  st.ship_vel.assign(1, ship.vel[0] + (ship.vel[0] - w.ship.vel) * lag);
+  w.ship = {ship.pos[0], ship.vel[0]};
+
+  st.events.clear();
+  st.collisions.update(b.pos, st.vel, cs.radius, w.time, dt, st.events);
+  st.collisions.probe(st.ship_pos, st.ship_vel, st.events);
+  std::sort(st.events.begin(), st.events.end());
+  w.encounters.clear();
+  for (const collide::event &e : st.events)
+    w.encounters.push_back({e.kind, cs.rows.owner(e.body),
+        e.other == collide::event::none ? ecs::entity{}
+                                        : cs.rows.owner(e.other),
+        e.time, e.distance});
+
+  w.tick++;
+  w.time += dt;
+}
+
+/// Orbits/zooms the camera around the origin according
+/// to a mouse movement; works on anything with pos() and
+/// focus() (a location, a row of ecs::transforms)
+template<typename T>
+void navigate(T &cam, const mouse_event &e) {
+  if (e.middle || (e.left && e.shift)) { // zoom
+    float mag = e.delta.y - e.delta.x;
+    pos(cam) *= std::pow(10, mag/500);
+
+  } else if (e.left) {
+    auto alt_axis =
+        rotate(90, vec3{0, 1, 0})
+      * glm::normalize(pos(cam) * vec3{1, 0, 1});
+
+    pos(cam) = rotate(-e.delta.x/40, {0, 1, 0})
+             * rotate(-e.delta.y/40, alt_axis)
+             * pos(cam);
+
+    // Note: We're orbiting around 0, 0, 0
+    focus(cam) = vec3{0, 0, 0} - pos(cam);
+  }
+}
+
+/// Edits the next planned maneuver of the ship (creating
+/// one five seconds ahead if there is none): up/down change
+/// the prograde delta v, left/right move it in time
+void plan_maneuver(world &w, int key) {
+  if (w.maneuvers.empty())
+    w.maneuvers.push_back({w.tick + 600, {0, 0, 0}});
+
+  traj::maneuver &m = w.maneuvers.front();
+  switch (key) {
+    case GLFW_KEY_UP:    m.dv.x += 0.02f; break;
+    case GLFW_KEY_DOWN:  m.dv.x -= 0.02f; break;
+    case GLFW_KEY_RIGHT: m.tick += 30; break;
+    case GLFW_KEY_LEFT:
+      m.tick = m.tick > w.tick + 31 ? m.tick - 30 : w.tick + 1;
+      break;
+  }
+}
+
+void sim_thr(shared_state &s) {
+  typedef std::chrono::steady_clock clock;
+
+  const fl dt = std::chrono::duration<fl>{s.tick}.count();
+
+  world w = initial_world(), prev = w;
+  step_state st;
+
+  auto next = clock::now();
+  bool stop = false;
+  while (!stop) {
+    prev = w;
+    s.sim_events.drain([&](const event &ev) {
+      std::visit(overloaded{
+        [&](const mouse_event &e) {
+          auto cam = w.transforms.at(w.camera);
+          navigate(cam, e);
+        },
+        [&](const key_event &e) { plan_maneuver(w, e.key); },
+        [&](const close_event&) { stop = true; },
+        [](const auto&) {}
+      }, ev);
+    });
+    step_world(w, st, dt);
+
+    // Assigning reuses the buffers of the slot
+    world_snapshot &snap = s.world_buf.back();
+    snap.prev = prev;
+    snap.cur = w;
+    snap.time = clock::now();
+    s.world_buf.publish();
+
+    s.predictor.request(w.tick, w.ship, w.celestials.bodies,
+                        w.attractor_mass, w.maneuvers);
+    s.predictor.poll();
+
+    // Fixed time step; if we fell behind by more than a
+    // few ticks we give up on catching up instead of
+    // spiraling into ever longer catch up phases
+    next += s.tick;
+    auto now = clock::now();
+    if (now - next > 4*s.tick)
+      next = now;
+    std::this_thread::sleep_until(next);
+  }
+}
+
 ////////////// DRAWING ///////////////////////
 
-void draw_thr(shared_state &s) {
-  // We should have something nicer for this.
-  // Window should implicitly create the context
-  // and allow it to be used from another thread
-  s.win.make_gl_context();
+gl::mesh upload(const geom::indexed_mesh &m) {
+  return {m.vertices, m.indices};
+}
 
-  // TODO: Depth buffer
-  glEnable(GL_DEPTH_TEST);
+/// Paints the world; owns all the GL resources needed for
+/// that. Must be created and used on a thread with a
+/// current GL context.
+struct scene_renderer {
+  // Asset paths of the programs and textures below
+  static constexpr const char
+    *default_prog_dir = "shaders/roundcube",
+    *line_prog_dir = "shaders/line",
+    *skybox_dir = "assets/poods_milky_way",
+    *blue_marble_dir = "assets/blue_marble";
 
+  const asset::load_path &assets;
+  job_pool &workers;
 
-  gl::program default_prog = asset::load_gl_program("shaders/roundcube");
-  asset::cubemap skybox{"assets/poods_milky_way"};
-  asset::cubemap blue_marble{"assets/blue_marble"};
+  /// Quad spheres of increasing subdivision level; built
+  /// before the cubemaps queue their decoding on the workers
+  static constexpr uint max_lod = 7;
+  std::vector<gl::mesh> spheres;
 
-  // TODO: We need a generic, compile time soluition
-  // for representing shader parameters
-  GLint param_mvp = glGetUniformLocation(default_prog.id(), "mvp");
+  gl::program default_prog, line_prog;
+  asset::cubemap skybox, blue_marble;
 
-  gl::mesh cube{cube_verts};
-  gl::mesh sphere{__sphere_verts(5)};
+  /// Reloaded cubemaps that are still decoding; they
+  /// replace the ones above once complete
+  std::unique_ptr<asset::cubemap> skybox_next, blue_marble_next;
 
-  // TODO: Error handling: is the extension loaded?
-  glfwSwapInterval(1);
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  /// Superseded or failed reloads whose decoding jobs are
+  /// still running; destroying them would block until the
+  /// jobs are done, so they are freed once idle
+  std::vector<std::unique_ptr<asset::cubemap>> retired;
+
+  /// Moves c to the retired cubemaps
+  void retire(std::unique_ptr<asset::cubemap> &c) {
+    if (c) retired.push_back(std::move(c));
+  }
+
+  /// Texture data uploaded per frame while loading
+  size_t upload_bytes = 8 << 20;
+  std::chrono::microseconds upload_time{2000};
 
-  mat4 vp; // View-projection matrix
+  gl::uniform_ring<gl::frame_uniforms> frame_params;
 
-  auto draw = [&](auto &obj, const mat4 &m) {
-    // TODO: We need a more generic way of expressing this
-    mat4 mvp = vp * m;
-    glUniformMatrix4fv(param_mvp, 1, GL_FALSE, &mvp[0][0]);
-    obj.draw();
+  gl::mesh cube = upload(geom::cube()),
+           rock = upload(geom::icosphere(1));
+
+  /// Terrain of the bodies drawn with body_mesh::terrain,
+  /// by entity index; owner tells whether it still belongs
+  /// to the same entity
+  struct terrain_slot {
+    ecs::entity owner;
+    std::unique_ptr<terrain::planet> planet;
   };
+  std::vector<terrain_slot> terrains;
+
+  /// What happened in the last frame
+  cull::stats culling;
+
+  render_queue queue;
+
+  /// Predicted path of the ship
+  gl::line_strip path;
+
+  /// quad_sphere(0) to quad_sphere(max_lod), generated
+  /// on the pool
+  static std::vector<gl::mesh> build_spheres(job_pool &pool) {
+    std::vector<gl::mesh> r;
+    r.reserve(max_lod + 1);
+    for (uint lv=0; lv <= max_lod; lv++)
+      r.push_back(upload(geom::quad_sphere(lv, &pool)));
+    return r;
+  }
+
+  scene_renderer(job_pool &workers_, const asset::load_path &assets_)
+      : assets{assets_}, workers{workers_},
+        spheres(build_spheres(workers)),
+        default_prog{asset::load_gl_program(assets, default_prog_dir)},
+        line_prog{asset::load_gl_program(assets, line_prog_dir)},
+        skybox{workers, assets, skybox_dir},
+        blue_marble{workers, assets, blue_marble_dir} {
+    gl::bind_uniform_block<gl::frame_uniforms>(default_prog);
+    gl::bind_uniform_block<gl::frame_uniforms>(line_prog);
+
+    // TODO: Depth buffer
+    glEnable(GL_DEPTH_TEST);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  }
+
+  /// Replaces the predicted path that is drawn
+  void set_path(const traj::trajectory &t) {
+    path.upload(t.points.data(), t.points.size());
+  }
+
+  //// HOT RELOAD ////
+
+  /// Every asset file the scene is built from
+  static std::vector<std::string> asset_files() {
+    std::vector<std::string> r;
+    for (const char *dir : {default_prog_dir, line_prog_dir})
+      for (const char *f : {"/main.vert.glsl", "/main.frag.glsl"})
+        r.push_back(std::string{dir} + f);
+    for (const char *dir : {skybox_dir, blue_marble_dir})
+      for (auto &f : asset::cubemap::files(dir))
+        r.push_back(f);
+    return r;
+  }
+
+  /// Runs f; logs the error and returns false if it throws
+  template<typename F>
+  static bool log_failure(const char *what, const char *consequence, F &&f) {
+    try {
+      f();
+      return true;
+    } catch (const std::exception &e) {
+      std::cerr << what << ": " << e.what() << "; " << consequence << "\n";
+    } catch (const errno_exception &e) {
+      std::cerr << what << ": " << e.what() << "; " << consequence << "\n";
+    }
+    return false;
+  }
+
+  /// Rebuilds everything depending on the changed files;
+  /// call between frames.
+  ///
+  /// Programs are recompiled right away; if that fails the
+  /// error is logged and the old program stays in use.
+  /// Cubemaps are decoded in the background and swapped in
+  /// by poll_reloads() once they are complete.
+  void reload(const std::vector<std::string> &changed) {
+    auto affected = [&](const std::string &dir) {
+      for (auto &f : changed)
+        if (f.size() > dir.size() && f.compare(0, dir.size(), dir) == 0
+            && f[dir.size()] == '/')
+          return true;
+      return false;
+    };
+
+    for (auto [dir, prog] : {std::pair{default_prog_dir, &default_prog},
+                             std::pair{line_prog_dir, &line_prog}}) {
+      if (!affected(dir)) continue;
+      const char *d = dir;
+      gl::program *p = prog;
+      log_failure(d, "keeping the old program", [&]() {
+        gl::program nu = asset::load_gl_program(assets, d);
+        gl::bind_uniform_block<gl::frame_uniforms>(nu);
+        *p = std::move(nu);
+        std::cerr << d << ": reloaded\n";
+      });
+    }
+
+    for (auto [dir, next] : {std::pair{skybox_dir, &skybox_next},
+                             std::pair{blue_marble_dir, &blue_marble_next}}) {
+      if (!affected(dir)) continue;
+      const char *d = dir;
+      auto *n = next;
+      retire(*n);
+      log_failure(d, "keeping the old texture", [&]() {
+        n->reset(new asset::cubemap{workers, assets, d});
+      });
+    }
+  }
+
+  /// Swaps in reloaded cubemaps that finished loading and
+  /// frees the retired ones that became idle
+  void poll_reloads(asset::upload_budget &budget) {
+    retired.erase(std::remove_if(retired.begin(), retired.end(),
+        [](const auto &c) { return !c->busy(); }), retired.end());
+
+    for (auto [dir, cur, next] : {
+        std::tuple{skybox_dir, &skybox, &skybox_next},
+        std::tuple{blue_marble_dir, &blue_marble, &blue_marble_next}}) {
+      if (!*next) continue;
+      const char *d = dir;
+      asset::cubemap *c = cur;
+      auto *n = next;
+      bool ok = log_failure(d, "keeping the old texture", [&]() {
+        if ((*n)->poll(budget)) {
+          c->swap(**n);
+          n->reset();
+          std::cerr << d << ": reloaded\n";
+        }
+      });
+      if (!ok) retire(*n);
+    }
+  }
 
-  auto use = [](auto &obj) { return obj.use(); };
+  asset::cubemap& texture(body_texture t) {
+    switch (t) {
+      case body_texture::blue_marble: return blue_marble;
+    }
+    return blue_marble;
+  }
 
-  use(default_prog);
-  while (!s.stop) {
-    // Make a snapshot of the state
-    // (just in case it changes concurrently)
-    location cam = s.cam;
+  /// The terrain of e; created on first use
+  terrain::planet& terrain_of(ecs::entity e) {
+    if (terrains.size() <= e.index) terrains.resize(e.index + 1);
+    terrain_slot &s = terrains[e.index];
+    if (!s.planet || s.owner != e) {
+      terrain::params tp;
+      tp.seed = e.index;
+      s.owner = e;
+      s.planet.reset(new terrain::planet{workers, tp});
+    }
+    return *s.planet;
+  }
+
+  /// Blocks until all textures are loaded and every
+  /// terrain created so far can be drawn
+  void wait() {
+    skybox.wait();
+    blue_marble.wait();
+    for (auto &t : terrains)
+      if (t.planet) t.planet->wait();
+  }
+
+  /// Paints the world as it was at alpha between the two
+  /// ticks of the snapshot
+  void draw(const world_snapshot &snap, float alpha,
+            vec2 size, float fov, profile::profiler &prof) {
+    location cam = lininterp(snap.prev.transforms.get(snap.prev.camera),
+                             snap.cur.transforms.get(snap.cur.camera),
+                             alpha);
 
     // Adjust the view/projection matrix to accomodate
     // position, fov and window size updates.
     // TODO: Use the roll component of the vector
     mat4 persp = glm::perspective(
-                          tau*s.fov/360,
-                          s.win_size.x / s.win_size.y,
+                          tau*fov/360,
+                          size.x / size.y,
                           0.01f, 1000.0f);
     vec3 up = rotate(roll(cam), vec3{0, 0, -1})
             * vec3{0, 1, 0};
     mat4 look = glm::lookAt(pos(cam),
                             pos(cam) + focus(cam),
                             up);
-    vp = persp * look;
 
-    if (s.opengl_needs_resize) {
-      glViewport(0, 0, (int)s.win_size.x, (int)s.win_size.y);
-      glScissor(0, 0, (int)s.win_size.x, (int)s.win_size.y);
-      s.opengl_needs_resize = false;
+    mat4 vp = persp * look;
+    cull::frustum frustum{vp};
+    const fl proj_scale = cull::projection_scale(tau*fov/360, size.y);
+
+    frame_params.push({
+      vp, pos(cam),
+      lininterp(snap.prev.time, snap.cur.time, alpha) });
+
+    { // Upload textures loading in the background
+      profile::cpu_scope cpu_timer{prof, "upload"};
+      asset::upload_budget budget{upload_bytes, upload_time};
+      skybox.poll(budget);
+      blue_marble.poll(budget);
+      poll_reloads(budget);
+      for (auto &t : terrains)
+        if (t.planet) t.planet->poll(budget);
     }
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Skybox
-    glDepthMask(GL_FALSE);
-    use(skybox);
-    draw(cube, translate(pos(cam)));
-    glDepthMask(GL_TRUE);
+    { // Spheres; culled against the frustum, with the level
+      // of detail chosen by their size on screen
+      profile::cpu_scope cpu_timer{prof, "spheres"};
+      culling.reset();
+      queue.add(pass::background, default_prog, skybox, cube,
+                translate(pos(cam)), 0);
+
+      const world &a = snap.prev, &b = snap.cur;
+      const celestial_store &ca = a.celestials, &cb = b.celestials;
+      uint chunks = 0, waiting = 0, generating = 0;
+      for (size_t i=0; i < cb.size(); i++) {
+        // The rows of a body only differ between the two
+        // ticks if bodies were removed in between
+        const ecs::entity e = cb.rows.owner(i);
+        const uint32_t j = ca.rows.row(e);
+        vec3 p = j == ecs::index::none ? cb.bodies.pos[i]
+               : lininterp(ca.bodies.pos[j], cb.bodies.pos[i], alpha);
+        fl r = cb.radius[i];
+        if (!frustum.visible(p, r)) {
+          culling.culled++;
+          continue;
+        }
+        const fl dist = glm::length(p - pos(cam));
+        const mat4 model = translate(p) * scale(r, r, r);
+        asset::cubemap &tex = texture(cb.texture[i]);
 
-    // Spheres
-    use(blue_marble);
-    draw(sphere, translate(0, 0, 0));
-    draw(sphere, translate(4, 4, 0)
-               * scale(2, 8, 4));
+        // Until the terrain has its first chunks, the plain
+        // sphere stands in for it
+        terrain::planet *t = nullptr;
+        if (cb.mesh[i] == body_mesh::terrain) t = &terrain_of(e);
+        if (t && t->ready()) {
+          t->select(frustum, p, r, pos(cam), proj_scale, [&](gl::mesh &m) {
+            queue.add(pass::opaque, default_prog, tex, m, model, dist);
+          });
+          culling.drawn++;
+          culling.triangles += t->last_stats().triangles;
+          chunks += t->last_stats().drawn;
+          waiting += t->last_stats().waiting;
+          continue;
+        }
 
-    s.win.swap_buffers();
+        fl sr = cull::screen_radius(r, dist, proj_scale);
+        gl::mesh &m = spheres[cull::lod_level(sr, max_lod)];
+        culling.drawn++;
+        culling.triangles += m.no_triangles();
+        queue.add(pass::opaque, default_prog, tex, m, model, dist);
+      }
+      for (auto &t : terrains)
+        if (t.planet) generating += t.planet->last_stats().generating;
 
-    // To save CPU we synchronize drawing the frame
-    // with the Frame rate. This saves some CPU for
-    // now, but we may need a better solution later
-    glFinish();
+      vec3 ship = lininterp(a.ship.pos, b.ship.pos, alpha);
+      queue.add(pass::opaque, default_prog, blue_marble, rock,
+                translate(ship) * scale(0.02f, 0.02f, 0.02f),
+                glm::length(ship - pos(cam)));
+
+      prof.add_count("drawn", culling.drawn);
+      prof.add_count("culled", culling.culled);
+      prof.add_count("triangles", culling.triangles);
+      prof.add_count("chunks", chunks);
+      prof.add_count("chunks waiting", waiting);
+      prof.add_count("chunk jobs", generating);
+    }
+
+    { // Everything queued above, sorted by state
+      profile::cpu_scope cpu_timer{prof, "submit"};
+      profile::gpu_scope gpu_timer{prof, "submit"};
+      queue.flush();
+
+      const render_queue::stats &st = queue.last_stats();
+      prof.add_count("draw calls", st.draws);
+      prof.add_count("program binds", st.program_binds);
+      prof.add_count("texture binds", st.texture_binds);
+      prof.add_count("mesh binds", st.mesh_binds);
+      prof.add_count("binds unsorted", st.unsorted_binds);
+      prof.add_count("queue KiB", st.arena_bytes / 1024.0);
+    }
+
+    { // Trajectory
+      profile::cpu_scope cpu_timer{prof, "path"};
+      profile::gpu_scope gpu_timer{prof, "path"};
+      line_prog.use();
+      path.draw();
+    }
   }
+};
+
+void draw_thr(shared_state &s) {
+  // We should have something nicer for this.
+  // Window should implicitly create the context
+  // and allow it to be used from another thread
+  s.win.make_gl_context();
+
+  scene_renderer scene{s.workers, s.assets};
+  gl::frame_pacer pacer{s.frames_in_flight};
+
+  // Reload shaders and textures edited on disk
+  std::unique_ptr<file_watcher> watcher;
+  const std::vector<std::string> roots = s.assets.directories();
+  if (roots.empty()) {
+    std::cerr << "No hot reloading: the archive comes first; "
+              << "edit files in an --overlay directory\n";
+  } else {
+    try {
+      watcher.reset(new file_watcher{roots, scene_renderer::asset_files()});
+    } catch (const errno_exception &e) {
+      std::cerr << "No hot reloading: " << e.what() << "\n";
+    }
+  }
+  std::vector<std::string> changed;
+
+  profile::profiler prof;
+  std::ofstream prof_file;
+  if (!s.profile_output.empty()) {
+    prof.enable();
+    if (s.profile_output == "-") {
+      prof.set_output(&std::cout);
+    } else {
+      prof_file.open(s.profile_output);
+      prof.set_output(&prof_file);
+    }
+  }
+
+  // TODO: Error handling: is the extension loaded?
+  glfwSwapInterval(1);
+
+  // Initializing not to zero in order to avoid division
+  // by zero errors before the first resize event
+  vec2 win_size{1,1};
+
+  bool stop = false;
+  while (!stop) {
+    profile::cpu_scope frame_timer{prof, "frame"};
+
+    s.draw_events.drain([&](const event &ev) {
+      std::visit(overloaded{
+        [&](const resize_event &e) {
+          win_size = e.size;
+          glViewport(0, 0, (int)win_size.x, (int)win_size.y);
+          glScissor(0, 0, (int)win_size.x, (int)win_size.y);
+        },
+        [&](const key_event &e) {
+          if (e.key >= GLFW_KEY_1 && e.key <= GLFW_KEY_3)
+            pacer.set_frames_in_flight(e.key - GLFW_KEY_1 + 1);
+        },
+        [&](const close_event&) { stop = true; },
+        [](const auto&) {}
+      }, ev);
+    });
+
+    // Between frames, so nothing is swapped out mid frame
+    if (watcher) {
+      changed.clear();
+      watcher->drain([&](const file_watcher::change &c) {
+        // Only if the edited copy is the one that gets loaded
+        const std::string src = s.assets.source_of(c.path);
+        if (src == c.root)
+          changed.push_back(c.path);
+        else if (src.empty())
+          std::cerr << c.root << "/" << c.path << ": not readable\n";
+        else
+          std::cerr << c.root << "/" << c.path << ": shadowed by "
+                    << src << ", not reloading\n";
+      });
+      if (!changed.empty()) scene.reload(changed);
+    }
+
+    // Don't run too far ahead of the GPU
+    pacer.begin_frame();
+    prof.add_cpu("wait", pacer.last_wait());
+    prof.collect();
+
+    // Take the latest snapshot of the world and interpolate
+    // between it's two ticks; we're displaying the world
+    // one tick in the past so the motion stays smooth no
+    // matter how frame rate and tick rate relate
+    const world_snapshot &snap = s.world_buf.read();
+    if (s.predictor.has_update())
+      scene.set_path(s.predictor.read());
+    float alpha = std::chrono::duration<float>{
+        std::chrono::steady_clock::now() - snap.time} / s.tick;
+    alpha = glm::clamp(alpha, 0.0f, 1.0f);
+
+    scene.draw(snap, alpha, win_size, s.fov, prof);
+
+    {
+      profile::cpu_scope cpu_timer{prof, "swap"};
+      s.win.swap_buffers();
+    }
+    pacer.end_frame();
+    prof.maybe_dump();
+  }
+}
+
+////////////// BENCHMARK /////////////////////
+
+struct bench_options {
+  /// Number of frames to render; 0 means no benchmark
+  uint frames = 0;
+
+  /// Name of a non rendering benchmark to run instead
+  std::string suite;
+
+  int width = 1280, height = 720;
+
+  /// Where to write the statistics; stdout if empty
+  std::string out;
+
+  /// Whether to write a hash of the final image
+  bool checksum = false;
+};
+
+/// The camera path of the benchmark: One orbit around the
+/// origin while slowly moving in and out
+location bench_camera(uint frame, uint no_frames) {
+  fl t = fl(frame) / no_frames,
+     phi = tau * t,
+     dist = 10 + 4*std::cos(2*tau*t);
+  vec3 p = vec3{std::cos(phi), 0.6f, std::sin(phi)} * dist;
+  return {p, -p, 0};
+}
+
+/// Renders a deterministic scene along a scripted camera
+/// path without a display, then writes frame time statistics.
+///
+/// The world is stepped exactly once per frame, so every run
+/// renders the same images.
+int run_benchmark(const bench_options &o, const asset::load_path &assets) {
+  // Prefer a context without any window system; fall back
+  // to an invisible window
+  std::unique_ptr<egl::context> egl_ctx;
+  std::unique_ptr<glfw::window> win;
+  try {
+    egl_ctx.reset(new egl::context);
+  } catch (const std::exception &e) {
+    std::cerr << "No surfaceless EGL context (" << e.what()
+              << "); using a hidden window.\n";
+    win.reset(new glfw::window{o.width, o.height, "Gravity Assist", false});
+    win->make_gl_context();
+  }
+
+  gl::framebuffer target{o.width, o.height};
+  target.bind();
+
+  gl::frame_pacer pacer;
+  profile::profiler prof{o.frames};
+
+  world w = initial_world();
+  world_snapshot snap;
+  step_state st;
+  const fl dt = 1.0f/120;
+
+  // Loading: the first frame is drawn with whatever the
+  // textures have by then; the measured frames only start
+  // once everything is at full resolution
+  auto load0 = std::chrono::steady_clock::now();
+  job_pool workers;
+  scene_renderer scene{workers, assets};
+  snap.prev = snap.cur = w;
+  scene.draw(snap, 1, vec2(o.width, o.height), 110, prof);
+  glFinish();
+  auto first_frame = std::chrono::steady_clock::now();
+  scene.wait();
+  glFinish();
+  auto full_res = std::chrono::steady_clock::now();
+  prof.enable();
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint i=0; i < o.frames; i++) {
+    profile::cpu_scope frame_timer{prof, "frame"};
+
+    pacer.begin_frame();
+    prof.add_cpu("wait", pacer.last_wait());
+    prof.collect();
+
+    snap.prev = w;
+    w.transforms.set(w.camera, bench_camera(i, o.frames));
+    step_world(w, st, dt);
+    snap.cur = w;
+
+    scene.draw(snap, 1, vec2(o.width, o.height), 110, prof);
+    pacer.end_frame();
+  }
+  glFinish();
+  auto t1 = std::chrono::steady_clock::now();
+  prof.collect();
+
+  std::ofstream file;
+  if (!o.out.empty()) file.open(o.out);
+  std::ostream &out = o.out.empty() ? std::cout : file;
+
+  double secs = std::chrono::duration<double>{t1 - t0}.count();
+  auto ms = [&](auto t) {
+    return std::chrono::duration<double, std::milli>{t - load0}.count();
+  };
+  out << "first frame ms     " << ms(first_frame) << "\n"
+      << "full resolution ms " << ms(full_res) << "\n"
+      << "frames  " << o.frames << "\n"
+      << "seconds " << secs << "\n"
+      << "fps     " << o.frames / secs << "\n";
+  prof.dump(out);
+
+  if (o.checksum) {
+    std::vector<uint8_t> pixels = target.read_pixels();
+    out << "checksum " << std::hex << std::setfill('0') << std::setw(16)
+        << fnv1a(pixels.data(), pixels.size()) << std::dec << "\n";
+  }
+
+  return out ? 0 : 1;
+}
+
+/// Measures how long updating a prediction takes after a
+/// maneuver was moved (like when dragging it), compared to
+/// computing it from scratch; also checks that both yield
+/// exactly the same path.
+int bench_trajectory(std::ostream &out) {
+  const size_t ticks = 10000, runs = 200;
+  const fl dt = 1.0f/120;
+
+  world w = initial_world();
+  nbody::bodies attractors;
+  traj::select_attractors(w.celestials.bodies, w.attractor_mass, attractors);
+
+  traj::predictor inc{ticks, dt}, full{ticks, dt};
+  inc.reset(w.tick, w.ship, attractors);
+  inc.update();
+
+  profile::histogram inc_ms{runs}, full_ms{runs};
+  auto ms_since = [](profile::clock::time_point t0) {
+    return std::chrono::duration<float, std::milli>{
+      profile::clock::now() - t0}.count();
+  };
+
+  size_t mismatches = 0, computed = 0;
+  for (size_t i=0; i < runs; i++) {
+    // Drag the node back and forth through the second half
+    std::vector<traj::maneuver> man{
+      { 5000 + (i*37) % 4000, {0.05f + 0.001f*i, 0, 0} } };
+
+    auto t0 = profile::clock::now();
+    inc.set_maneuvers(man);
+    computed += inc.update();
+    inc_ms.add(ms_since(t0));
+
+    t0 = profile::clock::now();
+    full.reset(w.tick, w.ship, attractors);
+    full.set_maneuvers(man);
+    full.update();
+    full_ms.add(ms_since(t0));
+
+    for (size_t j=0; j <= ticks; j++)
+      if (inc.states()[j].pos != full.states()[j].pos) {
+        mismatches++;
+        break;
+      }
+  }
+
+  out << std::fixed << std::setprecision(3)
+      << "ticks          " << ticks << "\n"
+      << "runs           " << runs << "\n"
+      << "recomputed     " << computed / runs << " ticks/run\n"
+      << "full        ms " << full_ms.percentile(0.5f)
+      << " p50 " << full_ms.percentile(0.99f) << " p99\n"
+      << "incremental ms " << inc_ms.percentile(0.5f)
+      << " p50 " << inc_ms.percentile(0.99f) << " p99\n"
+      << "mismatches     " << mismatches << "\n";
+  return mismatches == 0 && out ? 0 : 1;
+}
+
+/// Direct gravity counting the force evaluations
+struct counting_gravity {
+  integrate::direct_gravity gravity;
+  size_t evals = 0;
+
+  void operator()(const nbody::bodies &b, std::vector<vec3> &acc) {
+    evals++;
+    gravity(b, acc);
+  }
+};
+
+/// Runs one integrator for a minute of simulated time at
+/// the given time warp and writes a line of statistics
+template<typename Integrator>
+void bench_integrator(std::ostream &out, const nbody::bodies &init,
+                      fl warp) {
+  const fl duration = 60, dt = warp / 120;
+  const size_t no_steps = duration / dt;
+
+  integrate::simulation<Integrator, counting_gravity> sim;
+  sim.bodies = init;
+
+  const double e0 = nbody::energy(sim.bodies);
+  double max_drift = 0;
+  profile::clock::duration busy{0};
+  for (size_t i=0; i < no_steps; i++) {
+    auto t0 = profile::clock::now();
+    sim.step(dt);
+    busy += profile::clock::now() - t0;
+
+    // Sampling the energy is as expensive as a step
+    if (i % 16 == 15 || i+1 == no_steps) {
+      double e = nbody::energy(sim.bodies);
+      max_drift = std::max(max_drift, std::abs((e - e0) / e0));
+    }
+  }
+  const double drift = (nbody::energy(sim.bodies) - e0) / e0,
+               secs = std::chrono::duration<double>{busy}.count();
+
+  out << std::left << std::setw(10) << Integrator::name << std::right
+      << std::setw(6) << int(warp)
+      << std::setw(8) << no_steps
+      << std::setw(8) << sim.force.evals
+      << std::setw(11) << std::fixed << std::setprecision(1)
+      << no_steps * init.size() / secs / 1e6
+      << std::setw(12) << std::scientific << std::setprecision(2)
+      << drift << std::setw(12) << max_drift << "\n"
+      << std::defaultfloat;
+}
+
+/// Energy drift and throughput of the integrators at
+/// increasing time warp on a thinned out version of the
+/// initial world
+int bench_integrators(std::ostream &out) {
+  world w = initial_world();
+  const nbody::bodies &wb = w.celestials.bodies;
+  nbody::bodies b;
+  for (size_t i=0; i < wb.size(); i++)
+    if (i < 2 || i % 10 == 0)
+      b.add(wb.mass[i], wb.pos[i], wb.vel[i]);
+
+  out << "bodies " << b.size() << ", 60 s simulated, direct gravity\n"
+      << std::left << std::setw(10) << "integrator" << std::right
+      << std::setw(6) << "warp" << std::setw(8) << "steps"
+      << std::setw(8) << "evals" << std::setw(11) << "Mbody-st/s"
+      << std::setw(12) << "drift" << std::setw(12) << "max drift" << "\n";
+  for (fl warp : {1, 10, 100}) {
+    bench_integrator<integrate::semi_implicit_euler>(out, b, warp);
+    bench_integrator<integrate::leapfrog>(out, b, warp);
+    bench_integrator<integrate::yoshida4>(out, b, warp);
+    bench_integrator<integrate::dormand_prince>(out, b, warp);
+  }
+  return out ? 0 : 1;
+}
+
+/// Accuracy and speed of the Barnes-Hut octree against
+/// accelerations_direct() on Plummer spheres of increasing
+/// size. Fails if the relative error at the default
+/// opening angle exceeds max_err (any body) or max_rms.
+int bench_nbody(std::ostream &out) {
+  const fl thetas[] = {0.3f, 0.5f, 0.7f, 1.0f};
+  const double max_err = 0.1, max_rms = 1e-2;
+  const size_t runs = 3;
+  const nbody::params defaults;
+  auto ms_since = [](profile::clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>{
+      profile::clock::now() - t0}.count();
+  };
+
+  out << std::left << std::setw(8) << "bodies" << std::right
+      << std::setw(7) << "theta" << std::setw(10) << "build ms"
+      << std::setw(10) << "force ms" << std::setw(11) << "direct ms"
+      << std::setw(11) << "max err" << std::setw(11) << "rms err" << "\n";
+
+  bool ok = true;
+  for (size_t n : {1000, 10000, 50000}) {
+    // Clustered like a galaxy rather than uniform so the
+    // tree gets deep in the core; the radius is capped to
+    // keep the occasional outlier from inflating the root
+    std::mt19937 rng{42};
+    std::uniform_real_distribution<fl> unit{0, 1};
+    nbody::bodies b;
+    b.reserve(n);
+    while (b.size() < n) {
+      const fl r = 1 / std::sqrt(std::pow(unit(rng), -2.0f/3) - 1);
+      if (!(r < 10)) continue;
+      const fl z = 2*unit(rng) - 1, phi = tau*unit(rng),
+               s = std::sqrt(1 - z*z);
+      b.add((0.5f + unit(rng)) / n,
+            vec3{s*std::cos(phi), s*std::sin(phi), z} * r);
+    }
+
+    std::vector<vec3> ref, acc;
+    auto t0 = profile::clock::now();
+    nbody::accelerations_direct(b, ref, defaults);
+    const double direct_ms = ms_since(t0);
+
+    nbody::octree tree;
+    for (fl theta : thetas) {
+      nbody::params par = defaults;
+      par.theta = theta;
+
+      // Best of a few runs
+      double build_ms = HUGE_VAL, force_ms = HUGE_VAL;
+      for (size_t k=0; k < runs; k++) {
+        t0 = profile::clock::now();
+        tree.build(b);
+        build_ms = std::min(build_ms, ms_since(t0));
+        t0 = profile::clock::now();
+        tree.accelerations(acc, par);
+        force_ms = std::min(force_ms, ms_since(t0));
+      }
+
+      double worst = 0, sum_sq = 0;
+      for (size_t i=0; i < n; i++) {
+        const double err = glm::length(acc[i] - ref[i]) / glm::length(ref[i]);
+        worst = std::max(worst, err);
+        sum_sq += err * err;
+      }
+      const double rms = std::sqrt(sum_sq / n);
+      if (theta == defaults.theta && !(worst <= max_err && rms <= max_rms))
+        ok = false;
+
+      out << std::left << std::setw(8) << n << std::right
+          << std::setw(7) << std::fixed << std::setprecision(1) << theta
+          << std::setw(10) << std::setprecision(2) << build_ms
+          << std::setw(10) << force_ms << std::setw(11) << direct_ms
+          << std::setw(11) << std::scientific << worst
+          << std::setw(11) << rms << "\n" << std::defaultfloat;
+    }
+    // The direct reference takes seconds at the larger sizes
+    out.flush();
+  }
+
+  if (!ok)
+    out << "error at theta " << defaults.theta << " exceeds "
+        << max_err << " max or " << max_rms << " rms\n";
+  return ok && out ? 0 : 1;
+}
+
+/// Heap allocations and time for generating the sphere
+/// meshes with and without a scratch arena
+int bench_alloc(std::ostream &out) {
+  const uint lv = 7;
+  arena scratch;
+
+  auto run = [&](const char *name, arena *a) {
+    auto allocs0 = heap_allocs();
+    auto t0 = profile::clock::now();
+    auto lods = geom::cube_sphere_lods(lv, a);
+    std::chrono::duration<double, std::milli> t = profile::clock::now() - t0;
+    auto allocs1 = heap_allocs();
+
+    out << std::left << std::setw(14) << name << std::right << std::setw(10);
+    if (allocs1)
+      out << *allocs1 - *allocs0;
+    else
+      out << "-";
+    out << std::setw(10) << std::fixed << std::setprecision(2)
+        << t.count() << "\n";
+  };
+
+  out << "cube_sphere_lods(" << lv << ")\n"
+      << std::left << std::setw(14) << "scratch" << std::right
+      << std::setw(10) << "allocs" << std::setw(10) << "ms" << "\n";
+  run("heap", nullptr);
+  run("arena (cold)", &scratch);
+  run("arena (warm)", &scratch);
+  out << "arena capacity " << scratch.capacity() / 1024 << " KiB in "
+      << scratch.heap_allocations() << " chunks\n";
+  if (!heap_allocs())
+    out << "build with COUNT_ALLOCS=1 to count heap allocations\n";
+  return out ? 0 : 1;
+}
+
+/// Time to generate quad spheres with 1 to N workers; the
+/// results must be identical to the serial ones
+int bench_meshgen(std::ostream &out) {
+  const size_t hw = std::max(1u, std::thread::hardware_concurrency()),
+               runs = 5;
+  std::vector<size_t> worker_counts;
+  for (size_t k=1; k < hw; k *= 2) worker_counts.push_back(k);
+  worker_counts.push_back(hw);
+
+  // Best of a few runs; how long a run takes depends a
+  // lot on whether the allocator hands out fresh pages
+  auto time = [&](auto &&f) {
+    std::vector<double> ms;
+    for (size_t r=0; r < runs; r++) {
+      auto t0 = profile::clock::now();
+      f();
+      ms.push_back(std::chrono::duration<double, std::milli>{
+          profile::clock::now() - t0}.count());
+    }
+    return *std::min_element(ms.begin(), ms.end());
+  };
+
+  auto line = [&](const std::string &what, uint lv, double ms, double base) {
+    out << std::left << std::setw(16) << what << std::right
+        << std::setw(4) << lv
+        << std::setw(12) << geom::cube_sphere_triangles(lv)
+        << std::setw(10) << std::fixed << std::setprecision(2) << ms
+        << std::setw(10) << geom::cube_sphere_triangles(lv) / ms / 1e3
+        << std::setw(9) << base / ms << "x\n" << std::defaultfloat;
+  };
+
+  out << "hardware threads " << hw << ", best of " << runs << "\n"
+      << std::left << std::setw(16) << "generator" << std::right
+      << std::setw(4) << "lv" << std::setw(12) << "triangles"
+      << std::setw(10) << "ms" << std::setw(10) << "Mtri/s"
+      << std::setw(10) << "speedup" << "\n";
+
+  bool ok = true;
+  for (uint lv : {8u, 10u}) {
+    geom::indexed_mesh ref;
+    double serial = time([&]() { ref = geom::quad_sphere(lv); });
+
+    if (lv == 8) {
+      double t = time([&]() { geom::cube_sphere(lv); });
+      line("subdivide", lv, t, serial);
+    }
+    line("quad serial", lv, serial, serial);
+
+    for (size_t k : worker_counts) {
+      job_pool pool{k};
+      geom::indexed_mesh m;
+      double t = time([&]() { m = geom::quad_sphere(lv, &pool); });
+      ok = ok && m.vertices == ref.vertices && m.indices == ref.indices;
+      line("quad " + std::to_string(k) + " workers", lv, t, serial);
+    }
+  }
+
+  if (!ok) out << "MISMATCH between serial and parallel results\n";
+  return ok && out ? 0 : 1;
+}
+
+/// Flies from orbit down to the surface of a planet with
+/// terrain and along it, pretending to run at 60 frames
+/// per second, and reports how long the terrain work takes
+/// per frame and how far the terrain lags behind the
+/// camera: frames in which chunks had to be drawn in place
+/// of children that were not generated yet.
+///
+/// Nothing is drawn, but the chunks are uploaded, so this
+/// needs a GL context.
+int bench_terrain(std::ostream &out) {
+  typedef std::chrono::steady_clock clock;
+  std::unique_ptr<egl::context> ctx;
+  try {
+    ctx.reset(new egl::context);
+  } catch (const std::exception &e) {
+    std::cerr << "No surfaceless EGL context: " << e.what() << "\n";
+    return 1;
+  }
+
+  const uint frames = 600;
+  const auto frame_time = std::chrono::microseconds{16667};
+  const vec2 size{1280, 720};
+  const fl fov = tau*110/360;
+  const mat4 persp = glm::perspective(fov, size.x / size.y, 0.01f, 1000.0f);
+  const fl proj_scale = cull::projection_scale(fov, size.y);
+
+  job_pool workers;
+  terrain::params tp;
+  terrain::planet planet{workers, tp};
+
+  auto t0 = clock::now();
+  while (!planet.ready()) {
+    auto budget = asset::upload_budget::unlimited();
+    planet.poll(budget);
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  double roots_ms = std::chrono::duration<double, std::milli>{
+      clock::now() - t0}.count();
+
+  std::vector<double> ms;
+  uint waiting_frames = 0, max_waiting = 0, deepest = 0;
+  size_t max_resident = 0;
+  auto next = clock::now();
+  for (uint i=0; i < frames; i++) {
+    // Down from 10 radii above the ground to 0.002 in the
+    // first three quarters, then along the surface
+    const uint descent = frames*3/4;
+    fl t = std::min(fl(i) / descent, fl(1)),
+       along = i > descent ? fl(i - descent) / frames : 0,
+       alt = 10 * std::pow(2e-4f, t);
+    vec3 dir = glm::normalize(vec3{std::cos(along), 0.5f, std::sin(along)}),
+         ahead = glm::normalize(vec3{-dir.z, 0, dir.x});
+    vec3 cam = dir * (1 + terrain::height(tp, dir) + alt);
+    // Looking straight down from orbit, at the horizon
+    // near the ground
+    vec3 focus = glm::normalize(lininterp(-dir, ahead - dir*0.2f, t));
+    cull::frustum frustum{persp * glm::lookAt(cam, cam + focus, ahead)};
+
+    auto a = clock::now();
+    asset::upload_budget budget{8 << 20, std::chrono::microseconds{2000}};
+    planet.poll(budget);
+    planet.select(frustum, vec3{0, 0, 0}, 1, cam, proj_scale,
+                  [](gl::mesh&) {});
+    ms.push_back(std::chrono::duration<double, std::milli>{
+        clock::now() - a}.count());
+
+    const terrain::stats &st = planet.last_stats();
+    if (st.waiting) waiting_frames++;
+    max_waiting = std::max(max_waiting, st.waiting);
+    deepest = std::max(deepest, st.deepest);
+    max_resident = std::max(max_resident, st.resident);
+
+    next += frame_time;
+    std::this_thread::sleep_until(next);
+  }
+  glFinish();
+
+  std::vector<double> sorted = ms;
+  std::sort(sorted.begin(), sorted.end());
+  const terrain::stats &st = planet.last_stats();
+  out << "roots ms              " << roots_ms << "\n"
+      << "frames                " << frames << "\n"
+      << "terrain ms median     " << sorted[frames / 2] << "\n"
+      << "terrain ms 99%        " << sorted[frames * 99 / 100] << "\n"
+      << "terrain ms max        " << sorted.back() << "\n"
+      << "frames waiting        " << waiting_frames << "\n"
+      << "max chunks waiting    " << max_waiting << "\n"
+      << "deepest level         " << deepest << "/" << tp.max_level << "\n"
+      << "max chunks resident   " << max_resident << "\n"
+      << "last frame chunks     " << st.drawn << ", "
+      << st.triangles << " triangles\n";
+  return out ? 0 : 1;
+}
+
+/// Checks the batch kernels of every instruction set the
+/// CPU supports against the plain glm code and measures
+/// their throughput
+int bench_simd(std::ostream &out) {
+  const size_t n = 1 << 20, reps = 20;
+  const fl tol = 1e-5f;
+
+  std::mt19937 rng{42};
+  std::uniform_real_distribution<fl> dist{-100, 100};
+  std::vector<vec3> in(n), x(n), out_ref(n), out_simd(n);
+  for (auto &v : in) v = {dist(rng), dist(rng), dist(rng)};
+  for (auto &v : x) v = {dist(rng), dist(rng), dist(rng)};
+  const mat4 m = translate(vec3{1, -2, 3})
+               * rotate(33, glm::normalize(vec3{1, 2, 3}))
+               * scale(vec3{2, 0.5f, 1});
+  const fl a = 0.0123f;
+
+  // Largest deviation relative to the magnitude of the
+  // reference; also counts results that are not bit exact
+  auto compare = [&](const std::vector<vec3> &ref,
+                     const std::vector<vec3> &got, size_t &inexact) {
+    fl err = 0;
+    inexact = 0;
+    for (size_t i=0; i < n; i++) {
+      if (ref[i] != got[i]) inexact++;
+      err = std::max(err, glm::length(ref[i] - got[i])
+                          / std::max(fl(1), glm::length(ref[i])));
+    }
+    return err;
+  };
+
+  auto mpts = [&](profile::clock::duration d) {
+    return n * reps / std::chrono::duration<double>{d}.count() / 1e6;
+  };
+
+  out << "points " << n << ", selected " << simd::name(simd::kernels().level)
+      << "\n"
+      << std::left << std::setw(8) << "isa" << std::setw(11) << "kernel"
+      << std::right << std::setw(10) << "Mpts/s" << std::setw(10) << "speedup"
+      << std::setw(12) << "max err" << std::setw(10) << "inexact" << "\n";
+
+  bool ok = true;
+  double base[3] = {};
+  for (simd::isa level : {simd::isa::scalar, simd::isa::sse2, simd::isa::avx2}) {
+    if (level > simd::detect()) break;
+    const simd::kernel_table k = simd::table_for(level);
+    if (k.level != level) continue;
+
+    auto report = [&](size_t kernel, const char *name,
+                      profile::clock::duration d,
+                      const std::vector<vec3> &ref) {
+      double rate = mpts(d);
+      if (level == simd::isa::scalar) base[kernel] = rate;
+      size_t inexact;
+      fl err = compare(ref, out_simd, inexact);
+      ok = ok && err <= tol;
+      out << std::left << std::setw(8) << simd::name(level)
+          << std::setw(11) << name << std::right
+          << std::setw(10) << std::fixed << std::setprecision(1) << rate
+          << std::setw(9) << std::setprecision(2) << rate / base[kernel] << "x"
+          << std::setw(12) << std::scientific << err
+          << std::setw(10) << inexact << "\n" << std::defaultfloat;
+    };
+
+    //// TRANSFORM ////
+    for (size_t i=0; i < n; i++) out_ref[i] = m * in[i];
+    auto t0 = profile::clock::now();
+    for (size_t r=0; r < reps; r++)
+      k.transform_points(m, in.data(), out_simd.data(), n);
+    report(0, "transform", profile::clock::now() - t0, out_ref);
+
+    //// NORMALIZE ////
+    for (size_t i=0; i < n; i++) out_ref[i] = glm::normalize(in[i]);
+    profile::clock::duration busy{0};
+    for (size_t r=0; r < reps; r++) {
+      out_simd = in;
+      t0 = profile::clock::now();
+      k.normalize(out_simd.data(), n);
+      busy += profile::clock::now() - t0;
+    }
+    report(1, "normalize", busy, out_ref);
+
+    //// AXPY ////
+    for (size_t i=0; i < n; i++) out_ref[i] = in[i] + x[i] * a;
+    busy = {};
+    for (size_t r=0; r < reps; r++) {
+      out_simd = in;
+      t0 = profile::clock::now();
+      k.axpy(out_simd.data(), x.data(), a, n);
+      busy += profile::clock::now() - t0;
+    }
+    report(2, "axpy", busy, out_ref);
+  }
+
+  out << (ok ? "all kernels within " : "KERNEL MISMATCH, tolerance ")
+      << tol << "\n";
+  return ok && out ? 0 : 1;
+}
+
+/// Letters for the kinds of events found, in order
+std::string event_kinds(const std::vector<collide::event> &ev) {
+  std::string r;
+  for (collide::kind k : {collide::kind::approach, collide::kind::impact,
+                          collide::kind::periapsis}) {
+    bool found = std::any_of(ev.begin(), ev.end(),
+        [&](const collide::event &e) { return e.kind == k; });
+    r += !found ? '-'
+       : k == collide::kind::approach ? 'A'
+       : k == collide::kind::impact ? 'I' : 'P';
+  }
+  return r;
+}
+
+/// A ship coming in from afar with the given offset from
+/// a planet of radius 1 and mass 10 (fixed at the origin),
+/// simulated like the game does for 20 s with a tick of
+/// dt. Writes the encounters the detector sees and what
+/// looking at the positions after each tick would show.
+void simulate_pass(fl offset, fl dt, std::vector<collide::event> &ev,
+                   std::string &sampled) {
+  const fl M = 10, eps2 = nbody::params{}.softening * nbody::params{}.softening;
+  const std::vector<vec3> planet{{0, 0, 0}}, still{{0, 0, 0}};
+  const std::vector<fl> radius{1};
+  traj::ship_state ship{{-20, 0, offset}, {2, 0, 0}};
+  std::vector<vec3> pos{ship.pos}, vel{ship.vel};
+
+  collide::detector det;
+  const fl near = det.parameters().approach;
+  det.update(planet, still, radius, 0, 0, ev);
+  det.probe(pos, vel, ev);
+  sampled = "---";
+  fl before = glm::length(ship.pos), last = before;
+  for (size_t i=0; i < size_t(20 / dt); i++) {
+    const vec3 acc = nbody::intern::pull(ship.pos, planet[0], M, eps2);
+    ship.vel += acc * dt;
+    ship.pos += ship.vel * dt;
+    pos[0] = ship.pos;
+    vel[0] = ship.vel + acc * (dt/2);
+    det.update(planet, still, radius, i*dt, dt, ev);
+    det.probe(pos, vel, ev);
+
+    const fl d = glm::length(ship.pos);
+    if (d <= near) sampled[0] = 'A';
+    if (d <= 1) sampled[1] = 'I';
+    if (last < before && last <= d && last <= near) sampled[2] = 'P';
+    before = last;
+    last = d;
+  }
+}
+
+/// Checks the broad phase of the collision detection
+/// against testing all pairs on the initial world, and how
+/// the continuous tests hold up against increasing time
+/// warp for a ship passing by or hitting a planet
+int bench_collide(std::ostream &out) {
+  const size_t ticks = 600, check_every = 10;
+  const fl dt = 1.0f/120;
+
+  world w = initial_world();
+  step_state st;
+  collide::detector det;
+  std::vector<collide::event> ev, direct;
+  profile::histogram tree_ms{ticks}, direct_ms{ticks / check_every};
+  auto ms_since = [](profile::clock::time_point t0) {
+    return std::chrono::duration<float, std::milli>{
+      profile::clock::now() - t0}.count();
+  };
+
+  // A second detector fed what step_world() feeds its
+  // own, so it can be timed on its own
+  const nbody::bodies &b = w.celestials.bodies;
+  size_t reinserted = 0, pairs = 0, events = 0, mismatches = 0;
+  int height = 0;
+  for (size_t i=0; i < ticks; i++) {
+    const fl t = w.time;
+    step_world(w, st, dt);
+
+    ev.clear();
+    auto t0 = profile::clock::now();
+    det.update(b.pos, st.vel, w.celestials.radius, t, dt, ev);
+    det.probe(st.ship_pos, st.ship_vel, ev);
+    tree_ms.add(ms_since(t0));
+    reinserted += det.last_stats().reinserted;
+    pairs += det.last_stats().pairs;
+    height = std::max(height, det.tree_height());
+    events += ev.size();
+
+    if (i % check_every == 0) {
+      direct.clear();
+      t0 = profile::clock::now();
+      det.direct(direct);
+      direct_ms.add(ms_since(t0));
+      std::sort(ev.begin(), ev.end());
+      std::sort(direct.begin(), direct.end());
+      mismatches += ev != direct;
+    }
+  }
+
+  out << std::fixed << std::setprecision(3)
+      << "bodies         " << b.size() << "\n"
+      << "ticks          " << ticks << "\n"
+      << "tree height    " << height << "\n"
+      << "reinserted     " << reinserted / ticks << " /tick\n"
+      << "pairs          " << pairs / ticks << " /tick\n"
+      << "events         " << events << "\n"
+      << "tree        ms " << tree_ms.percentile(0.5f)
+      << " p50 " << tree_ms.percentile(0.99f) << " p99\n"
+      << "direct      ms " << direct_ms.percentile(0.5f)
+      << " p50 " << direct_ms.percentile(0.99f) << " p99\n"
+      << "mismatches     " << mismatches << "\n\n";
+
+  // The pass simulated with a tenth of a tick is the
+  // reference for the times and distances
+  out << "A approach, I impact, P periapsis\n"
+      << std::left << std::setw(8) << "pass" << std::right
+      << std::setw(6) << "warp" << std::setw(8) << "swept"
+      << std::setw(9) << "sampled" << std::setw(10) << "t err"
+      << std::setw(10) << "d err" << "\n";
+  for (auto [name, offset] : {std::pair{"flyby", 3.1f},
+                              std::pair{"impact", 1.6f}}) {
+    std::vector<collide::event> ref;
+    std::string sampled;
+    simulate_pass(offset, dt / 10, ref, sampled);
+    const collide::kind key = ref.size() && event_kinds(ref)[1] == 'I'
+                            ? collide::kind::impact : collide::kind::periapsis;
+    auto first = [&](const std::vector<collide::event> &v) {
+      return std::find_if(v.begin(), v.end(),
+          [&](const collide::event &e) { return e.kind == key; });
+    };
+
+    for (fl warp : {1, 10, 100}) {
+      ev.clear();
+      simulate_pass(offset, dt * warp, ev, sampled);
+      out << std::left << std::setw(8) << name << std::right
+          << std::setw(6) << int(warp)
+          << std::setw(8) << event_kinds(ev)
+          << std::setw(9) << sampled;
+      auto e = first(ev), r = first(ref);
+      if (e != ev.end() && r != ref.end())
+        out << std::setw(10) << std::abs(e->time - r->time)
+            << std::setw(10) << std::abs(e->distance - r->distance);
+      out << "\n";
+    }
+  }
+
+  return mismatches == 0 && out ? 0 : 1;
+}
+
+/// Runs the benchmark named in o.suite
+int run_suite(const bench_options &o) {
+  std::ofstream file;
+  if (!o.out.empty()) file.open(o.out);
+  std::ostream &out = o.out.empty() ? std::cout : file;
+
+  if (o.suite == "trajectory")
+    return bench_trajectory(out);
+  if (o.suite == "integrators")
+    return bench_integrators(out);
+  if (o.suite == "nbody")
+    return bench_nbody(out);
+  if (o.suite == "alloc")
+    return bench_alloc(out);
+  if (o.suite == "simd")
+    return bench_simd(out);
+  if (o.suite == "meshgen")
+    return bench_meshgen(out);
+  if (o.suite == "terrain")
+    return bench_terrain(out);
+  if (o.suite == "collide")
+    return bench_collide(out);
+
+  std::cerr << "Unknown benchmark: " << o.suite << "\n";
+  return 2;
 }
 
 ////////////// INPUT /////////////////////////
@@ -210,63 +1739,151 @@ void draw_thr(shared_state &s) {
 // NOTE: This necessarily must be placed in the
 // main thread
 void input_thr(shared_state &s) {
-  // TODO: This code is not very pretty
-  glm::tvec2<double> mousepos, mouse_lastpos, mouse_delta;
+  glm::tvec2<double> mousepos, mouse_lastpos;
+  glfwGetCursorPos(s.win.glfw_window, &mousepos.x, &mousepos.y);
+  vec2 win_size{0, 0};
 
+  // Keys we report; pressed state from the last wakeup
+  const int keys[] = {GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3};
+  bool key_down[std::size(keys)] = {};
 
-  while (!s.stop) {
+  // Maneuver planning; reported on every wakeup while held,
+  // so the key repeat of the system keeps them coming
+  const int plan_keys[] = {GLFW_KEY_UP, GLFW_KEY_DOWN,
+                           GLFW_KEY_LEFT, GLFW_KEY_RIGHT};
+
+  // Window events go to drawing, navigation to the
+  // simulation. A full queue just drops the event; the
+  // consumers drain them every frame/tick.
+  while (true) {
     glfwWaitEvents();
 
-    {
-      auto nu_size = s.win.size();
-      if (nu_size != s.win_size)
-        s.opengl_needs_resize = true;
-      s.win_size = nu_size;
+    //// WINDOW CLOSED ////
+    if (s.win.should_close()) {
+      // Must not be lost
+      for (event_queue *q : {&s.sim_events, &s.draw_events})
+        while (!q->push(close_event{}))
+          std::this_thread::yield();
+      break;
     }
 
-    bool mousel = glfwGetMouseButton(s.win.glfw_window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS,
-         mousem = glfwGetMouseButton(s.win.glfw_window, GLFW_MOUSE_BUTTON_MIDDLE) == GLFW_PRESS,
-         shift  = glfwGetKey(s.win.glfw_window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS;
+    //// WINDOW RESIZED ////
+    auto nu_size = s.win.size();
+    if (nu_size != win_size)
+      s.draw_events.push(resize_event{nu_size});
+    win_size = nu_size;
 
+    //// KEYS ////
+    for (size_t i=0; i < std::size(keys); i++) {
+      bool down = glfwGetKey(s.win.glfw_window, keys[i]) == GLFW_PRESS;
+      if (down && !key_down[i])
+        s.draw_events.push(key_event{keys[i]});
+      key_down[i] = down;
+    }
+    for (int k : plan_keys)
+      if (glfwGetKey(s.win.glfw_window, k) == GLFW_PRESS)
+        s.sim_events.push(key_event{k});
+
+    //// MOUSE ////
     mouse_lastpos = mousepos;
     glfwGetCursorPos(s.win.glfw_window, &mousepos.x, &mousepos.y);
-    mouse_delta = mousepos - mouse_lastpos;
-
-    //// WINDOW CLOSED ////
-    s.stop = s.win.should_close();
+    mouse_event m;
+    m.delta = mousepos - mouse_lastpos;
+    m.left   = glfwGetMouseButton(s.win.glfw_window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    m.middle = glfwGetMouseButton(s.win.glfw_window, GLFW_MOUSE_BUTTON_MIDDLE) == GLFW_PRESS;
+    m.shift  = glfwGetKey(s.win.glfw_window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS;
+    if ((m.left || m.middle) && (m.delta.x != 0 || m.delta.y != 0))
+      s.sim_events.push(m);
+  }
+}
 
-    //// CAMERA NAVIGATION ////
+////////////// MAIN //////////////////////////
 
-    if (mousem || (mousel && shift)) { // zoom
-      float mag = mouse_delta.y - mouse_delta.x;
-      pos(s.cam) *= std::pow(10, mag/500);
+/// The packed assets produced by the asset pipeline
+const char *asset_archive = "assets.gapk";
 
-    } else if (mousel) {
-      auto alt_axis =
-          rotate(90, vec3{0, 1, 0})
-        * glm::normalize(pos(s.cam) * vec3{1, 0, 1});
+/// Loose files in the overlay directories first, then the
+/// archive, then the working directory (for running from a
+/// source tree that has not been packed). Only directories
+/// in front of the archive are watched for hot reloading.
+asset::load_path make_load_path(const std::vector<std::string> &overlays) {
+  asset::load_path r;
+  for (auto &dir : overlays) r.add_directory(dir);
+  if (::access(asset_archive, R_OK) == 0)
+    r.add_archive(asset_archive);
+  r.add_directory(".");
+  return r;
+}
 
-      // TODO: Not locking here. This seems a bit dangerous,
-      // but apparently works
+/// Parses a decimal count that must fit into a uint;
+/// rejects trailing garbage instead of ignoring it
+bool parse_count(const char *str, uint &out) {
+  char *end;
+  errno = 0;
+  unsigned long v = std::strtoul(str, &end, 10);
+  if (errno || end == str || *end != '\0'
+      || v > std::numeric_limits<uint>::max())
+    return false;
+  out = v;
+  return true;
+}
 
-      pos(s.cam) = rotate(-mouse_delta.x/40, {0, 1, 0})
-                 * rotate(-mouse_delta.y/40, alt_axis)
-                 * pos(s.cam);
+void usage(const char *exe) {
+  std::cerr << "Usage: " << exe << " [--overlay DIR]..."
+            << " [--bench FRAMES [--size WxH] [--out FILE] [--checksum]]\n"
+            << "       " << exe << " --bench"
+            << " trajectory|integrators|nbody|alloc|simd|meshgen|terrain|collide"
+            << " [--out FILE]\n";
+}
 
-      // Note: We're orbiting around 0, 0, 0
-      focus(s.cam) = vec3{0, 0, 0} - pos(s.cam);
+int main(int argc, char **argv) {
+  bench_options bench;
+  std::vector<std::string> overlays;
+  for (int i=1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_val = i+1 < argc;
+    if (arg == "--bench" && has_val
+        && !std::isdigit((unsigned char)argv[i+1][0])) {
+      bench.suite = argv[++i];
+    } else if (arg == "--bench" && has_val
+        && parse_count(argv[++i], bench.frames)) {
+    } else if (arg == "--size" && has_val
+        && std::sscanf(argv[++i], "%dx%d", &bench.width, &bench.height) == 2) {
+    } else if (arg == "--out" && has_val) {
+      bench.out = argv[++i];
+    } else if (arg == "--checksum") {
+      bench.checksum = true;
+    } else if (arg == "--overlay" && has_val) {
+      overlays.push_back(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 2;
     }
   }
-}
 
-////////////// MAIN //////////////////////////
+  if (!bench.suite.empty())
+    return run_suite(bench);
+  if (bench.frames > 0)
+    return run_benchmark(bench, make_load_path(overlays));
 
-int main() {
   shared_state state;
+  state.assets = make_load_path(overlays);
+
+  if (const char *p = std::getenv("GASSIST_PROFILE"))
+    state.profile_output = p;
 
+  softwear::thread_pool simulators(1, sim_thr, state);
   softwear::thread_pool painters(1, draw_thr, state);
   input_thr(state);
 
+  if (!state.profile_output.empty()) {
+    for (auto [name, q] : {std::pair{"sim", &state.sim_events},
+                           std::pair{"draw", &state.draw_events}})
+      std::cerr << name << " events: max depth " << q->max_depth()
+                << "/" << q->capacity() << ", "
+                << q->overflows() << " dropped\n";
+  }
+
   // Note: All threads will exit and be joined
   // automatically
 
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
+#include <algorithm>
+#include <future>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "gassist/util.hh"
+#include "gassist/arena.hh"
+#include "gassist/jobs.hh"
+#include "gassist/simd.hh"
+
+namespace gassist::geom {
+
+// DATA STRUCTURES //////////////////
+
+/// A triangle mesh with shared vertices; every three
+/// consecutive entries in indices describe one triangle.
+struct indexed_mesh {
+  std::vector<vec3> vertices;
+  std::vector<uint32_t> indices;
+
+  size_t no_triangles() const { return indices.size() / 3; }
+};
+
+// BASE SHAPES //////////////////////
+
+/// A cube from (-1,-1,-1) to (1,1,1); two triangles per side
+inline indexed_mesh cube() {
+  enum { a, b, c, d, e, f, g, h };
+  return {
+    { {1,1, 1}, {-1,1, 1}, {-1,-1, 1}, {1,-1, 1},
+      {1,1,-1}, {-1,1,-1}, {-1,-1,-1}, {1,-1,-1} },
+    { a,b,c, a,c,d,  e,f,g, e,g,h,    // front back
+      a,d,e, d,e,h,  b,c,f, c,f,g,    // right left
+      a,b,e, b,e,f,  c,d,g, d,g,h } }; // top   bottom
+}
+
+/// A regular icosahedron; the vertices lie on the unit sphere
+inline indexed_mesh icosahedron() {
+  // Golden ratio based construction, normalized
+  const fl t = (1 + std::sqrt(fl(5))) / 2,
+           n = 1 / std::sqrt(1 + t*t),
+           o = n, p = t*n;
+  return {
+    { {-o, p, 0}, { o, p, 0}, {-o,-p, 0}, { o,-p, 0},
+      { 0,-o, p}, { 0, o, p}, { 0,-o,-p}, { 0, o,-p},
+      { p, 0,-o}, { p, 0, o}, {-p, 0,-o}, {-p, 0, o} },
+    { 0,11, 5,  0, 5, 1,  0, 1, 7,  0, 7,10,  0,10,11,
+      1, 5, 9,  5,11, 4, 11,10, 2, 10, 7, 6,  7, 1, 8,
+      3, 9, 4,  3, 4, 2,  3, 2, 6,  3, 6, 8,  3, 8, 9,
+      4, 9, 5,  2, 4,11,  6, 2,10,  8, 6, 7,  9, 8, 1 } };
+}
+
+// OPERATIONS ///////////////////////
+
+namespace intern {
+
+template<typename Alloc>
+void subdivide_once(indexed_mesh &m, std::vector<uint32_t> &nu_indices,
+                    const Alloc &alloc) {
+  typedef std::pair<const uint64_t, uint32_t> entry;
+  std::unordered_map<uint64_t, uint32_t,
+      std::hash<uint64_t>, std::equal_to<uint64_t>,
+      typename std::allocator_traits<Alloc>::template rebind_alloc<entry>>
+    midpoints{alloc};
+
+  // Euler: A closed triangle mesh has 1.5 edges per face
+  const size_t no_tris = m.no_triangles();
+  midpoints.reserve(no_tris * 3 / 2);
+  m.vertices.reserve(m.vertices.size() + no_tris * 3 / 2);
+  nu_indices.clear();
+  nu_indices.reserve(no_tris * 4 * 3);
+
+  auto mid = [&](uint32_t i, uint32_t j) -> uint32_t {
+    uint64_t key = i < j
+      ? uint64_t{i} << 32 | j
+      : uint64_t{j} << 32 | i;
+    auto r = midpoints.emplace(key, m.vertices.size());
+    if (r.second)
+      m.vertices.push_back((m.vertices[i] + m.vertices[j]) * 0.5f);
+    return r.first->second;
+  };
+
+  for (size_t t=0; t < m.indices.size(); t += 3) {
+    uint32_t a = m.indices[t], b = m.indices[t+1], c = m.indices[t+2],
+             d = mid(a, b), e = mid(a, c), f = mid(b, c);
+    for (uint32_t i : {a,d,e,  b,d,f,  c,e,f,  d,e,f})
+      nu_indices.push_back(i);
+  }
+
+  std::swap(m.indices, nu_indices);
+}
+
+} // ns intern
+
+/// Splits every triangle of the mesh into four by inserting
+/// a vertex in the middle of each edge; repeated lv times.
+///
+/// Edge midpoints are shared between the two triangles
+/// adjacent to the edge, so the result contains no duplicate
+/// vertices (provided the input does not).
+///
+/// The lookup table for this needs one node per edge; if an
+/// arena is given it is allocated from there (and freed
+/// again before returning) instead of the heap.
+inline indexed_mesh subdivide(indexed_mesh m, uint lv,
+                              arena *scratch=nullptr) {
+  std::vector<uint32_t> nu_indices;
+  for (uint l=0; l < lv; l++) {
+    if (scratch) {
+      arena_scope scope{*scratch};
+      intern::subdivide_once(m, nu_indices,
+                             arena_allocator<char>{*scratch});
+    } else {
+      intern::subdivide_once(m, nu_indices, std::allocator<char>{});
+    }
+  }
+  return m;
+}
+
+/// Moves all vertices onto the unit sphere
+inline void spherize(indexed_mesh &m) {
+  simd::normalize(m.vertices.data(), m.vertices.size());
+}
+
+// SPHERES //////////////////////////
+
+/// Sphere generated by subdividing a cube and projecting
+/// it onto the unit sphere; has cube_sphere_triangles(lv)
+/// triangles.
+///
+/// Triangles close to the cube's corners are smaller than
+/// those at the center of a side.
+inline indexed_mesh cube_sphere(uint lv) {
+  indexed_mesh m = subdivide(cube(), lv);
+  spherize(m);
+  return m;
+}
+
+/// cube_sphere(0) to cube_sphere(max_lv) (as index lv);
+/// cheaper than generating them one by one because every
+/// level is subdivided from the previous one.
+inline std::vector<indexed_mesh> cube_sphere_lods(uint max_lv,
+                                                  arena *scratch=nullptr) {
+  std::vector<indexed_mesh> r;
+  r.reserve(max_lv + 1);
+  indexed_mesh m = cube();
+  for (uint lv=0; lv <= max_lv; lv++) {
+    if (lv > 0) m = subdivide(std::move(m), 1, scratch);
+    r.push_back(m);
+    spherize(r.back());
+  }
+  return r;
+}
+
+/// Number of triangles of a cube_sphere() or quad_sphere()
+/// of the given level: 12·4^lv
+constexpr uint64_t cube_sphere_triangles(uint lv) {
+  return uint64_t{12} << (2*lv);
+}
+
+namespace intern {
+
+/// Orientation of the six cube faces of a quad_sphere:
+/// normal, then the two grid axes (u × v = normal, so the
+/// triangles wind counter clockwise seen from outside)
+constexpr fl quad_sphere_faces[6][3][3] = {
+  {{ 1, 0, 0}, {0, 1, 0}, {0, 0, 1}},
+  {{-1, 0, 0}, {0, 0, 1}, {0, 1, 0}},
+  {{ 0, 1, 0}, {0, 0, 1}, {1, 0, 0}},
+  {{ 0,-1, 0}, {1, 0, 0}, {0, 0, 1}},
+  {{ 0, 0, 1}, {1, 0, 0}, {0, 1, 0}},
+  {{ 0, 0,-1}, {0, 1, 0}, {1, 0, 0}} };
+
+/// Rows [row0, row1) of one face of a quad_sphere with n
+/// quads per side: the vertices of those rows and the quads
+/// starting in them, written to their final place in m
+inline void quad_sphere_patch(indexed_mesh &m, uint32_t n, uint32_t face,
+                              uint32_t row0, uint32_t row1) {
+  const auto &f = quad_sphere_faces[face];
+  const vec3 nor{f[0][0], f[0][1], f[0][2]},
+             u{f[1][0], f[1][1], f[1][2]},
+             v{f[2][0], f[2][1], f[2][2]};
+  const uint32_t side = n + 1;
+  const uint32_t base = face * side * side;
+  const fl step = fl(2) / n;
+
+  // The last patch of a face also writes the top row of
+  // vertices, which has no quads
+  const uint32_t vrow1 = row1 == n ? side : row1;
+  vec3 *vert = m.vertices.data() + base + size_t{row0}*side;
+  for (uint32_t j=row0; j < vrow1; j++)
+    for (uint32_t i=0; i < side; i++)
+      *vert++ = nor + u*(i*step - 1) + v*(j*step - 1);
+  simd::normalize(m.vertices.data() + base + size_t{row0}*side,
+                  size_t{vrow1 - row0}*side);
+
+  uint32_t *idx = m.indices.data() + (size_t{face}*n*n + size_t{row0}*n) * 6;
+  for (uint32_t j=row0; j < row1; j++) {
+    for (uint32_t i=0; i < n; i++) {
+      uint32_t a = base + j*side + i, b = a + 1,
+               d = a + side, c = d + 1;
+      for (uint32_t k : {a, b, c,  a, c, d})
+        *idx++ = k;
+    }
+  }
+}
+
+} // ns intern
+
+/// Sphere generated from a grid of 2^lv × 2^lv quads on
+/// every side of a cube, projected onto the unit sphere;
+/// the same shape (and number of triangles) as
+/// cube_sphere(lv), but generated directly instead of by
+/// repeated subdivision.
+///
+/// Vertices on the edges of the cube are duplicated (every
+/// side has its own grid), so there are 6·(2^lv + 1)²
+/// vertices. All sizes are known up front: every side is
+/// split into patches of rows which are generated in
+/// parallel on the pool (if given), each one writing into
+/// its own slice of the output; no locking needed.
+///
+/// lv must be 14 or less so the indices fit 32 bits.
+inline indexed_mesh quad_sphere(uint lv, job_pool *pool=nullptr) {
+  assert(lv <= 14);
+  const uint32_t n = uint32_t{1} << lv, side = n + 1;
+
+  indexed_mesh m;
+  m.vertices.resize(size_t{6} * side * side);
+  m.indices.resize(cube_sphere_triangles(lv) * 3);
+
+  // Small enough to be cheap to schedule, large enough to
+  // keep the rows of a patch in the same cache lines
+  const uint32_t patch_rows = 32;
+
+  std::vector<std::future<void>> jobs;
+  if (pool) jobs.reserve(6 * ((n + patch_rows - 1) / patch_rows));
+  for (uint32_t f=0; f < 6; f++) {
+    for (uint32_t r=0; r < n; r += patch_rows) {
+      uint32_t r1 = std::min(n, r + patch_rows);
+      if (!pool)
+        intern::quad_sphere_patch(m, n, f, r, r1);
+      else
+        jobs.push_back(pool->submit([&m, n, f, r, r1]() {
+          intern::quad_sphere_patch(m, n, f, r, r1);
+        }));
+    }
+  }
+  // All jobs write into m; wait for every one before
+  // anything is rethrown
+  for (auto &j : jobs) j.wait();
+  for (auto &j : jobs) j.get();
+  return m;
+}
+
+/// Sphere generated by subdividing an icosahedron; has
+/// 20·4^lv triangles of roughly uniform size.
+inline indexed_mesh icosphere(uint lv) {
+  indexed_mesh m = subdivide(icosahedron(), lv);
+  spherize(m);
+  return m;
+}
+
+} // ns gassist::geom
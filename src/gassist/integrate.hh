@@ -0,0 +1,290 @@
+#pragma once
+
+#include <cmath>
+
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "gassist/util.hh"
+#include "gassist/nbody.hh"
+#include "gassist/simd.hh"
+
+namespace gassist::integrate {
+
+// Integrators are policies: Classes with a step() member
+// template advancing a set of bodies by dt, given a force
+// model. The force model is a callable
+//
+//   void (const nbody::bodies &b, std::vector<vec3> &acc)
+//
+// writing the acceleration of every body in b to acc. Both
+// are template parameters of simulation, so there is no
+// virtual dispatch anywhere near the inner loops.
+//
+// Integrators may keep the accelerations of the last step
+// around; call reset() after modifying positions or adding
+// bodies between steps (changing velocities is fine).
+//
+// velocity_lag is how far (in steps) the velocities left by
+// step() lag behind the positions; adding lag times the
+// velocity change of the step estimates the velocities at
+// the new positions.
+
+// FORCE MODELS /////////////////////
+
+/// Exact O(N²) gravity
+struct direct_gravity {
+  nbody::params par;
+
+  void operator()(const nbody::bodies &b, std::vector<vec3> &acc) const {
+    nbody::accelerations_direct(b, acc, par);
+  }
+};
+
+/// Barnes-Hut gravity; O(N log N) but approximate
+struct tree_gravity {
+  nbody::params par;
+  nbody::octree tree;
+
+  void operator()(const nbody::bodies &b, std::vector<vec3> &acc) {
+    nbody::accelerations(tree, b, acc, par);
+  }
+};
+
+// FIXED STEP ///////////////////////
+
+/// Semi implicit (symplectic) euler; first order, one
+/// force evaluation per step. The velocities are those of
+/// the middle of the step.
+class semi_implicit_euler {
+  std::vector<vec3> acc_;
+
+public:
+  static constexpr const char *name = "euler";
+  static constexpr fl velocity_lag = 0.5f;
+
+  void reset() {}
+
+  template<typename F>
+  void step(nbody::bodies &b, fl dt, F &&accel) {
+    accel(b, acc_);
+    simd::axpy(b.vel.data(), acc_.data(), dt, b.size());
+    simd::axpy(b.pos.data(), b.vel.data(), dt, b.size());
+  }
+};
+
+/// Kick-drift-kick leapfrog (velocity verlet); second
+/// order and symplectic. The accelerations at the end of a
+/// step are reused for the start of the next one, so this
+/// costs one force evaluation per step.
+class leapfrog {
+  std::vector<vec3> acc_;
+  bool valid_ = false;
+
+public:
+  static constexpr const char *name = "leapfrog";
+  static constexpr fl velocity_lag = 0;
+
+  void reset() { valid_ = false; }
+
+  template<typename F>
+  void step(nbody::bodies &b, fl dt, F &&accel) {
+    if (!valid_ || acc_.size() != b.size()) accel(b, acc_);
+
+    const fl h = dt / 2;
+    simd::axpy(b.vel.data(), acc_.data(), h, b.size());
+    simd::axpy(b.pos.data(), b.vel.data(), dt, b.size());
+    accel(b, acc_);
+    simd::axpy(b.vel.data(), acc_.data(), h, b.size());
+    valid_ = true;
+  }
+};
+
+/// Yoshida's fourth order symplectic integrator: three
+/// leapfrog like sub steps with carefully chosen (one of
+/// them negative) lengths. Three force evaluations per step.
+class yoshida4 {
+  std::vector<vec3> acc_;
+
+  // w1 = 1/(2 - ∛2), w0 = -∛2/(2 - ∛2)
+  static constexpr double w1 = 1.3512071919596576,
+                          w0 = -1.7024143839193153;
+
+public:
+  static constexpr const char *name = "yoshida4";
+  static constexpr fl velocity_lag = 0;
+
+  /// Drift and kick coefficients
+  static constexpr std::array<fl, 4> c{
+    fl(w1/2), fl((w0+w1)/2), fl((w0+w1)/2), fl(w1/2) };
+  static constexpr std::array<fl, 3> d{ fl(w1), fl(w0), fl(w1) };
+
+  void reset() {}
+
+  template<typename F>
+  void step(nbody::bodies &b, fl dt, F &&accel) {
+    for (size_t s=0; s < 3; s++) {
+      simd::axpy(b.pos.data(), b.vel.data(), c[s] * dt, b.size());
+      accel(b, acc_);
+      simd::axpy(b.vel.data(), acc_.data(), d[s] * dt, b.size());
+    }
+    simd::axpy(b.pos.data(), b.vel.data(), c[3] * dt, b.size());
+  }
+};
+
+// ADAPTIVE /////////////////////////
+
+/// Dormand-Prince 5(4) Runge-Kutta with error control.
+///
+/// step() always advances by exactly dt, but internally
+/// takes as many sub steps as necessary to keep the
+/// estimated local error of every body below the tolerance;
+/// the sub step length carries over between calls. Six
+/// force evaluations per accepted sub step (the seventh is
+/// reused by the next one).
+///
+/// Not symplectic: energy drifts, but slowly with tight
+/// tolerances.
+class dormand_prince {
+  static constexpr size_t stages = 7;
+
+  // Butcher tableau; row i holds a[i][0..i-1]
+  static constexpr double a[stages][stages-1] = {
+    {},
+    {1./5},
+    {3./40, 9./40},
+    {44./45, -56./15, 32./9},
+    {19372./6561, -25360./2187, 64448./6561, -212./729},
+    {9017./3168, -355./33, 46732./5247, 49./176, -5103./18656},
+    {35./384, 0, 500./1113, 125./192, -2187./6784, 11./84} };
+
+  // Fifth order weights minus fourth order weights
+  static constexpr double e[stages] = {
+    35./384 - 5179./57600, 0, 500./1113 - 7571./16695,
+    125./192 - 393./640, -2187./6784 + 92097./339200,
+    11./84 - 187./2100, -1./40 };
+
+  fl rtol_, atol_, h_ = 0;
+
+  // Derivatives of position and velocity per stage
+  std::array<std::vector<vec3>, stages> kx_, kv_;
+  nbody::bodies stage_;
+  bool fsal_ = false; // kv_[0] is valid for the current state
+
+  size_t steps_ = 0, rejected_ = 0;
+
+  /// Positions and velocities at stage s into stage_
+  void stage_state(const nbody::bodies &b, size_t s, fl h) {
+    for (size_t i=0; i < b.size(); i++) {
+      vec3 dx{0, 0, 0}, dv{0, 0, 0};
+      for (size_t j=0; j < s; j++) {
+        dx += kx_[j][i] * fl(a[s][j]);
+        dv += kv_[j][i] * fl(a[s][j]);
+      }
+      stage_.pos[i] = b.pos[i] + dx*h;
+      stage_.vel[i] = b.vel[i] + dv*h;
+    }
+  }
+
+  /// Attempts a sub step of length h; returns the error
+  /// estimate relative to the tolerance (<= 1 means ok).
+  /// The result is left in stage_ and kv_[6].
+  template<typename F>
+  fl try_step(const nbody::bodies &b, fl h, F &&accel) {
+    if (!fsal_) accel(b, kv_[0]);
+    kx_[0] = b.vel;
+
+    for (size_t s=1; s < stages; s++) {
+      stage_state(b, s, h);
+      kx_[s] = stage_.vel;
+      accel(stage_, kv_[s]);
+    }
+    // The last stage is the fifth order solution itself
+
+    fl err = 0;
+    for (size_t i=0; i < b.size(); i++) {
+      vec3 ex{0, 0, 0}, ev{0, 0, 0};
+      for (size_t s=0; s < stages; s++) {
+        ex += kx_[s][i] * fl(e[s]);
+        ev += kv_[s][i] * fl(e[s]);
+      }
+      fl sx = atol_ + rtol_ * glm::length(b.pos[i]),
+         sv = atol_ + rtol_ * glm::length(b.vel[i]);
+      err = std::max({err, glm::length(ex) * h / sx,
+                           glm::length(ev) * h / sv});
+    }
+    return err;
+  }
+
+public:
+  static constexpr const char *name = "dopri45";
+  static constexpr fl velocity_lag = 0;
+
+  dormand_prince(fl rtol=1e-5f, fl atol=1e-7f)
+    : rtol_{rtol}, atol_{atol} {}
+
+  void reset() { fsal_ = false; }
+
+  /// Accepted/rejected sub steps so far
+  size_t steps() const { return steps_; }
+  size_t rejected() const { return rejected_; }
+
+  template<typename F>
+  void step(nbody::bodies &b, fl dt, F &&accel) {
+    if (stage_.size() != b.size()) {
+      stage_ = b;
+      fsal_ = false;
+    }
+    stage_.mass = b.mass;
+    for (auto &k : kx_) k.resize(b.size());
+    for (auto &k : kv_) k.resize(b.size());
+    if (h_ <= 0) h_ = dt;
+
+    fl t = 0;
+    while (t < dt) {
+      fl h = std::min(h_, dt - t);
+      fl err = try_step(b, h, accel);
+
+      // Sub steps this short make no progress in single
+      // precision; accept them regardless
+      bool accept = err <= 1 || h < dt * 1e-6f;
+
+      // Standard step size control
+      fl fac = err > 0 ? 0.9f * std::pow(err, -0.2f) : 5;
+      fl nu_h = h * std::clamp(fac, 0.2f, 5.0f);
+
+      if (accept) {
+        std::swap(b.pos, stage_.pos);
+        std::swap(b.vel, stage_.vel);
+        std::swap(kv_[0], kv_[stages-1]);
+        fsal_ = true;
+        t += h;
+        steps_++;
+        // Don't let the clamp to the end of dt shrink h
+        if (h == h_ || nu_h < h_) h_ = nu_h;
+      } else {
+        rejected_++;
+        h_ = nu_h;
+      }
+    }
+  }
+};
+
+// SIMULATION ///////////////////////
+
+/// A set of bodies together with the force model and the
+/// integrator advancing them
+template<typename Integrator, typename Force=direct_gravity>
+struct simulation {
+  nbody::bodies bodies;
+  Force force;
+  Integrator integrator;
+
+  void step(fl dt) {
+    integrator.step(bodies, dt, force);
+  }
+};
+
+} // ns gassist::integrate
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <utility>
+
+#include <softwear/thread_pool.hpp>
+
+namespace gassist {
+
+/// A set of worker threads executing jobs in the order
+/// they where submitted.
+///
+/// The threads are managed by a softwear::thread_pool; each
+/// of them pulls jobs from a shared queue. On destruction
+/// all jobs still in the queue are executed before the
+/// workers are joined, so every future obtained from
+/// submit() will eventually become ready.
+///
+/// Thread safe.
+class job_pool {
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> queue_;
+  bool stop_ = false;
+
+  // Must be declared last, so the threads are joined
+  // before the queue is destroyed
+  softwear::thread_pool workers_;
+
+  void work() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock{mtx_};
+        cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) return; // stop_ is set
+        job = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      job();
+    }
+  }
+
+public:
+  /// Spawns the given number of workers; by default
+  /// one per hardware thread
+  job_pool(size_t no_workers=std::thread::hardware_concurrency())
+    : workers_{std::max<size_t>(no_workers, 1),
+               [this]() { work(); }} {}
+
+  ~job_pool() {
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      stop_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  job_pool(const job_pool&) = delete;
+  job_pool& operator =(const job_pool&) = delete;
+
+  /// Queues f for execution on one of the workers;
+  /// returns a future for the result of f().
+  template<typename F>
+  auto submit(F &&f) -> std::future<decltype(f())> {
+    typedef decltype(f()) R;
+
+    // std::function must be copyable, packaged_task is not
+    auto task = std::make_shared<std::packaged_task<R()>>(
+        std::forward<F>(f));
+    auto fut = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock{mtx_};
+      queue_.emplace_back([task]() { (*task)(); });
+    }
+    cv_.notify_one();
+    return fut;
+  }
+};
+
+/// Whether the given future is ready without blocking
+template<typename T>
+bool is_ready(const std::future<T> &f) {
+  return f.valid() &&
+    f.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+}
+
+} // ns gassist
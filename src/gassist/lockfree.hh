@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <atomic>
+#include <array>
+#include <utility>
+
+namespace gassist {
+
+/// Lock free triple buffer for passing snapshots of some
+/// state from exactly one writer thread to exactly one
+/// reader thread.
+///
+/// The writer fills back() and then calls publish(), the
+/// reader calls read() to obtain the latest published
+/// value. Neither side ever blocks or waits on the other:
+/// The writer always has a free slot to write to and the
+/// reader always has a complete snapshot to read from, so
+/// there is no tearing; the reader just skips intermediate
+/// values if the writer is faster.
+///
+/// Slots are reused, so writing into back() by assignment
+/// avoids reallocating any buffers T may own.
+template<typename T>
+class triple_buffer {
+  std::array<T, 3> slots_;
+
+  /// Index of the slot that is neither owned by the
+  /// writer nor the reader; the dirty bit indicates that
+  /// it contains a value the reader has not seen yet.
+  std::atomic<uint8_t> middle_{1};
+  static constexpr uint8_t dirty = 4, idx_mask = 3;
+
+  // Only ever accessed by the writer/reader respectively
+  uint8_t back_ = 0, front_ = 2;
+
+public:
+  triple_buffer() = default;
+
+  /// Initializes all slots with the given value
+  triple_buffer(const T &init) : slots_{init, init, init} {}
+
+  triple_buffer(const triple_buffer&) = delete;
+  triple_buffer& operator =(const triple_buffer&) = delete;
+
+  //// WRITER SIDE ////
+
+  /// The slot the writer may fill
+  T& back() { return slots_[back_]; }
+
+  /// Makes the contents of back() available to the reader;
+  /// back() will point to a different slot afterwards.
+  void publish() {
+    uint8_t prev = middle_.exchange(back_ | dirty,
+                                    std::memory_order_acq_rel);
+    back_ = prev & idx_mask;
+  }
+
+  /// Shorthand for assigning to back() and publishing
+  template<typename V>
+  void publish(V &&v) {
+    back() = std::forward<V>(v);
+    publish();
+  }
+
+  //// READER SIDE ////
+
+  /// Whether a value was published that has not been read
+  bool has_update() const {
+    return middle_.load(std::memory_order_acquire) & dirty;
+  }
+
+  /// Returns the latest published value.
+  ///
+  /// The reference stays valid (and unchanged) until the
+  /// next call to read().
+  const T& read() {
+    if (has_update()) {
+      uint8_t prev = middle_.exchange(front_,
+                                      std::memory_order_acq_rel);
+      front_ = prev & idx_mask;
+    }
+    return slots_[front_];
+  }
+};
+
+/// Lock free ring buffer for passing a stream of values
+/// (e.g. events) from exactly one producer thread to exactly
+/// one consumer thread.
+///
+/// push() and pop() are wait free and never allocate; the
+/// capacity N is fixed and must be a power of two. If the
+/// queue is full push() fails and the value is dropped;
+/// this is counted in overflows(). max_depth() is the
+/// largest number of values that where queued at once,
+/// which helps choosing N.
+///
+/// T should be cheap to copy; values are copied into and
+/// out of the ring.
+template<typename T, size_t N>
+class spsc_queue {
+  static_assert(N >= 2 && (N & (N-1)) == 0,
+                "Capacity must be a power of two");
+
+  std::array<T, N> slots_;
+
+  // Monotonic counters; the index into slots_ is the
+  // counter modulo N. Kept on separate cache lines so the
+  // two threads do not fight over them.
+  alignas(64) std::atomic<size_t> head_{0}; // Written by the consumer
+  alignas(64) std::atomic<size_t> tail_{0}; // Written by the producer
+
+  // Statistics; written by the producer
+  alignas(64) std::atomic<size_t> overflows_{0}, max_depth_{0};
+
+public:
+  spsc_queue() = default;
+  spsc_queue(const spsc_queue&) = delete;
+  spsc_queue& operator =(const spsc_queue&) = delete;
+
+  static constexpr size_t capacity() { return N; }
+
+  //// PRODUCER SIDE ////
+
+  /// Appends v to the queue; returns false (and drops v)
+  /// if the queue is full
+  bool push(const T &v) {
+    size_t t = tail_.load(std::memory_order_relaxed),
+           h = head_.load(std::memory_order_acquire);
+    if (t - h == N) {
+      overflows_.store(overflows_.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+      return false;
+    }
+
+    slots_[t % N] = v;
+    tail_.store(t + 1, std::memory_order_release);
+
+    if (t + 1 - h > max_depth_.load(std::memory_order_relaxed))
+      max_depth_.store(t + 1 - h, std::memory_order_relaxed);
+    return true;
+  }
+
+  //// CONSUMER SIDE ////
+
+  /// Removes the oldest value from the queue and stores
+  /// it in out; returns false if the queue is empty
+  bool pop(T &out) {
+    size_t h = head_.load(std::memory_order_relaxed),
+           t = tail_.load(std::memory_order_acquire);
+    if (h == t) return false;
+
+    out = slots_[h % N];
+    head_.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Calls f with every value that is queued at the time
+  /// of the call (values pushed concurrently may or may not
+  /// be included); returns the number of values.
+  template<typename F>
+  size_t drain(F &&f) {
+    size_t h = head_.load(std::memory_order_relaxed),
+           t = tail_.load(std::memory_order_acquire);
+    for (size_t i=h; i < t; i++) {
+      f(slots_[i % N]);
+      head_.store(i + 1, std::memory_order_release);
+    }
+    return t - h;
+  }
+
+  //// EITHER SIDE ////
+
+  /// Number of queued values; only a snapshot
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire)
+         - head_.load(std::memory_order_acquire);
+  }
+
+  /// Number of values dropped because the queue was full
+  size_t overflows() const {
+    return overflows_.load(std::memory_order_relaxed);
+  }
+
+  /// Largest number of values queued at once so far
+  size_t max_depth() const {
+    return max_depth_.load(std::memory_order_relaxed);
+  }
+};
+
+} // ns gassist
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <vector>
+#include <array>
+#include <limits>
+#include <algorithm>
+
+#include "gassist/util.hh"
+
+namespace gassist::nbody {
+
+// BODY STORAGE ////////////////
+
+/// The state of all bodies in a simulation.
+///
+/// Stored as a structure of arrays: the i-th body is
+/// described by mass[i], pos[i] and vel[i]. All arrays
+/// always have the same length.
+///
+/// Keeping the attributes apart means the force pass only
+/// ever touches masses and positions and the integrators
+/// can walk over positions and velocities linearly.
+struct bodies {
+  std::vector<fl>   mass;
+  std::vector<vec3> pos;
+  std::vector<vec3> vel;
+
+  size_t size() const { return mass.size(); }
+  bool empty() const { return mass.empty(); }
+
+  void reserve(size_t n) {
+    mass.reserve(n);
+    pos.reserve(n);
+    vel.reserve(n);
+  }
+
+  void clear() {
+    mass.clear();
+    pos.clear();
+    vel.clear();
+  }
+
+  /// Adds a body and returns it's index
+  size_t add(fl m, const vec3 &p, const vec3 &v={0, 0, 0}) {
+    mass.push_back(m);
+    pos.push_back(p);
+    vel.push_back(v);
+    return size() - 1;
+  }
+};
+
+/// Tunables of the force calculation
+struct params {
+  /// Gravitational constant in world units
+  fl G = 1;
+
+  /// Plummer softening length; avoids the singularity
+  /// when two bodies get very close
+  fl softening = 0.01f;
+
+  /// Barnes-Hut opening angle; a node of size s at distance
+  /// d is treated as a point mass if s/d < theta.
+  /// 0 degenerates into the exact (but slower) calculation.
+  fl theta = 0.5f;
+};
+
+namespace intern {
+
+/// Acceleration exerted on a body at p by the point mass
+/// m at q (eps2 is the squared softening length)
+inline vec3 pull(const vec3 &p, const vec3 &q, fl m, fl eps2) {
+  vec3 d = q - p;
+  fl r2 = glm::dot(d, d) + eps2;
+  fl inv_r = 1 / std::sqrt(r2);
+  return d * (m * inv_r * inv_r * inv_r);
+}
+
+} // ns intern
+
+// REFERENCE PATH //////////////
+
+/// Exact O(N²) calculation of the acceleration of every
+/// body. Slow; use this to validate the octree results.
+///
+/// Writes to acc which is resized to the number of bodies.
+inline void accelerations_direct(const bodies &b,
+                                 std::vector<vec3> &acc,
+                                 const params &par={}) {
+  const fl eps2 = par.softening * par.softening;
+  acc.assign(b.size(), vec3{0, 0, 0});
+
+  // Uses the symmetry of the interaction to halve the work
+  for (size_t i=0; i < b.size(); i++) {
+    for (size_t j=i+1; j < b.size(); j++) {
+      vec3 d = b.pos[j] - b.pos[i];
+      fl r2 = glm::dot(d, d) + eps2;
+      fl inv_r = 1 / std::sqrt(r2);
+      vec3 f = d * (par.G * inv_r * inv_r * inv_r);
+      acc[i] += f * b.mass[j];
+      acc[j] -= f * b.mass[i];
+    }
+  }
+}
+
+/// Total (kinetic plus softened potential) energy of the
+/// system; O(N²). Used to measure the drift of integrators,
+/// so it is accumulated in double precision.
+inline double energy(const bodies &b, const params &par={}) {
+  const double eps2 = double(par.softening) * par.softening;
+  double kin = 0, pot = 0;
+  for (size_t i=0; i < b.size(); i++) {
+    kin += 0.5 * b.mass[i] * glm::dot(b.vel[i], b.vel[i]);
+    for (size_t j=i+1; j < b.size(); j++) {
+      vec3 d = b.pos[j] - b.pos[i];
+      pot -= double(b.mass[i]) * b.mass[j]
+           / std::sqrt(glm::dot(d, d) + eps2);
+    }
+  }
+  return kin + par.G * pot;
+}
+
+// BARNES-HUT //////////////////
+
+/// Barnes-Hut octree over the positions of a set of bodies.
+///
+/// Rebuild with build() whenever the positions changed, then
+/// evaluate the accelerations in O(N log N) with
+/// accelerations().
+///
+/// The tree keeps copies of the masses/positions sorted in
+/// tree order, so it can be evaluated against the state it
+/// was built from even while the bodies are being moved.
+///
+/// Reuses it's buffers; keep one tree around instead of
+/// constructing a new one every step.
+class octree {
+public:
+  /// Bodies per leaf; bigger leaves mean shallower trees
+  /// and more (cheap, linear) direct interactions
+  uint leaf_size = 8;
+
+  /// Bodies that are closer together than the precision of
+  /// fl would otherwise make the tree infinitely deep
+  static constexpr uint max_depth = 32;
+
+private:
+  struct node {
+    /// Center of mass and total mass of the node
+    vec3 com;
+    fl mass;
+
+    /// Cubic cell of the node
+    vec3 center;
+    fl half;
+
+    /// Range [begin, end) of the bodies (in tree order)
+    /// inside this node
+    uint32_t begin, end;
+
+    /// The non-empty children are stored contiguously
+    /// starting at first_child; no_children=0 means leaf
+    uint32_t first_child;
+    uint32_t no_children;
+  };
+
+  std::vector<node> nodes_;
+
+  /// Body indices in tree order
+  std::vector<uint32_t> order_, scratch_;
+
+  /// mass/pos of the bodies in tree order
+  std::vector<fl> mass_;
+  std::vector<vec3> pos_;
+
+  static uint octant(const vec3 &p, const vec3 &c) {
+    return (p.x >= c.x) | (p.y >= c.y) << 1 | (p.z >= c.z) << 2;
+  }
+
+  void build_node(uint32_t idx, uint depth, const bodies &b) {
+    uint32_t begin = nodes_[idx].begin, end = nodes_[idx].end;
+
+    if (end - begin <= leaf_size || depth >= max_depth) {
+      fl m = 0;
+      vec3 weighted{0, 0, 0};
+      for (uint32_t i=begin; i < end; i++) {
+        m += b.mass[order_[i]];
+        weighted += b.pos[order_[i]] * b.mass[order_[i]];
+      }
+      nodes_[idx].mass = m;
+      nodes_[idx].com = m > 0 ? weighted / m : nodes_[idx].center;
+      return;
+    }
+
+    // Counting sort of the bodies into the eight octants
+    const vec3 c = nodes_[idx].center;
+    std::array<uint32_t, 8> count{}, offset{};
+    for (uint32_t i=begin; i < end; i++)
+      count[octant(b.pos[order_[i]], c)]++;
+
+    uint32_t no_children = 0;
+    for (uint o=0, acc=begin; o < 8; o++) {
+      offset[o] = acc;
+      acc += count[o];
+      no_children += count[o] > 0;
+    }
+
+    std::array<uint32_t, 8> cursor = offset;
+    for (uint32_t i=begin; i < end; i++)
+      scratch_[cursor[octant(b.pos[order_[i]], c)]++] = order_[i];
+    std::copy(scratch_.begin() + begin, scratch_.begin() + end,
+              order_.begin() + begin);
+
+    // Allocate the children; this may reallocate nodes_,
+    // so no references into it are held across this
+    const uint32_t first = nodes_.size();
+    const fl h = nodes_[idx].half / 2;
+    nodes_[idx].first_child = first;
+    nodes_[idx].no_children = no_children;
+    nodes_.resize(first + no_children);
+
+    for (uint o=0, ch=first; o < 8; o++) {
+      if (count[o] == 0) continue;
+      node &n = nodes_[ch++];
+      n.center = c + vec3{o & 1 ? h : -h,
+                          o & 2 ? h : -h,
+                          o & 4 ? h : -h};
+      n.half = h;
+      n.begin = offset[o];
+      n.end = offset[o] + count[o];
+      n.first_child = 0;
+      n.no_children = 0;
+    }
+
+    fl m = 0;
+    vec3 weighted{0, 0, 0};
+    for (uint32_t ch=first; ch < first + no_children; ch++) {
+      build_node(ch, depth+1, b);
+      m += nodes_[ch].mass;
+      weighted += nodes_[ch].com * nodes_[ch].mass;
+    }
+    nodes_[idx].mass = m;
+    nodes_[idx].com = m > 0 ? weighted / m : c;
+  }
+
+public:
+  /// (Re)builds the tree from the current body positions
+  void build(const bodies &b) {
+    nodes_.clear();
+    order_.resize(b.size());
+    scratch_.resize(b.size());
+    for (size_t i=0; i < b.size(); i++) order_[i] = i;
+
+    vec3 lo{ std::numeric_limits<fl>::max()},
+         hi{-std::numeric_limits<fl>::max()};
+    for (auto &p : b.pos) {
+      lo = glm::min(lo, p);
+      hi = glm::max(hi, p);
+    }
+    if (b.empty()) lo = hi = vec3{0, 0, 0};
+
+    vec3 ext = hi - lo;
+    node root;
+    root.center = lo + ext * 0.5f;
+    root.half = std::max({ext.x, ext.y, ext.z}) / 2
+              * 1.0001f + std::numeric_limits<fl>::min();
+    root.begin = 0;
+    root.end = b.size();
+    root.first_child = root.no_children = 0;
+    nodes_.push_back(root);
+
+    build_node(0, 0, b);
+
+    mass_.resize(b.size());
+    pos_.resize(b.size());
+    for (size_t i=0; i < b.size(); i++) {
+      mass_[i] = b.mass[order_[i]];
+      pos_[i] = b.pos[order_[i]];
+    }
+  }
+
+  size_t size() const { return order_.size(); }
+  size_t no_nodes() const { return nodes_.size(); }
+
+  /// Body indices in tree order. Iterating the bodies in
+  /// this order is much more cache friendly than iterating
+  /// them in their natural order.
+  const std::vector<uint32_t>& order() const { return order_; }
+
+  /// The acceleration at p caused by all bodies in the tree.
+  ///
+  /// The body with index skip (if any) is ignored; pass
+  /// the index of the body at p to exclude self interaction.
+  vec3 acceleration_at(const vec3 &p, const params &par={},
+      size_t skip=std::numeric_limits<size_t>::max()) const {
+    vec3 acc{0, 0, 0};
+    if (nodes_.empty() || nodes_[0].mass <= 0) return acc;
+
+    const fl eps2 = par.softening * par.softening,
+             theta2 = par.theta * par.theta;
+
+    // Depth first traversal with an explicit stack; every
+    // level pushes at most 8 nodes and pops one
+    std::array<uint32_t, 8*(max_depth+1)> stack;
+    uint sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0) {
+      const node &n = nodes_[stack[--sp]];
+
+      if (n.no_children == 0) {
+        for (uint32_t i=n.begin; i < n.end; i++)
+          if (order_[i] != skip)
+            acc += intern::pull(p, pos_[i], mass_[i], eps2);
+        continue;
+      }
+
+      vec3 d = n.com - p;
+      fl size = 2*n.half;
+      if (size*size < theta2 * glm::dot(d, d)) {
+        acc += intern::pull(p, n.com, n.mass, eps2);
+      } else {
+        for (uint32_t ch=n.first_child; ch < n.first_child + n.no_children; ch++)
+          stack[sp++] = ch;
+      }
+    }
+
+    return acc * par.G;
+  }
+
+  /// Evaluates the acceleration of the bodies at the tree
+  /// order positions [begin, end), writing them to
+  /// acc[order()[i]].
+  ///
+  /// The ranges are independent, so the force pass can be
+  /// split across threads; acc must already have the size
+  /// of the tree.
+  void accelerations(std::vector<vec3> &acc, size_t begin,
+                     size_t end, const params &par={}) const {
+    for (size_t i=begin; i < end; i++)
+      acc[order_[i]] = acceleration_at(pos_[i], par, order_[i]);
+  }
+
+  /// Evaluates the acceleration of every body the tree was
+  /// built from; acc is resized to the number of bodies.
+  void accelerations(std::vector<vec3> &acc,
+                     const params &par={}) const {
+    acc.resize(size());
+    accelerations(acc, 0, size(), par);
+  }
+};
+
+/// Convenience function; builds the tree and evaluates the
+/// accelerations in one go.
+inline void accelerations(octree &tree, const bodies &b,
+                          std::vector<vec3> &acc,
+                          const params &par={}) {
+  tree.build(b);
+  tree.accelerations(acc, par);
+}
+
+} // ns gassist::nbody
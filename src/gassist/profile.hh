@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cstdint>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <epoxy/gl.h>
+
+namespace gassist::profile {
+
+typedef std::chrono::steady_clock clock;
+
+/// Rolling window over the last N samples of some
+/// measurement (e.g. a frame time in milliseconds)
+class histogram {
+  std::vector<float> samples_;
+  mutable std::vector<float> scratch_;
+  size_t next_ = 0, count_ = 0;
+
+public:
+  histogram(size_t window=512) : samples_(std::max<size_t>(window, 1)) {}
+
+  void add(float v) {
+    samples_[next_] = v;
+    next_ = (next_ + 1) % samples_.size();
+    count_ = std::min(count_ + 1, samples_.size());
+  }
+
+  /// Number of samples in the window
+  size_t size() const { return count_; }
+
+  /// The p-th percentile (p in [0, 1]) of the window;
+  /// 0 if the window is empty
+  float percentile(float p) const {
+    if (count_ == 0) return 0;
+    scratch_.assign(samples_.begin(), samples_.begin() + count_);
+    auto nth = scratch_.begin() + std::min<size_t>(p * count_, count_ - 1);
+    std::nth_element(scratch_.begin(), nth, scratch_.end());
+    return *nth;
+  }
+};
+
+/// Collects timings of named sections of the frame on the
+/// CPU and the GPU.
+///
+/// Sections are measured with cpu_scope and gpu_scope. GPU
+/// times are measured with GL_TIME_ELAPSED queries which are
+/// only read back once the results are available; call
+/// collect() once per frame. Nothing ever waits for the GPU.
+///
+/// Disabled by default; while disabled the scopes boil down
+/// to a single branch. Define GASSIST_NO_PROFILE to compile
+/// them out completely.
+///
+/// Not thread safe; GPU scopes require the GL context of
+/// the thread and must not be nested.
+class profiler {
+  struct section {
+    std::string name;
+    histogram cpu, gpu;
+  };
+
+  struct counter {
+    std::string name;
+    histogram values;
+  };
+
+  struct pending_query {
+    GLuint id;
+    size_t section;
+    // First use of a newly generated query object
+    bool fresh;
+  };
+
+  bool enabled_ = false;
+  size_t window_;
+  std::vector<section> sections_;
+  std::vector<counter> counters_;
+  std::deque<pending_query> pending_;
+  std::vector<GLuint> free_queries_;
+
+  std::ostream *out_ = nullptr;
+  clock::duration interval_ = std::chrono::seconds{5};
+  clock::time_point last_dump_ = clock::now();
+
+public:
+  /// window is the number of samples per histogram
+  profiler(size_t window=512) : window_{window} {}
+
+  ~profiler() {
+    for (auto &q : pending_) glDeleteQueries(1, &q.id);
+    if (!free_queries_.empty())
+      glDeleteQueries(free_queries_.size(), free_queries_.data());
+  }
+
+  profiler(const profiler&) = delete;
+  profiler& operator =(const profiler&) = delete;
+
+  bool enabled() const { return enabled_; }
+  void enable(bool on=true) { enabled_ = on; }
+
+  /// Index of the section with the given name;
+  /// creates the section if it does not exist yet
+  size_t section_id(const char *name) {
+    for (size_t i=0; i < sections_.size(); i++)
+      if (sections_[i].name == name) return i;
+    sections_.push_back({name, histogram{window_}, histogram{window_}});
+    return sections_.size() - 1;
+  }
+
+  void add_cpu(size_t sec, clock::duration d) {
+    sections_[sec].cpu.add(
+        std::chrono::duration<float, std::milli>{d}.count());
+  }
+
+  void add_cpu(const char *name, clock::duration d) {
+    if (enabled_) add_cpu(section_id(name), d);
+  }
+
+  /// Records a per frame quantity that is not a time
+  /// (e.g. the number of objects drawn)
+  void add_count(const char *name, double v) {
+    if (!enabled_) return;
+    for (auto &c : counters_)
+      if (c.name == name) {
+        c.values.add(v);
+        return;
+      }
+    counters_.push_back({name, histogram{window_}});
+    counters_.back().values.add(v);
+  }
+
+  /// Starts a GL_TIME_ELAPSED query for the section
+  void begin_gpu(size_t sec) {
+    GLuint q;
+    const bool fresh = free_queries_.empty();
+    if (fresh) {
+      glGenQueries(1, &q);
+    } else {
+      q = free_queries_.back();
+      free_queries_.pop_back();
+    }
+    pending_.push_back({q, sec, fresh});
+    glBeginQuery(GL_TIME_ELAPSED, q);
+  }
+
+  void end_gpu() {
+    glEndQuery(GL_TIME_ELAPSED);
+  }
+
+  /// Reads back all GPU timings that are available; the
+  /// queries complete in order, so this stops at the first
+  /// one that is not.
+  void collect() {
+    while (!pending_.empty()) {
+      pending_query &q = pending_.front();
+      GLint available = 0;
+      glGetQueryObjectiv(q.id, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available) break;
+
+      GLuint64 ns;
+      glGetQueryObjectui64v(q.id, GL_QUERY_RESULT, &ns);
+
+      // Some drivers (llvmpipe) report garbage for the first
+      // use of a query object, e.g. the time since context
+      // creation; only the reuses are trusted
+      if (!q.fresh)
+        sections_[q.section].gpu.add(ns / 1e6f);
+
+      free_queries_.push_back(q.id);
+      pending_.pop_front();
+    }
+  }
+
+  /// Periodically writes a summary to the given stream
+  /// (see maybe_dump()); nullptr disables that.
+  void set_output(std::ostream *out,
+                  clock::duration interval=std::chrono::seconds{5}) {
+    out_ = out;
+    interval_ = interval;
+  }
+
+  /// Writes a table with the p50/p95/p99 times of every
+  /// section in milliseconds, followed by the counters
+  void dump(std::ostream &o) const {
+    auto stats = [&](const histogram &h) {
+      o << std::setw(10) << h.percentile(0.5f)
+        << std::setw(10) << h.percentile(0.95f)
+        << std::setw(10) << h.percentile(0.99f);
+    };
+
+    o << std::fixed << std::setprecision(3)
+      << std::left << std::setw(16) << "section" << std::right
+      << std::setw(30) << "cpu ms p50/p95/p99"
+      << std::setw(30) << "gpu ms p50/p95/p99" << "\n";
+    for (auto &s : sections_) {
+      o << std::left << std::setw(16) << s.name << std::right;
+      stats(s.cpu);
+      stats(s.gpu);
+      o << "\n";
+    }
+    if (!counters_.empty()) {
+      o << std::left << std::setw(16) << "counter" << std::right
+        << std::setw(30) << "p50/p95/p99" << "\n";
+      for (auto &c : counters_) {
+        o << std::left << std::setw(16) << c.name << std::right;
+        stats(c.values);
+        o << "\n";
+      }
+    }
+    o << std::flush;
+  }
+
+  /// Dumps to the output set with set_output() if the
+  /// interval has passed since the last dump
+  void maybe_dump() {
+    if (!enabled_ || !out_) return;
+    auto now = clock::now();
+    if (now - last_dump_ < interval_) return;
+    last_dump_ = now;
+    dump(*out_);
+  }
+};
+
+#ifndef GASSIST_NO_PROFILE
+
+/// Measures the CPU time until the end of the scope
+class cpu_scope {
+  profiler *p_ = nullptr;
+  size_t sec_;
+  clock::time_point t0_;
+
+public:
+  cpu_scope(profiler &p, const char *name) {
+    if (!p.enabled()) return;
+    p_ = &p;
+    sec_ = p.section_id(name);
+    t0_ = clock::now();
+  }
+
+  ~cpu_scope() {
+    if (p_) p_->add_cpu(sec_, clock::now() - t0_);
+  }
+
+  cpu_scope(const cpu_scope&) = delete;
+  cpu_scope& operator =(const cpu_scope&) = delete;
+};
+
+/// Measures the GPU time of the commands issued until the
+/// end of the scope; must not be nested
+class gpu_scope {
+  profiler *p_ = nullptr;
+
+public:
+  gpu_scope(profiler &p, const char *name) {
+    if (!p.enabled()) return;
+    p_ = &p;
+    p.begin_gpu(p.section_id(name));
+  }
+
+  ~gpu_scope() {
+    if (p_) p_->end_gpu();
+  }
+
+  gpu_scope(const gpu_scope&) = delete;
+  gpu_scope& operator =(const gpu_scope&) = delete;
+};
+
+#else
+
+struct cpu_scope {
+  cpu_scope(profiler&, const char*) {}
+};
+
+struct gpu_scope {
+  gpu_scope(profiler&, const char*) {}
+};
+
+#endif
+
+} // ns gassist::profile
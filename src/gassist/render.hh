@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+
+#include "gassist/util.hh"
+#include "gassist/arena.hh"
+#include "gassist/wrap_gl.hh"
+#include "gassist/asset.hh"
+
+namespace gassist {
+
+// SORT KEYS ////////////////////////
+
+/// Render passes, in the order they are drawn
+enum class pass : uint8_t {
+  /// Behind everything; does not write depth (the skybox)
+  background,
+  opaque
+};
+
+/// Packs the state an object is drawn with into a key, so
+/// sorting the keys groups objects by state; most expensive
+/// state change first:
+///
+///   bits 60-63  pass
+///        52-59  program
+///        40-51  texture
+///        24-39  mesh (vertex array)
+///         0-23  view distance
+///
+/// The GL object names are truncated to their fields; they
+/// are small integers in practice, and a collision only
+/// costs an extra state change, since drawing compares the
+/// actual objects. Within the same state objects are
+/// sorted front to back.
+inline uint64_t sort_key(pass p, GLuint program, GLuint texture,
+                         GLuint vertex_array, fl distance) {
+  // The bits of a non negative float sort like the float
+  uint32_t d;
+  fl pos = distance > 0 ? distance : 0;
+  std::memcpy(&d, &pos, sizeof(d));
+  return uint64_t(p) << 60
+       | uint64_t(program & 0xff) << 52
+       | uint64_t(texture & 0xfff) << 40
+       | uint64_t(vertex_array & 0xffff) << 24
+       | uint64_t(d >> 8);
+}
+
+/// Sorts the entries by key with an LSD radix sort, eight
+/// bits at a time; tmp is scratch space. Bytes that are
+/// the same in all keys (e.g. the pass in most frames) are
+/// skipped.
+template<typename T, typename A>
+void radix_sort(std::vector<T, A> &v, std::vector<T, A> &tmp) {
+  if (v.empty()) return;
+  size_t count[8][256] = {};
+  for (const T &e : v)
+    for (uint b=0; b < 8; b++)
+      count[b][e.key >> (8*b) & 0xff]++;
+
+  tmp.resize(v.size());
+  for (uint b=0; b < 8; b++) {
+    size_t *c = count[b];
+    if (c[v.front().key >> (8*b) & 0xff] == v.size()) continue;
+
+    size_t sum = 0;
+    for (uint i=0; i < 256; i++) {
+      size_t n = c[i];
+      c[i] = sum;
+      sum += n;
+    }
+    for (const T &e : v)
+      tmp[c[e.key >> (8*b) & 0xff]++] = e;
+    v.swap(tmp);
+  }
+}
+
+// RENDER QUEUE /////////////////////
+
+/// Collects the objects of a frame as draw packets and
+/// paints them sorted by state (see sort_key()), with as
+/// few state changes and draw calls as possible.
+///
+/// Consecutive packets with the same pass, program, texture
+/// and mesh are painted with a single instanced draw call;
+/// binding a program, texture or vertex array already bound
+/// is skipped. The model matrices of all packets are
+/// uploaded in one go.
+///
+/// The packets and the sorting buffers only live for a
+/// frame; they are allocated from an arena which flush()
+/// resets, sized after the previous frame, so a warmed up
+/// queue does not touch the heap.
+///
+/// Usage: add() every object, then flush() once. The
+/// uniforms the programs need must be set before flushing.
+class render_queue {
+public:
+  /// State changes of the last flush(); unsorted_binds is
+  /// what drawing the packets in the order they were added
+  /// would have taken
+  struct stats {
+    uint packets = 0, draws = 0;
+    uint program_binds = 0, texture_binds = 0, mesh_binds = 0;
+    uint unsorted_binds = 0;
+    /// Frame arena memory the packets took
+    size_t arena_bytes = 0;
+
+    uint binds() const { return program_binds + texture_binds + mesh_binds; }
+  };
+
+private:
+  struct packet {
+    pass p;
+    gl::program *prog;
+    asset::cubemap *tex;
+    gl::mesh *mesh;
+    mat4 model;
+  };
+
+  struct entry {
+    uint64_t key;
+    uint32_t index;
+  };
+
+  // The lists below are allocated from frame_ and dropped
+  // together with it at the end of flush()
+  arena frame_{256 << 10};
+  arena_vector<packet> packets_{frame_};
+  arena_vector<entry> entries_{frame_}, scratch_{frame_};
+  arena_vector<mat4> staging_{frame_};
+  gl::instance_buffer instances_;
+  stats stats_;
+
+  /// Empties the lists and frees their memory; reserves
+  /// the previous frame's size again
+  void reset_frame() {
+    const size_t n = packets_.size();
+    arena_vector<packet>{frame_}.swap(packets_);
+    arena_vector<entry>{frame_}.swap(entries_);
+    arena_vector<entry>{frame_}.swap(scratch_);
+    arena_vector<mat4>{frame_}.swap(staging_);
+    frame_.reset();
+
+    packets_.reserve(n);
+    entries_.reserve(n);
+    scratch_.reserve(n);
+    staging_.reserve(n);
+  }
+
+  /// State changes needed to draw the packets in the
+  /// order they were added
+  uint unsorted_binds() const {
+    uint r = 0;
+    GLuint prog = 0, tex = 0, vao = 0;
+    for (const packet &p : packets_) {
+      for (auto [cur, nu] : {std::pair{&prog, p.prog->id()},
+                             std::pair{&tex, p.tex->bound_id()},
+                             std::pair{&vao, p.mesh->vertex_array()}}) {
+        if (*cur != nu) r++;
+        *cur = nu;
+      }
+    }
+    return r;
+  }
+
+public:
+  /// Queues an instance of mesh, drawn with prog and tex;
+  /// distance is the distance from the camera
+  void add(pass p, gl::program &prog, asset::cubemap &tex,
+           gl::mesh &mesh, const mat4 &model, fl distance) {
+    entries_.push_back({sort_key(p, prog.id(), tex.bound_id(),
+                                 mesh.vertex_array(), distance),
+                        uint32_t(packets_.size())});
+    packets_.push_back({p, &prog, &tex, &mesh, model});
+  }
+
+  /// Paints and clears all queued packets; leaves depth
+  /// writes enabled
+  void flush() {
+    stats_ = stats{};
+    stats_.packets = packets_.size();
+    if (packets_.empty()) return;
+    stats_.unsorted_binds = unsorted_binds();
+
+    radix_sort(entries_, scratch_);
+    staging_.clear();
+    for (const entry &e : entries_)
+      staging_.push_back(packets_[e.index].model);
+    instances_.upload(staging_.data(), staging_.size());
+
+    // Nothing is known to be bound when we start
+    const packet *cur = nullptr;
+    for (size_t first=0; first < entries_.size();) {
+      const packet &p = packets_[entries_[first].index];
+      size_t last = first + 1;
+      while (last < entries_.size()) {
+        const packet &q = packets_[entries_[last].index];
+        if (q.p != p.p || q.prog != p.prog || q.tex != p.tex
+            || q.mesh != p.mesh)
+          break;
+        last++;
+      }
+
+      if (!cur || cur->p != p.p)
+        glDepthMask(p.p == pass::background ? GL_FALSE : GL_TRUE);
+      if (!cur || cur->prog->id() != p.prog->id()) {
+        p.prog->use();
+        stats_.program_binds++;
+      }
+      if (!cur || cur->tex->bound_id() != p.tex->bound_id()) {
+        p.tex->use();
+        stats_.texture_binds++;
+      }
+      if (!cur || cur->mesh->vertex_array() != p.mesh->vertex_array()) {
+        p.mesh->bind();
+        stats_.mesh_binds++;
+      }
+      p.mesh->draw_bound(instances_, first, last - first);
+      stats_.draws++;
+
+      cur = &p;
+      first = last;
+    }
+    glDepthMask(GL_TRUE);
+
+    stats_.arena_bytes = frame_.used();
+    reset_frame();
+  }
+
+  /// Statistics of the last flush()
+  const stats& last_stats() const { return stats_; }
+};
+
+} // ns gassist
@@ -0,0 +1,362 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cmath>
+
+#include <string>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define GASSIST_SIMD_X86 1
+#  include <immintrin.h>
+#endif
+
+#include "gassist/util.hh"
+
+namespace gassist::simd {
+
+// Batch kernels over contiguous arrays of vec3:
+//
+//   transform_points(m, in, out, n)  out[i] = m * in[i] (w=1)
+//   normalize(v, n)                  v[i] = glm::normalize(v[i])
+//   axpy(y, x, a, n)                 y[i] += x[i] * a
+//
+// Each exists as a scalar, an SSE2 and an AVX2 version; the
+// best one the CPU supports is picked at runtime (the AVX2
+// code is compiled with a target attribute, so no special
+// compiler flags are needed). The vector versions evaluate
+// in the same order as the glm code and don't use FMA, so
+// the results match the scalar path up to the reordering
+// -Ofast allows the compiler; `--bench simd` checks that.
+//
+// The vector versions work on float lanes. vec3 always
+// holds floats, but if fl is configured to be double the
+// scale factor of axpy would be rounded, so then only the
+// scalar versions are used.
+
+static_assert(sizeof(vec3) == 3*sizeof(float),
+              "vec3 must be packed");
+
+/// Whether the vector kernels may be used for fl
+constexpr bool vectorize = std::is_same_v<fl, float>;
+
+enum class isa { scalar, sse2, avx2 };
+
+inline const char* name(isa i) {
+  switch (i) {
+    case isa::scalar: return "scalar";
+    case isa::sse2:   return "sse2";
+    case isa::avx2:   return "avx2";
+  }
+  return "?";
+}
+
+/// The best instruction set the CPU supports
+inline isa detect() {
+#ifdef GASSIST_SIMD_X86
+  if constexpr (vectorize) {
+    if (__builtin_cpu_supports("avx2")) return isa::avx2;
+    return isa::sse2;
+  }
+#endif
+  return isa::scalar;
+}
+
+// SCALAR ///////////////////////////
+
+namespace scalar {
+
+inline void transform_points(const mat4 &m, const vec3 *in,
+                             vec3 *out, size_t n) {
+  for (size_t i=0; i < n; i++) out[i] = m * in[i];
+}
+
+inline void normalize(vec3 *v, size_t n) {
+  for (size_t i=0; i < n; i++) v[i] = glm::normalize(v[i]);
+}
+
+inline void axpy(vec3 *y, const vec3 *x, fl a, size_t n) {
+  for (size_t i=0; i < n; i++) y[i] += x[i] * float(a);
+}
+
+} // ns scalar
+
+#ifdef GASSIST_SIMD_X86
+
+// SSE2 /////////////////////////////
+
+namespace sse2 {
+
+/// 4 packed points (12 floats in a, b, c) into x, y, z
+inline void deinterleave(__m128 a, __m128 b, __m128 c,
+                         __m128 &x, __m128 &y, __m128 &z) {
+  // a = x0 y0 z0 x1, b = y1 z1 x2 y2, c = z2 x3 y3 z3
+  __m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2));
+  x = _mm_shuffle_ps(a, t, _MM_SHUFFLE(2,0,3,0));
+  y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)),
+                     _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)),
+                     _MM_SHUFFLE(2,0,2,0));
+  z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)),
+                     _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)),
+                     _MM_SHUFFLE(2,0,2,0));
+}
+
+/// Inverse of deinterleave()
+inline void interleave(__m128 x, __m128 y, __m128 z,
+                       __m128 &a, __m128 &b, __m128 &c) {
+  a = _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0,0,0,0)),
+                     _mm_shuffle_ps(z, x, _MM_SHUFFLE(1,1,0,0)),
+                     _MM_SHUFFLE(2,0,2,0));
+  b = _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1,1,1,1)),
+                     _mm_shuffle_ps(x, y, _MM_SHUFFLE(2,2,2,2)),
+                     _MM_SHUFFLE(2,0,2,0));
+  c = _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3,3,2,2)),
+                     _mm_shuffle_ps(y, z, _MM_SHUFFLE(3,3,3,3)),
+                     _MM_SHUFFLE(2,0,2,0));
+}
+
+inline void transform_points(const mat4 &m, const vec3 *in,
+                             vec3 *out, size_t n) {
+  __m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]),
+         m02 = _mm_set1_ps(m[0][2]), m10 = _mm_set1_ps(m[1][0]),
+         m11 = _mm_set1_ps(m[1][1]), m12 = _mm_set1_ps(m[1][2]),
+         m20 = _mm_set1_ps(m[2][0]), m21 = _mm_set1_ps(m[2][1]),
+         m22 = _mm_set1_ps(m[2][2]), m30 = _mm_set1_ps(m[3][0]),
+         m31 = _mm_set1_ps(m[3][1]), m32 = _mm_set1_ps(m[3][2]);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const float *src = &in[i].x;
+    __m128 x, y, z;
+    deinterleave(_mm_loadu_ps(src), _mm_loadu_ps(src + 4),
+                 _mm_loadu_ps(src + 8), x, y, z);
+
+    // Same order as glm: (c0*x + c1*y) + (c2*z + c3)
+    __m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m10, y)),
+                           _mm_add_ps(_mm_mul_ps(m20, z), m30)),
+           ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, x), _mm_mul_ps(m11, y)),
+                           _mm_add_ps(_mm_mul_ps(m21, z), m31)),
+           rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m02, x), _mm_mul_ps(m12, y)),
+                           _mm_add_ps(_mm_mul_ps(m22, z), m32));
+
+    __m128 a, b, c;
+    interleave(rx, ry, rz, a, b, c);
+    float *dst = &out[i].x;
+    _mm_storeu_ps(dst, a);
+    _mm_storeu_ps(dst + 4, b);
+    _mm_storeu_ps(dst + 8, c);
+  }
+  scalar::transform_points(m, in + i, out + i, n - i);
+}
+
+inline void normalize(vec3 *v, size_t n) {
+  const __m128 one = _mm_set1_ps(1);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float *p = &v[i].x;
+    __m128 x, y, z;
+    deinterleave(_mm_loadu_ps(p), _mm_loadu_ps(p + 4),
+                 _mm_loadu_ps(p + 8), x, y, z);
+
+    __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                             _mm_mul_ps(z, z)),
+           inv = _mm_div_ps(one, _mm_sqrt_ps(len2));
+
+    __m128 a, b, c;
+    interleave(_mm_mul_ps(x, inv), _mm_mul_ps(y, inv), _mm_mul_ps(z, inv),
+               a, b, c);
+    _mm_storeu_ps(p, a);
+    _mm_storeu_ps(p + 4, b);
+    _mm_storeu_ps(p + 8, c);
+  }
+  scalar::normalize(v + i, n - i);
+}
+
+inline void axpy(vec3 *y, const vec3 *x, fl a, size_t n) {
+  // Componentwise; the layout does not matter
+  float *dst = &y->x;
+  const float *src = &x->x;
+  const size_t len = 3*n;
+  const __m128 va = _mm_set1_ps(a);
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4)
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i),
+                                      _mm_mul_ps(_mm_loadu_ps(src + i), va)));
+  for (; i < len; i++) dst[i] += src[i] * a;
+}
+
+} // ns sse2
+
+// AVX2 /////////////////////////////
+
+namespace avx2 {
+
+#define GASSIST_AVX2 __attribute__((target("avx2")))
+
+/// 8 packed points (24 floats in a, b, c) into x, y, z.
+///
+/// Blending the three registers puts each coordinate of
+/// all 8 points into one register, just in the wrong lanes;
+/// a lane permutation fixes that.
+GASSIST_AVX2
+inline void deinterleave(__m256 a, __m256 b, __m256 c,
+                         __m256 &x, __m256 &y, __m256 &z) {
+  x = _mm256_blend_ps(_mm256_blend_ps(a, b, 0b10010010), c, 0b00100100);
+  y = _mm256_blend_ps(_mm256_blend_ps(a, b, 0b00100100), c, 0b01001001);
+  z = _mm256_blend_ps(_mm256_blend_ps(a, b, 0b01001001), c, 0b10010010);
+  x = _mm256_permutevar8x32_ps(x, _mm256_setr_epi32(0,3,6,1,4,7,2,5));
+  y = _mm256_permutevar8x32_ps(y, _mm256_setr_epi32(1,4,7,2,5,0,3,6));
+  z = _mm256_permutevar8x32_ps(z, _mm256_setr_epi32(2,5,0,3,6,1,4,7));
+}
+
+/// Inverse of deinterleave()
+GASSIST_AVX2
+inline void interleave(__m256 x, __m256 y, __m256 z,
+                       __m256 &a, __m256 &b, __m256 &c) {
+  x = _mm256_permutevar8x32_ps(x, _mm256_setr_epi32(0,3,6,1,4,7,2,5));
+  y = _mm256_permutevar8x32_ps(y, _mm256_setr_epi32(5,0,3,6,1,4,7,2));
+  z = _mm256_permutevar8x32_ps(z, _mm256_setr_epi32(2,5,0,3,6,1,4,7));
+  a = _mm256_blend_ps(_mm256_blend_ps(x, y, 0b10010010), z, 0b00100100);
+  b = _mm256_blend_ps(_mm256_blend_ps(x, y, 0b00100100), z, 0b01001001);
+  c = _mm256_blend_ps(_mm256_blend_ps(x, y, 0b01001001), z, 0b10010010);
+}
+
+GASSIST_AVX2
+inline void transform_points(const mat4 &m, const vec3 *in,
+                             vec3 *out, size_t n) {
+  __m256 m00 = _mm256_set1_ps(m[0][0]), m01 = _mm256_set1_ps(m[0][1]),
+         m02 = _mm256_set1_ps(m[0][2]), m10 = _mm256_set1_ps(m[1][0]),
+         m11 = _mm256_set1_ps(m[1][1]), m12 = _mm256_set1_ps(m[1][2]),
+         m20 = _mm256_set1_ps(m[2][0]), m21 = _mm256_set1_ps(m[2][1]),
+         m22 = _mm256_set1_ps(m[2][2]), m30 = _mm256_set1_ps(m[3][0]),
+         m31 = _mm256_set1_ps(m[3][1]), m32 = _mm256_set1_ps(m[3][2]);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const float *src = &in[i].x;
+    __m256 x, y, z;
+    deinterleave(_mm256_loadu_ps(src), _mm256_loadu_ps(src + 8),
+                 _mm256_loadu_ps(src + 16), x, y, z);
+
+    __m256 rx = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(m00, x), _mm256_mul_ps(m10, y)),
+          _mm256_add_ps(_mm256_mul_ps(m20, z), m30)),
+        ry = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(m01, x), _mm256_mul_ps(m11, y)),
+          _mm256_add_ps(_mm256_mul_ps(m21, z), m31)),
+        rz = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(m02, x), _mm256_mul_ps(m12, y)),
+          _mm256_add_ps(_mm256_mul_ps(m22, z), m32));
+
+    __m256 a, b, c;
+    interleave(rx, ry, rz, a, b, c);
+    float *dst = &out[i].x;
+    _mm256_storeu_ps(dst, a);
+    _mm256_storeu_ps(dst + 8, b);
+    _mm256_storeu_ps(dst + 16, c);
+  }
+  sse2::transform_points(m, in + i, out + i, n - i);
+}
+
+GASSIST_AVX2
+inline void normalize(vec3 *v, size_t n) {
+  const __m256 one = _mm256_set1_ps(1);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    float *p = &v[i].x;
+    __m256 x, y, z;
+    deinterleave(_mm256_loadu_ps(p), _mm256_loadu_ps(p + 8),
+                 _mm256_loadu_ps(p + 16), x, y, z);
+
+    __m256 len2 = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+          _mm256_mul_ps(z, z)),
+        inv = _mm256_div_ps(one, _mm256_sqrt_ps(len2));
+
+    __m256 a, b, c;
+    interleave(_mm256_mul_ps(x, inv), _mm256_mul_ps(y, inv),
+               _mm256_mul_ps(z, inv), a, b, c);
+    _mm256_storeu_ps(p, a);
+    _mm256_storeu_ps(p + 8, b);
+    _mm256_storeu_ps(p + 16, c);
+  }
+  sse2::normalize(v + i, n - i);
+}
+
+GASSIST_AVX2
+inline void axpy(vec3 *y, const vec3 *x, fl a, size_t n) {
+  float *dst = &y->x;
+  const float *src = &x->x;
+  const size_t len = 3*n;
+  const __m256 va = _mm256_set1_ps(a);
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i),
+        _mm256_mul_ps(_mm256_loadu_ps(src + i), va)));
+  for (; i < len; i++) dst[i] += src[i] * a;
+}
+
+#undef GASSIST_AVX2
+
+} // ns avx2
+
+#endif // GASSIST_SIMD_X86
+
+// DISPATCH /////////////////////////
+
+/// The kernels for one instruction set
+struct kernel_table {
+  isa level;
+  void (*transform_points)(const mat4&, const vec3*, vec3*, size_t);
+  void (*normalize)(vec3*, size_t);
+  void (*axpy)(vec3*, const vec3*, fl, size_t);
+};
+
+/// The kernels for the given instruction set; falls back to
+/// scalar code where it is not compiled in or not usable
+/// with fl
+inline kernel_table table_for(isa i) {
+#ifdef GASSIST_SIMD_X86
+  if constexpr (vectorize) {
+    if (i == isa::avx2)
+      return {i, avx2::transform_points, avx2::normalize, avx2::axpy};
+    if (i == isa::sse2)
+      return {i, sse2::transform_points, sse2::normalize, sse2::axpy};
+  }
+#endif
+  (void)i;
+  return {isa::scalar, scalar::transform_points,
+          scalar::normalize, scalar::axpy};
+}
+
+/// The kernels in use: the best supported ones, unless
+/// overridden with GASSIST_SIMD=scalar|sse2|avx2 (a level
+/// the CPU does not support is ignored)
+inline const kernel_table& kernels() {
+  static const kernel_table t = []() {
+    isa best = detect();
+    if (const char *env = std::getenv("GASSIST_SIMD")) {
+      for (isa i : {isa::scalar, isa::sse2, isa::avx2})
+        if (std::string{env} == name(i) && i <= best)
+          return table_for(i);
+    }
+    return table_for(best);
+  }();
+  return t;
+}
+
+inline void transform_points(const mat4 &m, const vec3 *in,
+                             vec3 *out, size_t n) {
+  kernels().transform_points(m, in, out, n);
+}
+
+inline void normalize(vec3 *v, size_t n) {
+  kernels().normalize(v, n);
+}
+
+inline void axpy(vec3 *y, const vec3 *x, fl a, size_t n) {
+  kernels().axpy(y, x, a, n);
+}
+
+} // ns gassist::simd
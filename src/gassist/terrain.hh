@@ -0,0 +1,472 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <algorithm>
+#include <future>
+#include <list>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "gassist/util.hh"
+#include "gassist/jobs.hh"
+#include "gassist/simd.hh"
+#include "gassist/geometry.hh"
+#include "gassist/cull.hh"
+#include "gassist/wrap_gl.hh"
+#include "gassist/asset.hh"
+
+/// Planet surfaces with a level of detail that follows the
+/// camera down to the ground.
+///
+/// Every side of the cube a planet is projected from (see
+/// geom::quad_sphere) is the root of a quadtree of chunks;
+/// a chunk is a grid of quads displaced by a noise height
+/// field. Chunks close to the camera are split into their
+/// four children, chunks further away are drawn instead of
+/// their children (the chunked LOD / CDLOD scheme).
+///
+/// Chunk geometry is generated on a job_pool and uploaded
+/// within a per frame budget; until the children of a chunk
+/// are available the chunk itself is drawn, so the camera
+/// never waits for geometry. The number of chunks kept
+/// around is bounded; the least recently used ones are
+/// dropped first.
+namespace gassist::terrain {
+
+// HEIGHT FIELD /////////////////////
+
+/// How a planet's surface looks and how it is split into
+/// chunks
+struct params {
+  /// Selects the terrain; planets with the same seed look
+  /// the same
+  uint32_t seed = 1;
+
+  /// Maximum height (and depth) of the terrain relative to
+  /// the radius
+  fl amplitude = 0.01f;
+  /// Frequency of the largest features (per radius) and
+  /// number of noise octaves on top of that, each one
+  /// twice the frequency and half the amplitude of the
+  /// previous one
+  fl frequency = 3;
+  uint octaves = 12;
+
+  /// Quads per chunk side
+  uint resolution = 32;
+  /// Deepest level of the quadtrees; must be less than 28
+  uint max_level = 12;
+
+  /// A chunk is split once its quads would be longer than
+  /// this on screen
+  fl edge_px = 8;
+
+  /// Chunks kept (in addition to the roots) and chunks
+  /// generated at the same time
+  size_t max_chunks = 512;
+  uint max_jobs = 8;
+};
+
+namespace intern {
+
+inline uint32_t hash(int32_t x, int32_t y, int32_t z, uint32_t seed) {
+  uint32_t h = seed * 0x9e3779b9u;
+  for (uint32_t v : {uint32_t(x), uint32_t(y), uint32_t(z)}) {
+    h ^= v + 0x7f4a7c15u + (h << 6) + (h >> 2);
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+  }
+  h *= 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
+/// Value noise in [-1, 1]; smooth (quintic interpolation
+/// between the lattice points)
+inline fl value_noise(const vec3 &p, uint32_t seed) {
+  const fl fx = std::floor(p.x), fy = std::floor(p.y), fz = std::floor(p.z);
+  const int32_t x = fx, y = fy, z = fz;
+  auto fade = [](fl t) { return t*t*t*(t*(t*6 - 15) + 10); };
+  const fl u = fade(p.x - fx), v = fade(p.y - fy), w = fade(p.z - fz);
+
+  auto at = [&](int32_t dx, int32_t dy, int32_t dz) {
+    return fl(hash(x + dx, y + dy, z + dz, seed)) * (fl(2) / 4294967295.0f) - 1;
+  };
+  auto mix = [](fl a, fl b, fl t) { return a + (b - a)*t; };
+  return mix(mix(mix(at(0,0,0), at(1,0,0), u), mix(at(0,1,0), at(1,1,0), u), v),
+             mix(mix(at(0,0,1), at(1,0,1), u), mix(at(0,1,1), at(1,1,1), u), v),
+             w);
+}
+
+} // ns intern
+
+/// Height of the terrain above the unit sphere in the given
+/// direction (a unit vector); in [-amplitude, amplitude]
+inline fl height(const params &p, const vec3 &dir) {
+  fl h = 0, amp = 1, norm = 0, freq = p.frequency;
+  for (uint o=0; o < p.octaves; o++) {
+    h += amp * intern::value_noise(dir * freq, p.seed + o);
+    norm += amp;
+    amp *= 0.5f;
+    freq *= 2;
+  }
+  return p.amplitude * h / norm;
+}
+
+// CHUNKS ///////////////////////////
+
+/// Identifies a chunk: the cube side, the depth in the
+/// quadtree of that side and the position in the 2^level ×
+/// 2^level grid of chunks on that level
+struct chunk_key {
+  uint32_t face, level, x, y;
+
+  static chunk_key root(uint32_t face) { return {face, 0, 0, 0}; }
+
+  /// Children are numbered 0-3 (x + 2y)
+  chunk_key child(uint32_t i) const {
+    return {face, level + 1, 2*x + (i & 1), 2*y + (i >> 1)};
+  }
+
+  uint64_t pack() const {
+    return uint64_t{face} << 61 | uint64_t{level} << 56
+         | uint64_t{x} << 28 | uint64_t{y};
+  }
+
+  /// Length of a quad of the chunk on the unit sphere,
+  /// roughly: A cube side spans a quarter of a great circle
+  fl quad_length(uint resolution) const {
+    return (tau / 4) / fl(uint64_t{1} << level) / resolution;
+  }
+};
+
+/// The geometry of a chunk on the unit sphere (the planet
+/// radius is applied by the model matrix), with a bounding
+/// sphere
+struct chunk_data {
+  geom::indexed_mesh mesh;
+  vec3 center;
+  fl radius;
+};
+
+/// Generates the geometry of a chunk.
+///
+/// A grid of (resolution+1)² vertices, plus a skirt along
+/// every edge: a copy of the edge vertices lowered below
+/// the surface, connected to the edge. Neighbouring chunks
+/// of different levels do not share all of their edge
+/// vertices; the skirts cover the cracks that leaves.
+inline chunk_data generate(const params &p, const chunk_key &k) {
+  const uint32_t n = p.resolution, side = n + 1;
+  const auto &f = geom::intern::quad_sphere_faces[k.face];
+  const vec3 nor{f[0][0], f[0][1], f[0][2]},
+             u{f[1][0], f[1][1], f[1][2]},
+             v{f[2][0], f[2][1], f[2][2]};
+
+  // The chunk spans [u0, u0+size] × [v0, v0+size] of the
+  // cube side [-1, 1]²
+  const fl size = fl(2) / fl(uint64_t{1} << k.level),
+           u0 = -1 + k.x*size, v0 = -1 + k.y*size,
+           step = size / n;
+
+  chunk_data r;
+  geom::indexed_mesh &m = r.mesh;
+  m.vertices.resize(size_t{side}*side + 4*side);
+  for (uint32_t j=0; j < side; j++)
+    for (uint32_t i=0; i < side; i++)
+      m.vertices[j*side + i] = nor + u*(u0 + i*step) + v*(v0 + j*step);
+  simd::normalize(m.vertices.data(), size_t{side}*side);
+
+  // Deep enough to hide the height difference between
+  // neighbours a level apart, but no deeper than the
+  // terrain can be
+  const fl skirt = std::min(2*p.amplitude, 8*k.quad_length(n));
+  auto edge = [&](uint32_t e, uint32_t i) -> uint32_t {
+    switch (e) {
+      case 0: return i;                   // bottom
+      case 1: return n*side + i;          // top
+      case 2: return i*side;              // left
+      default: return i*side + n;         // right
+    }
+  };
+
+  const uint32_t skirt0 = side*side;
+  for (uint32_t i=0; i < skirt0; i++) {
+    vec3 &d = m.vertices[i];
+    d *= 1 + height(p, d);
+  }
+  for (uint32_t e=0; e < 4; e++)
+    for (uint32_t i=0; i < side; i++)
+      m.vertices[skirt0 + e*side + i] = m.vertices[edge(e, i)] * (1 - skirt);
+
+  m.indices.reserve((size_t{n}*n + 4*n) * 6);
+  for (uint32_t j=0; j < n; j++) {
+    for (uint32_t i=0; i < n; i++) {
+      uint32_t a = j*side + i, b = a + 1, d = a + side, c = d + 1;
+      for (uint32_t idx : {a, b, c,  a, c, d})
+        m.indices.push_back(idx);
+    }
+  }
+  for (uint32_t e=0; e < 4; e++) {
+    for (uint32_t i=0; i < n; i++) {
+      uint32_t a = edge(e, i), b = edge(e, i + 1),
+               c = skirt0 + e*side + i + 1, d = skirt0 + e*side + i;
+      for (uint32_t idx : {a, b, c,  a, c, d})
+        m.indices.push_back(idx);
+    }
+  }
+
+  // Centered on the middle of the grid
+  r.center = m.vertices[(n/2)*side + n/2];
+  r.radius = 0;
+  for (const vec3 &q : m.vertices)
+    r.radius = std::max(r.radius, glm::length(q - r.center));
+  return r;
+}
+
+// PLANETS //////////////////////////
+
+/// What happened to the chunks of one planet in the last
+/// frame
+struct stats {
+  uint drawn = 0, culled = 0;
+  uint64_t triangles = 0;
+  /// Chunks that should have been split but whose children
+  /// were not available yet
+  uint waiting = 0;
+  /// Deepest level drawn
+  uint deepest = 0;
+  /// Chunks in memory and being generated
+  size_t resident = 0, generating = 0;
+};
+
+/// The terrain of one planet: the chunk quadtrees of all
+/// six sides with the cache of generated chunks.
+///
+/// Call poll() and then select() once per frame on the GL
+/// thread. The roots are generated in the background like
+/// all other chunks; nothing can be drawn until ready().
+class planet {
+  struct chunk {
+    /// Set while the chunk is being generated; then the
+    /// geometry waits in data until it is uploaded to mesh
+    std::future<chunk_data> job;
+    std::optional<chunk_data> data;
+    std::optional<gl::mesh> mesh;
+    vec3 center;
+    fl radius = 0;
+    /// Last frame it was needed; position in lru_ (roots
+    /// are never dropped and have none)
+    uint64_t used = 0;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  params p_;
+  job_pool &workers_;
+
+  std::unordered_map<uint64_t, chunk> chunks_;
+  /// Most recently used first
+  std::list<uint64_t> lru_;
+  /// Being generated; generated and waiting for upload
+  std::vector<uint64_t> generating_, generated_;
+  uint64_t frame_ = 0;
+  bool ready_ = false;
+
+  /// Children missing in this frame: (level, distance, key)
+  struct request {
+    uint level;
+    fl distance;
+    chunk_key key;
+  };
+  std::vector<request> requests_;
+  stats stats_;
+
+  void generate(const chunk_key &k, bool root) {
+    chunk &c = chunks_[k.pack()];
+    c.job = workers_.submit([p = p_, k]() { return terrain::generate(p, k); });
+    c.used = frame_;
+    if (!root) {
+      lru_.push_front(k.pack());
+      c.lru = lru_.begin();
+    }
+    generating_.push_back(k.pack());
+  }
+
+  void touch(chunk &c, uint32_t level) {
+    c.used = frame_;
+    if (level > 0) lru_.splice(lru_.begin(), lru_, c.lru);
+  }
+
+  chunk* find_uploaded(const chunk_key &k) {
+    auto it = chunks_.find(k.pack());
+    return it == chunks_.end() || !it->second.mesh ? nullptr : &it->second;
+  }
+
+  template<typename F>
+  void visit(const chunk_key &k, chunk &c, const cull::frustum &frustum,
+             const vec3 &origin, fl scale, const vec3 &cam,
+             fl proj_scale, F &f) {
+    touch(c, k.level);
+    const vec3 center = origin + c.center*scale;
+    const fl radius = c.radius*scale;
+    if (!frustum.visible(center, radius)) {
+      stats_.culled++;
+      return;
+    }
+
+    // Distance to the closest point of the chunk
+    const fl dist = std::max(glm::length(center - cam) - radius, fl(1e-6f));
+    const fl quad_px = k.quad_length(p_.resolution) * scale * proj_scale / dist;
+    if (k.level < p_.max_level && quad_px > p_.edge_px) {
+      chunk *children[4];
+      bool complete = true;
+      for (uint32_t i=0; i < 4; i++) {
+        children[i] = find_uploaded(k.child(i));
+        if (!children[i]) {
+          complete = false;
+          if (!chunks_.count(k.child(i).pack()))
+            requests_.push_back({k.level + 1, dist, k.child(i)});
+        }
+      }
+
+      // All four or none, so there is no overlap
+      if (complete) {
+        for (uint32_t i=0; i < 4; i++)
+          visit(k.child(i), *children[i], frustum, origin, scale,
+                cam, proj_scale, f);
+        return;
+      }
+      stats_.waiting++;
+      for (uint32_t i=0; i < 4; i++)
+        if (auto it = chunks_.find(k.child(i).pack()); it != chunks_.end())
+          touch(it->second, k.level + 1);
+    }
+
+    stats_.drawn++;
+    stats_.triangles += c.mesh->no_triangles();
+    stats_.deepest = std::max(stats_.deepest, k.level);
+    f(*c.mesh);
+  }
+
+  /// Drops the least recently used chunks not needed in
+  /// this frame until at most max_chunks are left
+  void evict() {
+    while (lru_.size() > p_.max_chunks) {
+      auto it = chunks_.find(lru_.back());
+      if (it->second.used == frame_ || !it->second.mesh) break;
+      chunks_.erase(it);
+      lru_.pop_back();
+    }
+  }
+
+public:
+  planet(job_pool &workers, const params &p)
+      : p_{p}, workers_{workers} {
+    for (uint32_t f=0; f < 6; f++)
+      generate(chunk_key::root(f), true);
+  }
+
+  planet(const planet&) = delete;
+  planet& operator =(const planet&) = delete;
+
+  const params& parameters() const { return p_; }
+
+  /// Whether the roots are uploaded, so there is something
+  /// to draw
+  bool ready() const { return ready_; }
+
+  /// Statistics of the last select()
+  const stats& last_stats() const { return stats_; }
+
+  /// Uploads generated chunks within the budget
+  void poll(asset::upload_budget &budget) {
+    for (size_t i=0; i < generating_.size();) {
+      chunk &c = chunks_.at(generating_[i]);
+      if (is_ready(c.job)) {
+        c.data = c.job.get();
+        generated_.push_back(generating_[i]);
+        generating_[i] = generating_.back();
+        generating_.pop_back();
+      } else {
+        i++;
+      }
+    }
+
+    // Coarse chunks first; they are needed before their
+    // children can be used
+    std::sort(generated_.begin(), generated_.end(),
+              [](uint64_t a, uint64_t b) {
+                return (a >> 56 & 31) > (b >> 56 & 31);
+              });
+    while (!generated_.empty()) {
+      chunk &c = chunks_.at(generated_.back());
+      const geom::indexed_mesh &m = c.data->mesh;
+      if (!budget.take(m.vertices.size()*sizeof(vec3)
+                       + m.indices.size()*sizeof(uint32_t)))
+        break;
+      c.mesh.emplace(m.vertices, m.indices);
+      c.center = c.data->center;
+      c.radius = c.data->radius;
+      c.data.reset();
+      generated_.pop_back();
+    }
+
+    if (!ready_) {
+      ready_ = true;
+      for (uint32_t f=0; f < 6; f++)
+        ready_ = ready_ && find_uploaded(chunk_key::root(f));
+    }
+  }
+
+  /// Generates and uploads the roots, blocking
+  void wait() {
+    while (!ready_) {
+      asset::upload_budget all = asset::upload_budget::unlimited();
+      poll(all);
+      if (!ready_) std::this_thread::yield();
+    }
+  }
+
+  /// Chooses the chunks to draw for a planet at origin with
+  /// radius scale seen from cam, and calls f(gl::mesh&) for
+  /// each of them; starts generating the chunks that are
+  /// missing. proj_scale is cull::projection_scale().
+  ///
+  /// The meshes are on the unit sphere; draw them with the
+  /// model matrix of the planet.
+  template<typename F>
+  void select(const cull::frustum &frustum, const vec3 &origin, fl scale,
+              const vec3 &cam, fl proj_scale, F &&f) {
+    frame_++;
+    stats_ = stats{};
+    requests_.clear();
+
+    if (ready_) {
+      for (uint32_t face=0; face < 6; face++) {
+        chunk_key k = chunk_key::root(face);
+        visit(k, chunks_.at(k.pack()), frustum, origin, scale,
+              cam, proj_scale, f);
+      }
+    }
+
+    // Coarse and close chunks first
+    std::sort(requests_.begin(), requests_.end(),
+              [](const request &a, const request &b) {
+                return a.level != b.level ? a.level < b.level
+                                          : a.distance < b.distance;
+              });
+    for (const request &r : requests_) {
+      if (generating_.size() >= p_.max_jobs) break;
+      generate(r.key, false);
+    }
+
+    evict();
+    stats_.resident = chunks_.size();
+    stats_.generating = generating_.size();
+  }
+};
+
+} // ns gassist::terrain
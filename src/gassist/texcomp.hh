@@ -0,0 +1,397 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <vector>
+#include <array>
+#include <string>
+#include <algorithm>
+#include <limits>
+
+#include "gassist/exception.hh"
+
+/// Block compressed texture container (.gatex files).
+///
+/// Produced offline by the gatex tool from the asset
+/// pipeline, loaded by mapping the file and handing the
+/// pointers to the individual mip levels directly to
+/// glCompressedTexImage2D.
+///
+/// Layout (all integers little endian):
+///
+///   header            32 bytes
+///   level[no_levels]  24 bytes each, largest level first
+///   data              each level aligned to 16 bytes
+///
+/// This header has no GL dependencies so it can be used by
+/// the offline tools.
+namespace gassist::texcomp {
+
+// FORMAT ///////////////////////////
+
+enum class format : uint32_t {
+  /// BC1/DXT1 without alpha; 8 bytes per 4x4 block
+  bc1_rgb = 1
+};
+
+struct header {
+  char magic[4];
+  uint32_t version;
+  format fmt;
+  uint32_t width, height;
+  uint32_t no_levels;
+  uint32_t reserved[2];
+};
+
+struct level {
+  /// Offset from the start of the file and length in bytes
+  uint64_t offset, size;
+  uint32_t width, height;
+};
+
+static_assert(sizeof(header) == 32, "Unexpected header padding");
+static_assert(sizeof(level) == 24, "Unexpected level padding");
+
+constexpr char magic[4] = {'G', 'A', 'T', 'X'};
+constexpr uint32_t version = 1;
+constexpr size_t alignment = 16;
+
+/// Number of 4x4 blocks needed to cover n pixels
+inline uint32_t no_blocks(uint32_t n) { return (n + 3) / 4; }
+
+/// Size in bytes of a bc1 encoded image
+inline size_t bc1_size(uint32_t w, uint32_t h) {
+  return size_t{no_blocks(w)} * no_blocks(h) * 8;
+}
+
+/// Number of mip levels down to (and including) 1x1
+inline uint32_t no_mip_levels(uint32_t w, uint32_t h) {
+  uint32_t n = 1;
+  while (w > 1 || h > 1) {
+    w = std::max<uint32_t>(w/2, 1);
+    h = std::max<uint32_t>(h/2, 1);
+    n++;
+  }
+  return n;
+}
+
+/// A parsed container; points into the memory it was
+/// parsed from
+struct view {
+  const header *head;
+  const level *levels;
+  const char *base;
+
+  const char* data(uint32_t lv) const {
+    return base + levels[lv].offset;
+  }
+};
+
+/// Parses and validates a container in memory;
+/// throws msg_exception if it is malformed
+inline view parse(const char *data, size_t len) {
+  if (len < sizeof(header))
+    throw msg_exception{"Texture container truncated"};
+
+  view v;
+  v.base = data;
+  v.head = (const header*)data;
+  v.levels = (const level*)(data + sizeof(header));
+
+  if (std::memcmp(v.head->magic, magic, 4) != 0)
+    throw msg_exception{"Not a texture container"};
+  if (v.head->version != version)
+    throw msg_exception{"Unsupported texture container version"};
+  if (v.head->fmt != format::bc1_rgb)
+    throw msg_exception{"Unsupported texture format"};
+  if (v.head->no_levels == 0
+      || v.head->no_levels > no_mip_levels(v.head->width, v.head->height)
+      || sizeof(header) + v.head->no_levels*sizeof(level) > len)
+    throw msg_exception{"Texture container has a bad level table"};
+
+  for (uint32_t i=0; i < v.head->no_levels; i++) {
+    const level &l = v.levels[i];
+    if (l.width != std::max<uint32_t>(v.head->width >> i, 1)
+        || l.height != std::max<uint32_t>(v.head->height >> i, 1)
+        || l.size != bc1_size(l.width, l.height)
+        || l.offset % alignment != 0
+        || l.offset > len || l.size > len - l.offset)
+      throw msg_exception{"Texture container has a bad level"};
+  }
+
+  return v;
+}
+
+// IMAGES ///////////////////////////
+
+/// Uncompressed 8 bit RGB image; rows are tightly packed
+struct rgb_image {
+  uint32_t width = 0, height = 0;
+  std::vector<uint8_t> px;
+
+  rgb_image() = default;
+  rgb_image(uint32_t w, uint32_t h)
+    : width{w}, height{h}, px(size_t{w}*h*3) {}
+
+  uint8_t* at(uint32_t x, uint32_t y) {
+    return px.data() + (size_t{y}*width + x)*3;
+  }
+  const uint8_t* at(uint32_t x, uint32_t y) const {
+    return px.data() + (size_t{y}*width + x)*3;
+  }
+};
+
+/// Halves a tightly packed w×h RGB image in both
+/// dimensions using a box filter (dimensions of 1 stay 1)
+inline rgb_image downsample(const uint8_t *src, uint32_t w, uint32_t h) {
+  rgb_image dst{std::max<uint32_t>(w/2, 1), std::max<uint32_t>(h/2, 1)};
+  auto at = [&](uint32_t x, uint32_t y) {
+    return src + (size_t{y}*w + x)*3;
+  };
+
+  for (uint32_t y=0; y < dst.height; y++) {
+    for (uint32_t x=0; x < dst.width; x++) {
+      uint32_t x0 = std::min(2*x, w-1), x1 = std::min(2*x+1, w-1),
+               y0 = std::min(2*y, h-1), y1 = std::min(2*y+1, h-1);
+      for (int c=0; c < 3; c++)
+        dst.at(x, y)[c] = (at(x0, y0)[c] + at(x1, y0)[c]
+                         + at(x0, y1)[c] + at(x1, y1)[c] + 2) / 4;
+    }
+  }
+
+  return dst;
+}
+
+inline rgb_image downsample(const rgb_image &src) {
+  return downsample(src.px.data(), src.width, src.height);
+}
+
+/// Peak signal to noise ratio between two images of the
+/// same size in dB
+inline double psnr(const rgb_image &a, const rgb_image &b) {
+  double se = 0;
+  for (size_t i=0; i < a.px.size(); i++) {
+    double d = double(a.px[i]) - b.px[i];
+    se += d*d;
+  }
+  if (se == 0) return std::numeric_limits<double>::max();
+  return 10 * std::log10(255.0*255.0 * a.px.size() / se);
+}
+
+// BC1 //////////////////////////////
+
+namespace intern {
+
+inline uint16_t pack565(const float *c) {
+  auto q = [](float v, int max) {
+    return (uint16_t)std::lround(std::min(std::max(v, 0.0f), 255.0f) * max / 255);
+  };
+  return q(c[0], 31) << 11 | q(c[1], 63) << 5 | q(c[2], 31);
+}
+
+inline void unpack565(uint16_t v, int *c) {
+  int r = v >> 11 & 31, g = v >> 5 & 63, b = v & 31;
+  c[0] = r << 3 | r >> 2;
+  c[1] = g << 2 | g >> 4;
+  c[2] = b << 3 | b >> 2;
+}
+
+/// The four colors a block with the given endpoints can
+/// represent (in 4 color mode, i.e. c0 > c1)
+inline void palette(uint16_t c0, uint16_t c1, int (*pal)[3]) {
+  unpack565(c0, pal[0]);
+  unpack565(c1, pal[1]);
+  for (int c=0; c < 3; c++) {
+    pal[2][c] = (2*pal[0][c] + pal[1][c]) / 3;
+    pal[3][c] = (pal[0][c] + 2*pal[1][c]) / 3;
+  }
+}
+
+/// Encodes 16 pixels (row major RGB) into one block
+inline void encode_block(const uint8_t (*px)[3], uint8_t *out) {
+  // Fit a line through the colors: Mean plus principal
+  // axis of the covariance (power iteration)
+  float mean[3] = {0, 0, 0};
+  for (int i=0; i < 16; i++)
+    for (int c=0; c < 3; c++)
+      mean[c] += px[i][c] / 16.0f;
+
+  float cov[6] = {0, 0, 0, 0, 0, 0};
+  for (int i=0; i < 16; i++) {
+    float d[3] = {px[i][0]-mean[0], px[i][1]-mean[1], px[i][2]-mean[2]};
+    cov[0] += d[0]*d[0]; cov[1] += d[0]*d[1]; cov[2] += d[0]*d[2];
+    cov[3] += d[1]*d[1]; cov[4] += d[1]*d[2]; cov[5] += d[2]*d[2];
+  }
+
+  float axis[3] = {1, 1, 1};
+  for (int it=0; it < 8; it++) {
+    float n[3] = {
+      cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2],
+      cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2],
+      cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2]};
+    float len = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if (len < 1e-6f) break; // Flat block; any axis will do
+    for (int c=0; c < 3; c++) axis[c] = n[c] / len;
+  }
+
+  // No infinities; the Makefile builds with -Ofast
+  float lo = std::numeric_limits<float>::max(), hi = -lo;
+  for (int i=0; i < 16; i++) {
+    float t = (px[i][0]-mean[0])*axis[0] + (px[i][1]-mean[1])*axis[1]
+            + (px[i][2]-mean[2])*axis[2];
+    lo = std::min(lo, t);
+    hi = std::max(hi, t);
+  }
+
+  // Inset the endpoints a bit; the extremes are usually
+  // outliers and this reduces the average error
+  float inset = (hi - lo) / 16;
+  lo += inset;
+  hi -= inset;
+
+  float e0[3], e1[3];
+  for (int c=0; c < 3; c++) {
+    e0[c] = mean[c] + axis[c]*hi;
+    e1[c] = mean[c] + axis[c]*lo;
+  }
+
+  uint16_t c0 = pack565(e0), c1 = pack565(e1);
+  if (c0 < c1) std::swap(c0, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    int pal[4][3];
+    palette(c0, c1, pal);
+    for (int i=0; i < 16; i++) {
+      int best = 0, best_err = 1 << 30;
+      for (int p=0; p < 4; p++) {
+        int err = 0;
+        for (int c=0; c < 3; c++) {
+          int d = px[i][c] - pal[p][c];
+          err += d*d;
+        }
+        if (err < best_err) {
+          best = p;
+          best_err = err;
+        }
+      }
+      indices |= uint32_t(best) << (2*i);
+    }
+  }
+
+  out[0] = c0 & 0xff; out[1] = c0 >> 8;
+  out[2] = c1 & 0xff; out[3] = c1 >> 8;
+  for (int i=0; i < 4; i++)
+    out[4+i] = indices >> (8*i) & 0xff;
+}
+
+inline void decode_block(const uint8_t *in, uint8_t (*px)[3]) {
+  uint16_t c0 = in[0] | in[1] << 8, c1 = in[2] | in[3] << 8;
+  uint32_t indices = in[4] | in[5] << 8 | in[6] << 16 | uint32_t(in[7]) << 24;
+
+  int pal[4][3];
+  palette(c0, c1, pal);
+  if (c0 <= c1) { // 3 color mode; we never produce those
+    for (int c=0; c < 3; c++) {
+      pal[2][c] = (pal[0][c] + pal[1][c]) / 2;
+      pal[3][c] = 0;
+    }
+  }
+
+  for (int i=0; i < 16; i++)
+    for (int c=0; c < 3; c++)
+      px[i][c] = pal[indices >> (2*i) & 3][c];
+}
+
+} // ns intern
+
+/// Encodes an image as BC1; returns bc1_size(w, h) bytes.
+///
+/// Blocks at the border of images whose size is not a
+/// multiple of four are padded by repeating the edge.
+inline std::vector<uint8_t> encode_bc1(const rgb_image &img) {
+  std::vector<uint8_t> out(bc1_size(img.width, img.height));
+  uint8_t *dst = out.data();
+
+  uint8_t block[16][3];
+  for (uint32_t by=0; by < no_blocks(img.height); by++) {
+    for (uint32_t bx=0; bx < no_blocks(img.width); bx++) {
+      for (uint32_t i=0; i < 16; i++) {
+        uint32_t x = std::min(bx*4 + i%4, img.width-1),
+                 y = std::min(by*4 + i/4, img.height-1);
+        std::memcpy(block[i], img.at(x, y), 3);
+      }
+      intern::encode_block(block, dst);
+      dst += 8;
+    }
+  }
+
+  return out;
+}
+
+/// Decodes a BC1 image of the given size
+inline rgb_image decode_bc1(const uint8_t *data, uint32_t w, uint32_t h) {
+  rgb_image img{w, h};
+
+  uint8_t block[16][3];
+  for (uint32_t by=0; by < no_blocks(h); by++) {
+    for (uint32_t bx=0; bx < no_blocks(w); bx++) {
+      intern::decode_block(data, block);
+      data += 8;
+      for (uint32_t i=0; i < 16; i++) {
+        uint32_t x = bx*4 + i%4, y = by*4 + i/4;
+        if (x < w && y < h)
+          std::memcpy(img.at(x, y), block[i], 3);
+      }
+    }
+  }
+
+  return img;
+}
+
+// CONTAINER ////////////////////////
+
+/// Builds the full mip chain of img, encodes every level as
+/// BC1 and serializes the result as a container
+inline std::vector<char> encode_container(const rgb_image &img) {
+  const uint32_t no_levels = no_mip_levels(img.width, img.height);
+  auto align = [](size_t v) {
+    return (v + alignment - 1) / alignment * alignment;
+  };
+
+  std::vector<char> out(align(sizeof(header) + no_levels*sizeof(level)));
+
+  header h;
+  std::memcpy(h.magic, magic, 4);
+  h.version = version;
+  h.fmt = format::bc1_rgb;
+  h.width = img.width;
+  h.height = img.height;
+  h.no_levels = no_levels;
+  h.reserved[0] = h.reserved[1] = 0;
+  std::memcpy(out.data(), &h, sizeof(h));
+
+  rgb_image mip;
+  for (uint32_t i=0; i < no_levels; i++) {
+    const rgb_image &src = i == 0 ? img : mip;
+    std::vector<uint8_t> enc = encode_bc1(src);
+
+    level l;
+    l.offset = out.size();
+    l.size = enc.size();
+    l.width = src.width;
+    l.height = src.height;
+    std::memcpy(out.data() + sizeof(header) + i*sizeof(level), &l, sizeof(l));
+
+    out.insert(out.end(), enc.begin(), enc.end());
+    out.resize(align(out.size()));
+
+    if (i+1 < no_levels) mip = downsample(src);
+  }
+
+  return out;
+}
+
+} // ns gassist::texcomp
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "gassist/util.hh"
+#include "gassist/nbody.hh"
+#include "gassist/integrate.hh"
+#include "gassist/simd.hh"
+#include "gassist/jobs.hh"
+#include "gassist/lockfree.hh"
+
+namespace gassist::traj {
+
+// DATA STRUCTURES //////////////////
+
+/// Position and velocity of a massless body
+struct ship_state {
+  vec3 pos{0, 0, 0}, vel{0, 0, 0};
+};
+
+/// An impulsive burn executed at the start of the given
+/// simulation tick.
+///
+/// dv is given in the local frame of the ship relative to
+/// the primary attractor: x is prograde, y normal (along the
+/// orbital angular momentum) and z radial (outwards).
+struct maneuver {
+  uint64_t tick;
+  vec3 dv;
+
+  bool operator==(const maneuver &o) const {
+    return tick == o.tick && dv == o.dv;
+  }
+  bool operator!=(const maneuver &o) const { return !(*this == o); }
+};
+
+/// A predicted path: points[i] is the position of the ship
+/// at tick start_tick + i
+struct trajectory {
+  uint64_t start_tick = 0;
+  std::vector<vec3> points;
+};
+
+// PHYSICS //////////////////////////
+
+/// Copies the bodies of b with at least min_mass to out;
+/// the ship only feels these
+inline void select_attractors(const nbody::bodies &b, fl min_mass,
+                              nbody::bodies &out) {
+  out.clear();
+  for (size_t i=0; i < b.size(); i++)
+    if (b.mass[i] >= min_mass)
+      out.add(b.mass[i], b.pos[i], b.vel[i]);
+}
+
+/// Gravitational acceleration of a massless ship at p due
+/// to n attractors; summed directly. The force model of the
+/// ship for both the simulation and the predictor, so the
+/// two agree.
+inline vec3 ship_acceleration(const vec3 &p, const vec3 *pos,
+    const fl *mass, size_t n, const nbody::params &par) {
+  const fl eps2 = par.softening * par.softening;
+  vec3 acc{0, 0, 0};
+  for (size_t j=0; j < n; j++)
+    acc += nbody::intern::pull(p, pos[j], mass[j], eps2);
+  return acc * par.G;
+}
+
+/// Force model (see integrate.hh) pulling massless bodies
+/// toward n attractors through ship_acceleration()
+struct attractor_gravity {
+  nbody::params par;
+  const vec3 *pos = nullptr;
+  const fl *mass = nullptr;
+  size_t n = 0;
+
+  void operator()(const nbody::bodies &b, std::vector<vec3> &acc) const {
+    acc.resize(b.size());
+    for (size_t i=0; i < b.size(); i++)
+      acc[i] = ship_acceleration(b.pos[i], pos, mass, n, par);
+  }
+};
+
+/// The integrator of the game; the simulation and the
+/// predictor both step through it, so changing it here
+/// changes both
+typedef integrate::semi_implicit_euler integrator;
+
+/// Advances the attractors among themselves
+typedef integrate::simulation<integrator, integrate::direct_gravity>
+  attractor_simulation;
+
+/// Advances ships (one body each) through the attractors
+typedef integrate::simulation<integrator, attractor_gravity>
+  ship_simulation;
+
+/// Applies the velocity change of a maneuver to s; primary
+/// is the position of the body the local frame refers to.
+inline void burn(ship_state &s, const vec3 &primary, const vec3 &dv) {
+  vec3 r = s.pos - primary;
+  if (glm::dot(s.vel, s.vel) == 0 || glm::dot(r, r) == 0) return;
+
+  vec3 pro = glm::normalize(s.vel),
+       nor = glm::cross(r, s.vel);
+  nor = glm::dot(nor, nor) > 0 ? glm::normalize(nor) : vec3{0, 1, 0};
+  vec3 rad = glm::cross(pro, nor);
+  s.vel += pro*dv.x + nor*dv.y + rad*dv.z;
+}
+
+/// Applies all maneuvers scheduled for the given tick;
+/// maneuvers must be sorted by tick.
+inline void execute_maneuvers(ship_state &s, const vec3 &primary,
+    const std::vector<maneuver> &man, uint64_t tick) {
+  auto it = std::lower_bound(man.begin(), man.end(), tick,
+      [](const maneuver &m, uint64_t t) { return m.tick < t; });
+  for (; it != man.end() && it->tick == tick; ++it)
+    burn(s, primary, it->dv);
+}
+
+// PREDICTOR ////////////////////////
+
+/// Propagates a ship through the gravity field of a few
+/// attractors for a fixed number of ticks into the future.
+///
+/// The ship feels the attractors (the massive bodies) only,
+/// through ship_acceleration() like in the simulation. The
+/// attractors themselves are integrated among each other
+/// and drift from the simulated bodies, which also feel the
+/// light ones; advance() checks for that.
+///
+/// The work is incremental: The path of the attractors does
+/// not depend on the ship and is only extended as the start
+/// moves forward; the path of the ship is only recomputed
+/// from the first tick affected by a changed maneuver, and
+/// moving the start forward along the predicted path only
+/// extends the tail.
+///
+/// Not thread safe.
+class predictor {
+  size_t no_steps_;
+  fl dt_;
+
+  uint64_t start_ = 0;
+  std::vector<maneuver> man_;
+
+  /// State of the attractors at the last tick of the
+  /// ephemeris; the ephemeris is extended from here
+  attractor_simulation attr_;
+
+  /// Steps the ship one tick at a time; its force points
+  /// at the attractors of that tick in eph_
+  ship_simulation ship_sim_;
+
+  /// Attractor positions; no_attractors() entries per tick
+  /// starting at start_
+  std::vector<vec3> eph_;
+
+  /// ship_[i] is the state at tick start_ + i, before the
+  /// maneuvers of that tick. The first valid_ are current.
+  std::vector<ship_state> ship_;
+  size_t valid_ = 0;
+
+  size_t eph_ticks() const {
+    return no_attractors() ? eph_.size() / no_attractors() : 0;
+  }
+
+  /// Appends one tick to the ephemeris
+  void extend_ephemeris() {
+    attr_.step(dt_);
+    eph_.insert(eph_.end(), attr_.bodies.pos.begin(),
+                attr_.bodies.pos.end());
+  }
+
+  /// Computes ship_[i+1] from ship_[i]
+  void step_ship(size_t i) {
+    const vec3 *att = eph_.data() + i*no_attractors();
+    ship_state s = ship_[i];
+    if (no_attractors() > 0)
+      execute_maneuvers(s, att[0], man_, start_ + i);
+
+    nbody::bodies &sb = ship_sim_.bodies;
+    sb.pos[0] = s.pos;
+    sb.vel[0] = s.vel;
+    ship_sim_.force.pos = att;
+    // Any state the integrator kept belongs to another tick
+    ship_sim_.integrator.reset();
+    ship_sim_.step(dt_);
+    ship_[i+1] = {sb.pos[0], sb.vel[0]};
+  }
+
+public:
+  /// no_steps is how many ticks of length dt to predict
+  predictor(size_t no_steps, fl dt, const nbody::params &par={})
+    : no_steps_{no_steps}, dt_{dt} {
+    attr_.force.par = par;
+    ship_sim_.force.par = par;
+    ship_sim_.bodies.add(0, {0, 0, 0});
+  }
+
+  // The ship force points into attr_
+  predictor(const predictor&) = delete;
+  predictor& operator =(const predictor&) = delete;
+
+  uint64_t start_tick() const { return start_; }
+  size_t no_attractors() const { return attr_.bodies.size(); }
+  size_t no_steps() const { return no_steps_; }
+
+  /// Whether the next update() has anything to do
+  bool dirty() const { return valid_ < no_steps_ + 1; }
+
+  /// Starts a completely new prediction at the given tick
+  void reset(uint64_t tick, const ship_state &ship,
+             const nbody::bodies &attractors) {
+    start_ = tick;
+    attr_.bodies = attractors;
+    attr_.integrator.reset();
+    ship_sim_.force.mass = attr_.bodies.mass.data();
+    ship_sim_.force.n = no_attractors();
+    eph_.assign(attractors.pos.begin(), attractors.pos.end());
+    eph_.reserve((no_steps_ + 1) * no_attractors());
+    ship_.assign(no_steps_ + 1, ship_state{});
+    ship_[0] = ship;
+    valid_ = 1;
+  }
+
+  /// Moves the start forward to the given tick, reusing the
+  /// existing prediction if ship and every attractor are
+  /// within tol of their predicted positions (the ship's
+  /// velocity also within tol per tick). Returns false if
+  /// that is not possible; the caller needs to reset() then.
+  bool advance(uint64_t tick, const ship_state &ship,
+               const nbody::bodies &attractors, fl tol) {
+    if (tick < start_ || tick - start_ >= valid_) return false;
+    if (attractors.size() != no_attractors()) return false;
+
+    size_t k = tick - start_;
+    const ship_state &p = ship_[k];
+    if (glm::length(p.pos - ship.pos) > tol
+        || glm::length(p.vel - ship.vel) * dt_ > tol)
+      return false;
+
+    const vec3 *att = eph_.data() + k*no_attractors();
+    for (size_t j=0; j < no_attractors(); j++)
+      if (glm::length(att[j] - attractors.pos[j]) > tol)
+        return false;
+
+    ship_.erase(ship_.begin(), ship_.begin() + k);
+    ship_.resize(no_steps_ + 1);
+    ship_[0] = ship;
+    valid_ -= k;
+    eph_.erase(eph_.begin(), eph_.begin() + k*no_attractors());
+    start_ = tick;
+
+    // Executed maneuvers are no longer relevant
+    man_.erase(man_.begin(), std::lower_bound(man_.begin(), man_.end(),
+        tick, [](const maneuver &m, uint64_t t) { return m.tick < t; }));
+    return true;
+  }
+
+  /// Replaces the planned maneuvers; invalidates the path
+  /// from the first tick whose maneuvers changed.
+  void set_maneuvers(std::vector<maneuver> man) {
+    std::sort(man.begin(), man.end(),
+        [](const maneuver &a, const maneuver &b) { return a.tick < b.tick; });
+
+    auto [a, b] = std::mismatch(man.begin(), man.end(),
+                                man_.begin(), man_.end());
+    if (a != man.end() || b != man_.end()) {
+      uint64_t first = std::min(
+          a != man.end() ? a->tick : UINT64_MAX,
+          b != man_.end() ? b->tick : UINT64_MAX);
+      // ship_[i] is before the maneuvers of its tick
+      if (first >= start_)
+        valid_ = std::min<uint64_t>(valid_, first - start_ + 1);
+      else
+        valid_ = std::min<size_t>(valid_, 1);
+    }
+
+    man_ = std::move(man);
+  }
+
+  /// Recomputes the invalidated part of the prediction;
+  /// returns the number of ticks computed
+  size_t update() {
+    if (valid_ == 0) return 0; // Never reset()
+    while (no_attractors() > 0 && eph_ticks() < no_steps_ + 1)
+      extend_ephemeris();
+
+    size_t computed = 0;
+    for (; valid_ < no_steps_ + 1; valid_++, computed++)
+      step_ship(valid_ - 1);
+    return computed;
+  }
+
+  /// The predicted states; only meaningful after update()
+  const std::vector<ship_state>& states() const { return ship_; }
+
+  /// Writes the predicted positions to out
+  void path(trajectory &out) const {
+    out.start_tick = start_;
+    out.points.resize(ship_.size());
+    for (size_t i=0; i < ship_.size(); i++)
+      out.points[i] = ship_[i].pos;
+  }
+};
+
+// BACKGROUND PREDICTION ////////////
+
+/// Runs a predictor on a job_pool, so the prediction never
+/// holds up the simulation.
+///
+/// The owning thread calls request() with the current state
+/// and poll() once per tick; at most one prediction job is
+/// running at a time and requests made in the meantime are
+/// collapsed into the latest one. Results are published
+/// through a triple_buffer to a single reader thread.
+class async_predictor {
+  struct request_t {
+    uint64_t tick;
+    ship_state ship;
+    nbody::bodies attractors;
+    std::vector<maneuver> maneuvers;
+  };
+
+  job_pool &pool_;
+  fl tol_;
+
+  // Only accessed by the running job, if any
+  std::unique_ptr<predictor> pred_;
+  std::future<size_t> job_;
+
+  std::optional<request_t> pending_;
+  triple_buffer<trajectory> out_;
+
+  size_t last_computed_ = 0;
+
+  void start_job() {
+    job_ = pool_.submit([this, r=std::move(*pending_)]() {
+      if (!pred_->advance(r.tick, r.ship, r.attractors, tol_))
+        pred_->reset(r.tick, r.ship, r.attractors);
+      pred_->set_maneuvers(r.maneuvers);
+      size_t n = pred_->update();
+      if (n > 0) {
+        pred_->path(out_.back());
+        out_.publish();
+      }
+      return n;
+    });
+    pending_.reset();
+  }
+
+public:
+  /// tol is how far (in world units) the real ship or an
+  /// attractor may drift from the prediction before it is
+  /// recomputed from scratch
+  async_predictor(job_pool &pool, size_t no_steps, fl dt,
+                  const nbody::params &par={}, fl tol=1e-3f)
+    : pool_{pool}, tol_{tol},
+      pred_{std::make_unique<predictor>(no_steps, dt, par)} {}
+
+  ~async_predictor() {
+    if (job_.valid()) job_.wait();
+  }
+
+  async_predictor(const async_predictor&) = delete;
+  async_predictor& operator =(const async_predictor&) = delete;
+
+  //// OWNER SIDE ////
+
+  /// Asks for a prediction starting at the given tick; the
+  /// attractors are the bodies with at least min_mass
+  void request(uint64_t tick, const ship_state &ship,
+               const nbody::bodies &bodies, fl min_mass,
+               const std::vector<maneuver> &maneuvers) {
+    if (!pending_) pending_.emplace();
+    request_t &r = *pending_;
+    r.tick = tick;
+    r.ship = ship;
+    select_attractors(bodies, min_mass, r.attractors);
+    r.maneuvers = maneuvers;
+  }
+
+  /// Starts the next job if the previous one has finished;
+  /// rethrows exceptions from the job
+  void poll() {
+    if (job_.valid()) {
+      if (!is_ready(job_)) return;
+      last_computed_ = job_.get();
+    }
+    if (pending_) start_job();
+  }
+
+  /// Number of ticks the last finished job computed
+  size_t last_computed() const { return last_computed_; }
+
+  //// READER SIDE ////
+
+  /// Whether a prediction was published that has not
+  /// been read
+  bool has_update() const { return out_.has_update(); }
+
+  /// The latest published prediction
+  const trajectory& read() { return out_.read(); }
+};
+
+} // ns gassist::traj
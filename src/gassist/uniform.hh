@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include <array>
+#include <string>
+#include <utility>
+
+#include <epoxy/gl.h>
+
+#include "gassist/exception.hh"
+#include "gassist/util.hh"
+#include "gassist/wrap_gl.hh"
+
+namespace gassist::gl {
+
+// STD140 LAYOUT ////////////////////
+
+/// Compile time description of the std140 layout rules for
+/// the types we use in uniform blocks.
+///
+/// Only types with a specialization of traits may be used;
+/// anything else (e.g. bool or arrays, which std140 pads to
+/// 16 bytes per element) fails to compile.
+namespace std140 {
+
+template<typename T> struct traits;
+
+template<size_t Align, size_t Size>
+struct basic_traits {
+  static constexpr size_t align = Align, size = Size;
+};
+
+template<> struct traits<float> : basic_traits<4, 4> {};
+template<> struct traits<int32_t> : basic_traits<4, 4> {};
+template<> struct traits<uint32_t> : basic_traits<4, 4> {};
+template<> struct traits<vec2> : basic_traits<8, 8> {};
+template<> struct traits<vec3> : basic_traits<16, 12> {};
+template<> struct traits<vec4> : basic_traits<16, 16> {};
+template<> struct traits<mat4> : basic_traits<16, 64> {};
+
+constexpr size_t align_up(size_t v, size_t a) {
+  return (v + a - 1) / a * a;
+}
+
+/// The std140 offsets of a block with members of the given
+/// types in the given order, and the size of the block.
+template<typename... Ts>
+struct layout {
+  static constexpr size_t no_members = sizeof...(Ts);
+
+  static constexpr std::array<size_t, no_members> offsets() {
+    std::array<size_t, no_members> r{};
+    size_t aligns[] = {traits<Ts>::align...},
+           sizes[] = {traits<Ts>::size...},
+           off = 0;
+    for (size_t i=0; i < no_members; i++) {
+      off = align_up(off, aligns[i]);
+      r[i] = off;
+      off += sizes[i];
+    }
+    return r;
+  }
+
+  static constexpr size_t size() {
+    auto offs = offsets();
+    size_t sizes[] = {traits<Ts>::size...};
+    return align_up(offs[no_members - 1] + sizes[no_members - 1], 16);
+  }
+
+  /// Whether the given offsets (use offsetof()) and size
+  /// (use sizeof()) of a C++ struct match std140
+  static constexpr bool matches(std::array<size_t, no_members> actual,
+                                size_t actual_size) {
+    auto expected = offsets();
+    for (size_t i=0; i < no_members; i++)
+      if (expected[i] != actual[i]) return false;
+    return actual_size == size();
+  }
+};
+
+} // ns std140
+
+// UNIFORM BLOCKS ///////////////////
+
+/// Per frame parameters; shared by all programs.
+///
+/// Has to be kept in sync with the `frame` uniform block in
+/// the shaders; the layout is checked against std140 at
+/// compile time and the size against the linked program by
+/// bind_uniform_block().
+struct frame_uniforms {
+  static constexpr const char *block_name = "frame";
+  static constexpr GLuint binding = 0;
+
+  alignas(16) mat4 vp;
+  alignas(16) vec3 cam_pos;
+  float time;
+};
+
+static_assert(std140::layout<mat4, vec3, float>::matches({
+    offsetof(frame_uniforms, vp),
+    offsetof(frame_uniforms, cam_pos),
+    offsetof(frame_uniforms, time) }, sizeof(frame_uniforms)),
+  "frame_uniforms does not match the std140 layout");
+
+/// Connects the uniform block T::block_name of the program to
+/// the binding point T::binding.
+///
+/// Throws msg_exception if the block is missing (or was
+/// optimized away) or its size differs from sizeof(T).
+template<typename T>
+void bind_uniform_block(const program &p) {
+  GLuint idx = glGetUniformBlockIndex(p.id(), T::block_name);
+  if (idx == GL_INVALID_INDEX)
+    throw msg_exception{std::string{"No uniform block "} + T::block_name};
+
+  GLint size = 0;
+  glGetActiveUniformBlockiv(p.id(), idx, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+  if (size_t(size) != sizeof(T))
+    throw msg_exception{std::string{"Size mismatch in uniform block "}
+                        + T::block_name};
+
+  glUniformBlockBinding(p.id(), idx, T::binding);
+}
+
+// UNIFORM RING /////////////////////
+
+/// A ring of uniform blocks of type T in a single buffer,
+/// one slot per frame that may be in flight plus one that is
+/// being written.
+///
+/// Uses a persistently mapped buffer if ARB_buffer_storage is
+/// available and unsynchronized mapping of the slot otherwise;
+/// either way updating never stalls. The caller has to make
+/// sure the GPU is done with a slot before it is reused,
+/// e.g. by using a frame_pacer with at most slots-1 frames in
+/// flight.
+template<typename T>
+class uniform_ring {
+  GLuint id_ = 0;
+  size_t stride_ = 0, slots_ = 0, next_ = 0;
+  char *mapped_ = nullptr; // Only with persistent mapping
+
+public:
+  uniform_ring(size_t slots=frame_pacer::max_frames_in_flight + 1)
+      : slots_{slots} {
+    GLint align = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    stride_ = std140::align_up(sizeof(T), align);
+
+    glGenBuffers(1, &id_);
+    glBindBuffer(GL_UNIFORM_BUFFER, id_);
+    const size_t len = stride_ * slots_;
+    if (epoxy_gl_version() >= 44
+        || epoxy_has_gl_extension("GL_ARB_buffer_storage")) {
+      const GLbitfield flags = GL_MAP_WRITE_BIT
+        | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_UNIFORM_BUFFER, len, nullptr, flags);
+      mapped_ = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, len, flags);
+    } else {
+      glBufferData(GL_UNIFORM_BUFFER, len, nullptr, GL_DYNAMIC_DRAW);
+    }
+  }
+
+  ~uniform_ring() {
+    if (mapped_) {
+      glBindBuffer(GL_UNIFORM_BUFFER, id_);
+      glUnmapBuffer(GL_UNIFORM_BUFFER);
+    }
+    glDeleteBuffers(1, &id_);
+  }
+
+  GLuint id() const { return id_; }
+  bool persistent() const { return mapped_ != nullptr; }
+
+  /// Writes v to the next slot and binds that slot to
+  /// T::binding; the one buffer update per frame.
+  void push(const T &v) {
+    const size_t off = next_ * stride_;
+    next_ = (next_ + 1) % slots_;
+
+    glBindBuffer(GL_UNIFORM_BUFFER, id_);
+    if (mapped_) {
+      std::memcpy(mapped_ + off, &v, sizeof(T));
+    } else {
+      void *dst = glMapBufferRange(GL_UNIFORM_BUFFER, off, sizeof(T),
+          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+          | GL_MAP_UNSYNCHRONIZED_BIT);
+      std::memcpy(dst, &v, sizeof(T));
+      glUnmapBuffer(GL_UNIFORM_BUFFER);
+    }
+    glBindBufferRange(GL_UNIFORM_BUFFER, T::binding, id_, off, sizeof(T));
+  }
+
+  uniform_ring(const uniform_ring&) = delete;
+  uniform_ring& operator =(const uniform_ring&otr) = delete;
+
+  uniform_ring(uniform_ring&& otr) { swap(otr); }
+  uniform_ring& operator=(uniform_ring&& otr) {
+    swap(otr);
+    return *this;
+  }
+
+  void swap(uniform_ring &otr) {
+    std::swap(id_, otr.id_);
+    std::swap(stride_, otr.stride_);
+    std::swap(slots_, otr.slots_);
+    std::swap(next_, otr.next_);
+    std::swap(mapped_, otr.mapped_);
+  }
+};
+
+} // ns gassist::gl
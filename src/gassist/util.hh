@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
+
 #include <glm/gtc/type_precision.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/constants.hpp>
@@ -59,6 +62,18 @@ mat4 rotate(const fl angle, const vec3 &axis) {
   return glm::rotate(identity, angle, axis);
 }
 
+/// FNV-1a hash of the given bytes; pass the result of a
+/// previous call as h to hash multiple pieces of data
+inline uint64_t fnv1a(const void *data, size_t len,
+                      uint64_t h=14695981039346656037ull) {
+  auto *bytes = (const uint8_t*)data;
+  for (size_t i=0; i < len; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
 /// Applies a 4d matrix transformation to a 3d vector
 /// (converts the 3d vector to 4d by setting w=1 and
 /// then drops w again)
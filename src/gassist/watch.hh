@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "gassist/exception.hh"
+#include "gassist/lockfree.hh"
+
+namespace gassist {
+
+/// Watches a set of files for changes with inotify on a
+/// background thread.
+///
+/// Files are given relative to one or more root
+/// directories (e.g. the loose file directories of an
+/// asset::load_path); a change to the file below any of the
+/// roots is reported as the root and the relative path. The directories
+/// containing the files are watched rather than the files
+/// themselves, so editors replacing a file by renaming a
+/// new one over it are handled, as are files created after
+/// the watch started.
+///
+/// Bursts of events (an editor writing a file in several
+/// steps, a build step touching many files) are collapsed
+/// by waiting until no more events arrive for a short
+/// moment before reporting.
+///
+/// Changes are reported through a single consumer queue;
+/// call drain() e.g. once per frame. Linux only.
+class file_watcher {
+public:
+  static constexpr size_t queue_size = 64;
+
+  /// A changed file: path relative to the given root
+  struct change {
+    std::string root, path;
+
+    bool operator<(const change &o) const {
+      return std::tie(root, path) < std::tie(o.root, o.path);
+    }
+  };
+
+private:
+  int fd_ = -1;
+
+  /// Watch descriptor -> the root and the directory
+  /// relative to it ("" for the root itself)
+  std::map<int, change> dirs_;
+  std::set<std::string> files_;
+
+  spsc_queue<change, queue_size> changes_;
+  std::atomic<bool> stop_{false};
+  std::thread thr_;
+
+  static constexpr int poll_ms = 100;
+  static constexpr auto quiet_time = std::chrono::milliseconds{50};
+
+  /// Reads all pending events; adds changed files we are
+  /// interested in to out. Returns whether there were any.
+  bool read_events(std::set<change> &out) {
+    alignas(inotify_event) char buf[4096];
+    bool any = false;
+    while (true) {
+      ssize_t len = ::read(fd_, buf, sizeof(buf));
+      if (len <= 0) return any; // EAGAIN: Nothing left
+
+      for (char *p = buf; p < buf + len;) {
+        auto *ev = (inotify_event*)p;
+        p += sizeof(inotify_event) + ev->len;
+
+        auto dir = dirs_.find(ev->wd);
+        if (dir == dirs_.end() || ev->len == 0) continue;
+        const change &d = dir->second;
+        std::string path = d.path.empty() ? ev->name
+                         : d.path + "/" + ev->name;
+        if (files_.count(path)) {
+          out.insert({d.root, path});
+          any = true;
+        }
+      }
+    }
+  }
+
+  void run() {
+    std::set<change> pending;
+    auto last_event = std::chrono::steady_clock::now();
+
+    while (!stop_) {
+      pollfd pfd{fd_, POLLIN, 0};
+      int timeout = pending.empty() ? poll_ms : int(quiet_time.count());
+      if (::poll(&pfd, 1, timeout) > 0) {
+        if (read_events(pending))
+          last_event = std::chrono::steady_clock::now();
+        continue;
+      }
+
+      // Quiet for long enough; report. Whatever does not
+      // fit the queue is retried next time around.
+      if (!pending.empty()
+          && std::chrono::steady_clock::now() - last_event >= quiet_time) {
+        for (auto it = pending.begin(); it != pending.end();) {
+          if (!changes_.push(*it)) break;
+          it = pending.erase(it);
+        }
+      }
+    }
+  }
+
+public:
+  /// Watches root/file for every root and file; missing
+  /// directories are skipped. Throws errno_exception if
+  /// inotify is not available.
+  file_watcher(const std::vector<std::string> &roots,
+               const std::vector<std::string> &files)
+      : files_{files.begin(), files.end()} {
+    fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) throw errno_exception{};
+
+    std::set<std::string> subdirs;
+    for (auto &f : files) {
+      size_t slash = f.rfind('/');
+      subdirs.insert(slash == std::string::npos ? "" : f.substr(0, slash));
+    }
+
+    for (auto &root : roots) {
+      for (auto &sub : subdirs) {
+        std::string dir = sub.empty() ? root : root + "/" + sub;
+        int wd = ::inotify_add_watch(fd_, dir.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd >= 0) dirs_[wd] = {root, sub};
+      }
+    }
+
+    thr_ = std::thread{[this]() { run(); }};
+  }
+
+  ~file_watcher() {
+    stop_ = true;
+    if (thr_.joinable()) thr_.join();
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  file_watcher(const file_watcher&) = delete;
+  file_watcher& operator =(const file_watcher&) = delete;
+
+  /// Number of directories actually watched
+  size_t no_watched_dirs() const { return dirs_.size(); }
+
+  /// Calls f(change) for every file changed since the
+  /// last call; returns the number of files. Single
+  /// consumer.
+  template<typename F>
+  size_t drain(F &&f) {
+    return changes_.drain(f);
+  }
+};
+
+} // ns gassist
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <epoxy/egl.h>
+
+#include "gassist/exception.hh"
+
+namespace gassist::egl {
+
+/// An OpenGL 3.3 core context without any window or
+/// surface; made current on construction.
+///
+/// Useful for rendering into framebuffer objects on
+/// machines without a display (e.g. with Mesa's llvmpipe
+/// on build machines). Uses the surfaceless platform if
+/// available and the default display otherwise.
+///
+/// Throws msg_exception if no such context can be created.
+class context {
+  EGLDisplay dpy_ = EGL_NO_DISPLAY;
+  EGLContext ctx_ = EGL_NO_CONTEXT;
+
+  void fail(const char *msg) {
+    if (dpy_ != EGL_NO_DISPLAY) eglTerminate(dpy_);
+    throw msg_exception{msg};
+  }
+
+public:
+  context() {
+    if (epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_EXT_platform_base")
+        && epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+      dpy_ = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA,
+                                      EGL_DEFAULT_DISPLAY, nullptr);
+    if (dpy_ == EGL_NO_DISPLAY)
+      dpy_ = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (dpy_ == EGL_NO_DISPLAY)
+      throw msg_exception{"No EGL display"};
+
+    if (!eglInitialize(dpy_, nullptr, nullptr)) {
+      dpy_ = EGL_NO_DISPLAY;
+      throw msg_exception{"Could not initialize EGL"};
+    }
+    if (!epoxy_has_egl_extension(dpy_, "EGL_KHR_surfaceless_context"))
+      fail("EGL does not support surfaceless contexts");
+    if (!eglBindAPI(EGL_OPENGL_API))
+      fail("EGL does not support OpenGL");
+
+    const EGLint cfg_attrs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_NONE};
+    EGLConfig cfg;
+    EGLint no_cfgs = 0;
+    if (!eglChooseConfig(dpy_, cfg_attrs, &cfg, 1, &no_cfgs) || no_cfgs < 1)
+      fail("No suitable EGL config");
+
+    const EGLint ctx_attrs[] = {
+      EGL_CONTEXT_MAJOR_VERSION, 3,
+      EGL_CONTEXT_MINOR_VERSION, 3,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_NONE};
+    ctx_ = eglCreateContext(dpy_, cfg, EGL_NO_CONTEXT, ctx_attrs);
+    if (ctx_ == EGL_NO_CONTEXT)
+      fail("Could not create an OpenGL 3.3 context");
+
+    if (!eglMakeCurrent(dpy_, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx_)) {
+      eglDestroyContext(dpy_, ctx_);
+      fail("Could not make the EGL context current");
+    }
+  }
+
+  ~context() {
+    eglMakeCurrent(dpy_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(dpy_, ctx_);
+    eglTerminate(dpy_);
+  }
+
+  context(const context&) = delete;
+  context& operator =(const context&) = delete;
+};
+
+} // ns gassist::egl
@@ -1,6 +1,14 @@
 #pragma once
 
+#include <cstdint>
+
 #include <initializer_list>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
 #include <sstream>
 #include <functional>
 #include <utility>
@@ -22,8 +30,6 @@ class shader {
   GLuint _id;
 
 public:
-  
-  GLuint param_mvp;
   shader(const GLenum type, const char *s, size_t len)
       : _type{type}, _id{glCreateShader(_type)} {
     int _len = len; // TODO: Check overflow
@@ -102,10 +108,12 @@ shader make_fragment_shader(Args&&... args) {
 /// should be handled by wrapper classes.
 class program {
   GLuint _id = glCreateProgram();
-  GLuint param_mvp_id;
 
   template<typename R>
   void from_range(const R &shaders) {
+    // Allow binary() to be used on this program
+    glProgramParameteri(id(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
     for (shader &s : shaders) glAttachShader(id(), s.id());
     glLinkProgram(id());
     for (shader &s : shaders) glDetachShader(id(), s.id());
@@ -140,6 +148,40 @@ public:
     from_range(l);
   }
 
+  /// Loads a program from a binary previously obtained with
+  /// binary(). The driver may reject binaries (e.g. after a
+  /// driver update); throws msg_exception in that case.
+  program(GLenum format, const void *data, size_t len) {
+    glProgramBinary(id(), format, data, len);
+
+    GLint success;
+    glGetProgramiv(id(), GL_LINK_STATUS, &success);
+    if (!success) {
+      glDeleteProgram(id());
+      throw msg_exception{"Program binary rejected"};
+    }
+  }
+
+  /// Whether the driver supports program binaries at all
+  static bool binaries_supported() {
+    GLint no_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &no_formats);
+    return no_formats > 0;
+  }
+
+  /// Retrieves the linked program in a driver specific
+  /// binary format for loading it later
+  std::vector<char> binary(GLenum &format) const {
+    GLint len = 0;
+    glGetProgramiv(id(), GL_PROGRAM_BINARY_LENGTH, &len);
+    std::vector<char> buf(len);
+    GLsizei written = 0;
+    if (len > 0)
+      glGetProgramBinary(id(), len, &written, &format, buf.data());
+    buf.resize(written);
+    return buf;
+  }
+
   ~program() {
     glDeleteProgram(id());
   }
@@ -164,19 +206,88 @@ public:
   }
 };
 
+/// Buffer of per instance model matrices for instanced
+/// drawing. Meant to be respecified every frame: upload()
+/// orphans the old storage, so the driver does not need to
+/// wait for draws still reading it; the buffer name and the
+/// vertex arrays pointing into it stay valid.
+class instance_buffer {
+  GLuint id_ = 0;
+  size_t capacity_ = 0;
+  // Unlike the GL name this is never reused, so meshes can
+  // tell whether their vertex array still points here
+  uint64_t serial_ = 0;
+
+  static uint64_t next_serial() {
+    static std::atomic<uint64_t> n{0};
+    return ++n;
+  }
+
+public:
+  instance_buffer() : serial_{next_serial()} {
+    glGenBuffers(1, &id_);
+  }
+
+  ~instance_buffer() {
+    glDeleteBuffers(1, &id_);
+  }
+
+  GLuint id() const { return id_; }
+  uint64_t serial() const { return serial_; }
+
+  /// Replaces the contents of the buffer
+  void upload(const mat4 *models, size_t n) {
+    glBindBuffer(GL_ARRAY_BUFFER, id_);
+    capacity_ = std::max(capacity_, n);
+    glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(mat4),
+                 nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, n*sizeof(mat4), models);
+  }
+
+  instance_buffer(const instance_buffer&) = delete;
+  instance_buffer& operator =(const instance_buffer&otr) = delete;
+
+  instance_buffer(instance_buffer&& otr) { swap(otr); }
+  instance_buffer& operator=(instance_buffer&& otr) {
+    swap(otr);
+    return *this;
+  }
+
+  void swap(instance_buffer &otr) {
+    std::swap(id_, otr.id_);
+    std::swap(capacity_, otr.capacity_);
+    std::swap(serial_, otr.serial_);
+  }
+};
+
 /// Basic wrapper for a 3d mesh/model.
-/// Takes a range of vertices and takes care of uploading
-/// them to the GPU and painting them
+/// Takes a range of vertices (and optionally a range of
+/// 32 bit indices into the vertices) and takes care of
+/// uploading them to the GPU and painting them
+///
+/// Meshes are always drawn instanced; vertex attribute 0 is
+/// the vertex position, attributes 1-4 the columns of the
+/// per instance model matrix. All of that is recorded in the
+/// vertex array: the positions on construction, the instance
+/// pointers on the first draw. They are only respecified
+/// when a draw uses another instance buffer or another first
+/// instance than the previous one (GL 3.3 has no base
+/// instance for draws).
 ///
-/// Paint with draw()
+/// Paint with draw_instanced(), or bind() once and then
+/// draw_bound() any number of times.
 class mesh {
-  GLuint id_vertex_array;
-	GLuint id_vertex_buffer;
-  size_t no_vertices;
+  GLuint id_vertex_array = 0;
+	GLuint id_vertex_buffer = 0;
+  GLuint id_index_buffer = 0;
+  size_t no_vertices = 0;
+  size_t no_indices = 0;
+  // Where the instance attributes of the vertex array point
+  uint64_t inst_serial = 0;
+  size_t inst_first = 0;
 
-public:
   template<typename VertCont>
-  mesh(const VertCont &vertices) noexcept {
+  void upload_vertices(const VertCont &vertices) {
 	  glGenVertexArrays(1, &id_vertex_array);
     glBindVertexArray(id_vertex_array);
 
@@ -188,19 +299,10 @@ public:
     glBufferData(GL_ARRAY_BUFFER,
                  vertices.size()*sizeof(vec3),
                  vertices.data(), GL_STATIC_DRAW);
-  }
 
-  ~mesh() {
-    glDeleteBuffers(1, &id_vertex_buffer);
-	  glDeleteVertexArrays(1, &id_vertex_array);
-  }
-
-  /// Draws this mesh. You should probably use draw() instead
-  void draw() {
 		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, id_vertex_buffer);
 		glVertexAttribPointer(
-			0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
+			0,                  // attribute 0; must match the layout in the shader.
 			3,                  // size
 			GL_FLOAT,           // type
 			GL_FALSE,           // normalized?
@@ -208,10 +310,306 @@ public:
 			(void*)0            // array buffer offset
 		);
 
-		// Draw the triangle !
-		glDrawArrays(GL_TRIANGLES, 0, no_vertices);
+    // The model matrix takes one attribute per column; the
+    // pointers are set by the first draw
+    for (GLuint col=0; col < 4; col++) {
+      glEnableVertexAttribArray(1 + col);
+      glVertexAttribDivisor(1 + col, 1);
+    }
+  }
+
+public:
+  template<typename VertCont>
+  mesh(const VertCont &vertices) noexcept {
+    upload_vertices(vertices);
+  }
+
+  /// Indexed mesh; indices must be contiguous uint32_t
+  template<typename VertCont, typename IdxCont>
+  mesh(const VertCont &vertices, const IdxCont &indices) noexcept {
+    upload_vertices(vertices);
+
+    // The element buffer binding is part of the vertex
+    // array state, so this sticks with the mesh
+    glGenBuffers(1, &id_index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id_index_buffer);
+    no_indices = indices.size();
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 indices.size()*sizeof(uint32_t),
+                 indices.data(), GL_STATIC_DRAW);
+  }
+
+  ~mesh() {
+    glDeleteBuffers(1, &id_index_buffer);
+    glDeleteBuffers(1, &id_vertex_buffer);
+	  glDeleteVertexArrays(1, &id_vertex_array);
+  }
+
+  bool indexed() const { return id_index_buffer != 0; }
+
+  /// Number of triangles drawn per instance
+  size_t no_triangles() const {
+    return (indexed() ? no_indices : no_vertices) / 3;
+  }
+
+  GLuint vertex_array() const { return id_vertex_array; }
+
+  void bind() {
+    glBindVertexArray(id_vertex_array);
+  }
+
+  /// Draws count instances of this mesh, using the model
+  /// matrices [first, first+count) from the instance buffer
+  void draw_instanced(const instance_buffer &inst,
+                      size_t first, size_t count) {
+    bind();
+    draw_bound(inst, first, count);
+  }
+
+  /// Like draw_instanced(), but the mesh must already be
+  /// bound
+  void draw_bound(const instance_buffer &inst,
+                  size_t first, size_t count) {
+    if (inst.serial() != inst_serial || first != inst_first) {
+      glBindBuffer(GL_ARRAY_BUFFER, inst.id());
+      for (GLuint col=0; col < 4; col++)
+        glVertexAttribPointer(1 + col, 4, GL_FLOAT, GL_FALSE, sizeof(mat4),
+            (void*)(first*sizeof(mat4) + col*sizeof(vec4)));
+      inst_serial = inst.serial();
+      inst_first = first;
+    }
+
+    if (indexed())
+      glDrawElementsInstanced(GL_TRIANGLES, no_indices,
+          GL_UNSIGNED_INT, (void*)0, count);
+    else
+      glDrawArraysInstanced(GL_TRIANGLES, 0, no_vertices, count);
+  }
+
+  mesh(const mesh&) = delete;
+  mesh& operator =(const mesh&otr) = delete;
+
+  mesh(mesh&& otr) { swap(otr); }
+  mesh& operator=(mesh&& otr) {
+    swap(otr);
+    return *this;
+  }
+
+  void swap(mesh &otr) {
+    std::swap(id_vertex_array, otr.id_vertex_array);
+    std::swap(id_vertex_buffer, otr.id_vertex_buffer);
+    std::swap(id_index_buffer, otr.id_index_buffer);
+    std::swap(no_vertices, otr.no_vertices);
+    std::swap(no_indices, otr.no_indices);
+    std::swap(inst_serial, otr.inst_serial);
+    std::swap(inst_first, otr.inst_first);
+  }
+};
+
+/// A connected line through a list of points that changes
+/// frequently (e.g. a predicted trajectory); upload()
+/// orphans the old storage like instance_buffer does.
+///
+/// Vertex attribute 0 is the position.
+class line_strip {
+  GLuint id_vertex_array = 0;
+  GLuint id_vertex_buffer = 0;
+  size_t capacity_ = 0, no_points_ = 0;
+
+public:
+  line_strip() {
+    glGenVertexArrays(1, &id_vertex_array);
+    glBindVertexArray(id_vertex_array);
+    glGenBuffers(1, &id_vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, id_vertex_buffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  }
+
+  ~line_strip() {
+    glDeleteBuffers(1, &id_vertex_buffer);
+    glDeleteVertexArrays(1, &id_vertex_array);
+  }
+
+  size_t size() const { return no_points_; }
+
+  /// Replaces the points of the line
+  void upload(const vec3 *points, size_t n) {
+    glBindBuffer(GL_ARRAY_BUFFER, id_vertex_buffer);
+    capacity_ = std::max(capacity_, n);
+    glBufferData(GL_ARRAY_BUFFER, capacity_*sizeof(vec3),
+                 nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, n*sizeof(vec3), points);
+    no_points_ = n;
+  }
+
+  void draw() const {
+    if (no_points_ < 2) return;
+    glBindVertexArray(id_vertex_array);
+    glDrawArrays(GL_LINE_STRIP, 0, no_points_);
+  }
+
+  line_strip(const line_strip&) = delete;
+  line_strip& operator =(const line_strip&otr) = delete;
+
+  line_strip(line_strip&& otr) { swap(otr); }
+  line_strip& operator=(line_strip&& otr) {
+    swap(otr);
+    return *this;
+  }
+
+  void swap(line_strip &otr) {
+    std::swap(id_vertex_array, otr.id_vertex_array);
+    std::swap(id_vertex_buffer, otr.id_vertex_buffer);
+    std::swap(capacity_, otr.capacity_);
+    std::swap(no_points_, otr.no_points_);
+  }
+};
+
+/// Offscreen render target with a color and a depth
+/// attachment; draw into it after bind()
+class framebuffer {
+  GLuint fbo_ = 0, color_ = 0, depth_ = 0;
+  int w_, h_;
+
+public:
+  framebuffer(int w, int h) : w_{w}, h_{h} {
+    glGenRenderbuffers(1, &color_);
+    glBindRenderbuffer(GL_RENDERBUFFER, color_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+
+    glGenRenderbuffers(1, &depth_);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+
+    glGenFramebuffers(1, &fbo_);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, color_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, depth_);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+      // TODO: Handle in a better way
+      glDeleteFramebuffers(1, &fbo_);
+      glDeleteRenderbuffers(1, &depth_);
+      glDeleteRenderbuffers(1, &color_);
+      throw msg_exception{"Incomplete framebuffer"};
+    }
+  }
+
+  ~framebuffer() {
+    glDeleteFramebuffers(1, &fbo_);
+    glDeleteRenderbuffers(1, &depth_);
+    glDeleteRenderbuffers(1, &color_);
+  }
+
+  framebuffer(const framebuffer&) = delete;
+  framebuffer& operator =(const framebuffer&) = delete;
+
+  int width() const { return w_; }
+  int height() const { return h_; }
+
+  /// Makes this the draw target and adjusts the viewport
+  void bind() {
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+    glViewport(0, 0, w_, h_);
+    glScissor(0, 0, w_, h_);
+  }
+
+  /// Reads back the color attachment as tightly packed
+  /// RGBA rows (bottom row first); blocks until rendering
+  /// finished
+  std::vector<uint8_t> read_pixels() {
+    std::vector<uint8_t> px(size_t(w_)*h_*4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, w_, h_, GL_RGBA, GL_UNSIGNED_BYTE, px.data());
+    return px;
+  }
+};
+
+/// Limits how many frames the CPU may queue up ahead of
+/// the GPU.
+///
+/// Call begin_frame() before issuing any commands for a
+/// frame and end_frame() after swapping buffers. A fence is
+/// inserted after every frame; begin_frame() blocks on the
+/// oldest fence once frames_in_flight() frames are pending.
+///
+/// More frames in flight mean more throughput (CPU and GPU
+/// work in parallel) at the cost of latency; one frame in
+/// flight is equivalent to a glFinish() after every frame.
+///
+/// The wait uses glClientWaitSync with a timeout, so the
+/// thread sleeps in the driver instead of spinning.
+class frame_pacer {
+public:
+  static constexpr uint max_frames_in_flight = 3;
+
+private:
+  std::array<GLsync, max_frames_in_flight> fences_{};
+  size_t oldest_ = 0, pending_ = 0;
+  uint frames_in_flight_;
+  std::chrono::nanoseconds last_wait_{0};
+
+  void wait_oldest() {
+    GLsync f = fences_[oldest_];
+
+    // Flushing is only needed on the first wait; a timeout
+    // just means the GPU is slow, so wait again
+    GLenum r = glClientWaitSync(f, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+    while (r == GL_TIMEOUT_EXPIRED)
+      r = glClientWaitSync(f, 0, 100000000);
+
+    glDeleteSync(f);
+    fences_[oldest_] = 0;
+    oldest_ = (oldest_ + 1) % max_frames_in_flight;
+    pending_--;
+  }
+
+public:
+  frame_pacer(uint frames_in_flight=2) {
+    set_frames_in_flight(frames_in_flight);
+  }
+
+  ~frame_pacer() {
+    for (GLsync f : fences_)
+      if (f) glDeleteSync(f);
+  }
+
+  frame_pacer(const frame_pacer&) = delete;
+  frame_pacer& operator =(const frame_pacer&) = delete;
+
+  uint frames_in_flight() const { return frames_in_flight_; }
+
+  /// Clamped to [1, max_frames_in_flight]; takes effect
+  /// with the next begin_frame()
+  void set_frames_in_flight(uint n) {
+    frames_in_flight_ = std::min(std::max(n, 1u), max_frames_in_flight);
+  }
+
+  /// Time the CPU spent waiting for the GPU in the last
+  /// begin_frame()
+  std::chrono::nanoseconds last_wait() const { return last_wait_; }
+
+  void begin_frame() {
+    auto t0 = std::chrono::steady_clock::now();
+    while (pending_ >= frames_in_flight_)
+      wait_oldest();
+    last_wait_ = std::chrono::steady_clock::now() - t0;
+  }
+
+  void end_frame() {
+    // Can only happen if frames_in_flight was lowered
+    // without a begin_frame()
+    if (pending_ == max_frames_in_flight) wait_oldest();
 
-		glDisableVertexAttribArray(0);
+    size_t idx = (oldest_ + pending_) % max_frames_in_flight;
+    fences_[idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pending_++;
   }
 };
 
@@ -51,13 +51,15 @@ class window {
 public:
   GLFWwindow* glfw_window;
 
+  /// Invisible windows can be used to get a GL context
+  /// for offscreen rendering
   window(const int w, const int h,
-         const std::string &title) noexcept {
+         const std::string &title, bool visible=true) noexcept {
     // TODO: Again – error handling
     glfwWindowHint(GLFW_RESIZABLE, true);
-    glfwWindowHint(GLFW_VISIBLE,   true);
-    glfwWindowHint(GLFW_FOCUSED,   true);
-    glfwWindowHint(GLFW_MAXIMIZED, true);
+    glfwWindowHint(GLFW_VISIBLE,   visible);
+    glfwWindowHint(GLFW_FOCUSED,   visible);
+    glfwWindowHint(GLFW_MAXIMIZED, visible);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
@@ -0,0 +1,108 @@
+// gapk – Asset archive packer for the asset pipeline
+//
+// Usage: gapk OUTPUT.gapk FILE...
+//        gapk -l ARCHIVE.gapk
+//
+// Packs the given files into an archive (see gapk.hh),
+// under the paths given on the command line, and checks the
+// result by parsing the written file again and looking up
+// every file. With -l, lists the contents of an archive.
+
+#include <cstdio>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+
+#include "gassist/gapk.hh"
+
+using namespace gassist;
+
+std::vector<char> read_file(const std::string &path) {
+  std::ifstream in{path, std::ios::binary};
+  if (!in)
+    throw msg_exception{"Could not open " + path};
+  std::vector<char> r{std::istreambuf_iterator<char>{in},
+                      std::istreambuf_iterator<char>{}};
+  if (!in.good() && !in.eof())
+    throw msg_exception{"Could not read " + path};
+  return r;
+}
+
+void write_file(const std::string &path, const std::vector<char> &data) {
+  std::ofstream out{path, std::ios::binary | std::ios::trunc};
+  out.write(data.data(), data.size());
+  out.close();
+  if (!out)
+    throw msg_exception{"Could not write " + path};
+}
+
+/// The path the file is stored under: "./a//b" is "a/b"
+std::string normalize_path(const std::string &p) {
+  std::string r;
+  size_t i = 0;
+  while (i < p.size()) {
+    size_t j = p.find('/', i);
+    if (j == std::string::npos) j = p.size();
+    std::string part = p.substr(i, j - i);
+    if (!part.empty() && part != ".") {
+      if (part == "..")
+        throw msg_exception{"Path leaves the asset root: " + p};
+      if (!r.empty()) r += '/';
+      r += part;
+    }
+    i = j + 1;
+  }
+  return r;
+}
+
+int list(const std::string &path) {
+  std::vector<char> buf = read_file(path);
+  gapk::view v = gapk::parse(buf.data(), buf.size());
+  v.for_each([](std::string_view name, std::string_view data) {
+    std::cout << data.size() << "\t" << name << "\n";
+  });
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " OUTPUT.gapk FILE...\n"
+              << "       " << argv[0] << " -l ARCHIVE.gapk\n";
+    return 2;
+  }
+
+  try {
+    if (std::string{argv[1]} == "-l")
+      return list(argv[2]);
+
+    std::vector<std::pair<std::string, std::vector<char>>> files;
+    size_t total = 0;
+    for (int i=2; i < argc; i++) {
+      files.emplace_back(normalize_path(argv[i]), read_file(argv[i]));
+      total += files.back().second.size();
+    }
+    write_file(argv[1], gapk::build(files));
+
+    // Round trip through the file we just wrote
+    std::vector<char> back = read_file(argv[1]);
+    gapk::view v = gapk::parse(back.data(), back.size());
+    for (auto &[name, contents] : files) {
+      auto found = v.find(name);
+      if (!found || found->size() != contents.size()
+          || std::memcmp(found->data(), contents.data(), contents.size()) != 0) {
+        std::remove(argv[1]);
+        throw msg_exception{"Round trip check failed for " + name};
+      }
+    }
+
+    std::cout << argv[1] << ": " << files.size() << " files, "
+              << total << " bytes of data, " << back.size()
+              << " bytes total\n";
+  } catch (const std::exception &e) {
+    std::cerr << argv[0] << ": " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+// gatex – Offline texture compressor for the asset pipeline
+//
+// Usage: gatex INPUT.webp OUTPUT.gatex
+//        gatex --self-test
+//
+// Decodes the input, encodes it (with a full mip chain) into
+// a BC1 texture container and checks the result by parsing
+// the written file again and comparing the decoded top
+// level against the input.
+//
+// With --self-test, round trips a set of synthetic images
+// (solid colors, gradients, sizes that are not multiples of
+// four) through the container and compares every mip level
+// against the mip chain of the input. Needs no GPU and no
+// files.
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+
+#include "webp/decode.h"
+
+#include "gassist/texcomp.hh"
+
+using namespace gassist;
+
+/// Round trips with a lower PSNR indicate an encoder bug
+/// rather than just a hard to compress image
+const double min_psnr = 20;
+
+texcomp::rgb_image read_webp(const std::string &path) {
+  std::ifstream in{path, std::ios::binary};
+  std::vector<uint8_t> buf{std::istreambuf_iterator<char>{in},
+                           std::istreambuf_iterator<char>{}};
+  if (!in.good() && !in.eof())
+    throw msg_exception{"Could not read " + path};
+
+  int w, h;
+  if (!WebPGetInfo(buf.data(), buf.size(), &w, &h))
+    throw msg_exception{"Not a webp file: " + path};
+
+  texcomp::rgb_image img(w, h);
+  if (!WebPDecodeRGBInto(buf.data(), buf.size(),
+                         img.px.data(), img.px.size(), w*3))
+    throw msg_exception{"Failed decoding " + path};
+  return img;
+}
+
+void write_file(const std::string &path, const std::vector<char> &data) {
+  std::ofstream out{path, std::ios::binary | std::ios::trunc};
+  out.write(data.data(), data.size());
+  out.close();
+  if (!out)
+    throw msg_exception{"Could not write " + path};
+}
+
+std::vector<char> read_file(const std::string &path) {
+  std::ifstream in{path, std::ios::binary};
+  return {std::istreambuf_iterator<char>{in},
+          std::istreambuf_iterator<char>{}};
+}
+
+// SELF TEST ////////////////////////
+
+/// Largest difference of any channel of any pixel
+int max_error(const texcomp::rgb_image &a, const texcomp::rgb_image &b) {
+  int r = 0;
+  for (size_t i=0; i < a.px.size(); i++)
+    r = std::max(r, std::abs(int(a.px[i]) - int(b.px[i])));
+  return r;
+}
+
+texcomp::rgb_image solid(uint32_t w, uint32_t h, uint8_t r, uint8_t g, uint8_t b) {
+  texcomp::rgb_image img{w, h};
+  for (uint32_t y=0; y < h; y++)
+    for (uint32_t x=0; x < w; x++) {
+      uint8_t *p = img.at(x, y);
+      p[0] = r; p[1] = g; p[2] = b;
+    }
+  return img;
+}
+
+/// From color a in the top left corner to b in the bottom
+/// right one; along x only if horizontal. The colors of
+/// every block lie on a line, so BC1 can represent them
+/// well at every level.
+texcomp::rgb_image gradient(uint32_t w, uint32_t h, const uint8_t (&a)[3],
+                            const uint8_t (&b)[3], bool horizontal) {
+  texcomp::rgb_image img{w, h};
+  const uint32_t len = std::max<uint32_t>(horizontal ? w - 1 : w + h - 2, 1);
+  for (uint32_t y=0; y < h; y++)
+    for (uint32_t x=0; x < w; x++) {
+      const uint32_t t = horizontal ? x : x + y;
+      for (int c=0; c < 3; c++)
+        img.at(x, y)[c] = (a[c] * (len - t) + b[c] * t) / len;
+    }
+  return img;
+}
+
+/// Encodes img into a container, parses it and compares
+/// every level against the mip chain of img. Solid colors
+/// may only be off by the 565 quantization; everything
+/// else needs a PSNR of at least min_psnr.
+bool round_trip(const char *name, const texcomp::rgb_image &img,
+                bool is_solid) {
+  // 255/31 rounded to the nearest step, plus rounding
+  const int max_solid_error = 5;
+
+  std::vector<char> enc = texcomp::encode_container(img);
+  bool ok = enc == texcomp::encode_container(img); // Deterministic
+
+  texcomp::view v = texcomp::parse(enc.data(), enc.size());
+  ok = ok && v.head->no_levels == texcomp::no_mip_levels(img.width, img.height);
+
+  double worst = std::numeric_limits<double>::max();
+  texcomp::rgb_image ref = img;
+  for (uint32_t i=0; ok && i < v.head->no_levels; i++) {
+    if (i > 0) ref = texcomp::downsample(ref);
+    const texcomp::level &l = v.levels[i];
+    if (l.width != ref.width || l.height != ref.height
+        || l.size != texcomp::bc1_size(l.width, l.height)) {
+      ok = false;
+      break;
+    }
+
+    texcomp::rgb_image dec = texcomp::decode_bc1(
+        (const uint8_t*)v.data(i), l.width, l.height);
+    double q = texcomp::psnr(ref, dec);
+    worst = std::min(worst, q);
+    ok = is_solid ? max_error(ref, dec) <= max_solid_error : q >= min_psnr;
+  }
+
+  std::cout << (ok ? "ok   " : "FAIL ") << name << " " << img.width
+            << "x" << img.height << ", " << v.head->no_levels << " levels, ";
+  if (worst == std::numeric_limits<double>::max())
+    std::cout << "lossless\n";
+  else
+    std::cout << "worst PSNR " << worst << " dB\n";
+  return ok;
+}
+
+int self_test() {
+  bool ok = true;
+  const uint32_t sizes[][2] = {{1, 1}, {4, 4}, {5, 3}, {13, 7},
+                               {1, 9}, {37, 20}, {64, 64}};
+  const uint8_t black[3] = {0, 0, 0}, white[3] = {255, 255, 255},
+                teal[3] = {20, 140, 160}, orange[3] = {240, 120, 10};
+  for (auto [w, h] : sizes) {
+    ok &= round_trip("black", solid(w, h, 0, 0, 0), true);
+    ok &= round_trip("white", solid(w, h, 255, 255, 255), true);
+    ok &= round_trip("color", solid(w, h, 200, 30, 90), true);
+    ok &= round_trip("gray ramp", gradient(w, h, black, white, true), false);
+    ok &= round_trip("color ramp", gradient(w, h, teal, orange, false), false);
+  }
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && std::string{argv[1]} == "--self-test")
+    return self_test();
+
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " INPUT.webp OUTPUT.gatex\n"
+              << "       " << argv[0] << " --self-test\n";
+    return 2;
+  }
+
+  try {
+    texcomp::rgb_image img = read_webp(argv[1]);
+    write_file(argv[2], texcomp::encode_container(img));
+
+    // Round trip through the file we just wrote
+    std::vector<char> back = read_file(argv[2]);
+    texcomp::view v = texcomp::parse(back.data(), back.size());
+    texcomp::rgb_image dec = texcomp::decode_bc1(
+        (const uint8_t*)v.data(0), v.levels[0].width, v.levels[0].height);
+    double q = texcomp::psnr(img, dec);
+
+    std::cout << argv[2] << ": " << v.head->width << "x" << v.head->height
+              << ", " << v.head->no_levels << " levels, PSNR "
+              << q << " dB\n";
+
+    if (q < min_psnr) {
+      std::remove(argv[2]);
+      throw msg_exception{"Round trip check failed; PSNR too low"};
+    }
+  } catch (const std::exception &e) {
+    std::cerr << argv[0] << ": " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}